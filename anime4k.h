@@ -1,11 +1,35 @@
 #ifndef ANIME4K_H_
 #define ANIME4K_H_
 
+/*
+ * The factor K when the new size is exactly K times the old one in both
+ * dimensions, for the K = 2, 3, 4 with specialized linear_upscale kernels;
+ * 0 otherwise.
+ */
+static inline int integer_scale(unsigned int width, unsigned int height,
+    unsigned int new_width, unsigned int new_height)
+{
+    for (unsigned int k = 2; k <= 4; k++) {
+        if (new_width == k * width && new_height == k * height) {
+            return k;
+        }
+    }
+    return 0;
+}
+
 class Anime4k {
 public:
     virtual ~Anime4k() {}
     virtual void run() = 0;
     virtual unsigned char *get_image() = 0;
+    /*
+     * Point the upscaler at a new input and output size. Buffers only
+     * grow, so a batch of differently sized images reuses the largest
+     * allocation instead of reallocating per image.
+     */
+    virtual void reconfigure(
+        unsigned int width, unsigned int height, unsigned char *image,
+        unsigned int new_width, unsigned int new_height) = 0;
 };
 
 #endif /* ANIME4K_H_ */
@@ -1,16 +1,149 @@
 #include "anime4k_cpu.h"
 
 #include "instrument.h"
+#include "ispc_instrument.h"
+#include "plane_alloc.h"
+#include "placement.h"
 #include "anime4k_kernel_task_ispc.h"
+/* per-target entry points of the multi-target build */
+#include "anime4k_kernel_task_ispc_sse4.h"
+#include "anime4k_kernel_task_ispc_avx2.h"
+#include "anime4k_kernel_task_ispc_avx512skx.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <omp.h>
 
 static inline float min(float a, float b)
 {
     return a < b ? a : b;
 }
 
+/* entry points of one ISPC target, "auto" goes through the dispatcher */
+struct ispc_task_kernels {
+    const char *name;
+    decltype(&ispc::task_linear_upscale) linear_upscale;
+    decltype(&ispc::task_thin_lines) thin_lines;
+    decltype(&ispc::task_compute_gradient) compute_gradient;
+    decltype(&ispc::task_refine) refine;
+    decltype(&ispc::task_gang_size) gang_size;
+};
+
+#define KERNELS(name, suffix) { name, \
+    ispc::task_linear_upscale##suffix, \
+    ispc::task_thin_lines##suffix, \
+    ispc::task_compute_gradient##suffix, \
+    ispc::task_refine##suffix, \
+    ispc::task_gang_size##suffix }
+
+/* __builtin_cpu_supports() only takes literals */
+static bool cpu_supports(const char *isa)
+{
+    if (strcmp(isa, "sse4") == 0) {
+        return __builtin_cpu_supports("sse4.1");
+    } else if (strcmp(isa, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    } else if (strcmp(isa, "avx512skx") == 0) {
+        return __builtin_cpu_supports("avx512f") &&
+            __builtin_cpu_supports("avx512bw") &&
+            __builtin_cpu_supports("avx512dq") &&
+            __builtin_cpu_supports("avx512vl");
+    }
+    return true;
+}
+
+static const ispc_task_kernels targets[] = {
+    KERNELS("auto", ),
+    KERNELS("sse4", _sse4),
+    KERNELS("avx2", _avx2),
+    KERNELS("avx512skx", _avx512skx),
+};
+
+static const ispc_task_kernels *find_target(const char *target)
+{
+    for (unsigned int i = 0; i < sizeof(targets) / sizeof(targets[0]); i++) {
+        if (strcasecmp(targets[i].name, target) == 0) {
+            return cpu_supports(targets[i].name) ? &targets[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Rough cost per output pixel of each stage relative to linear_upscale,
+ * and the tasks per thread wanted for load balance: the branchy
+ * thin_lines and refine rows vary a lot with the image content, the
+ * others barely at all.
+ */
+struct stage_model {
+    float cost;
+    unsigned int tasks_per_thread;
+};
+
+static const stage_model linear_model = { 1.0f, 2 };
+static const stage_model thinlines_model = { 2.5f, 8 };
+static const stage_model gradient_model = { 0.5f, 2 };
+static const stage_model refine_model = { 2.0f, 8 };
+
+/* fewer cost units per task than this and the launch overhead shows */
+#define MIN_TASK_WORK 16384
+
+/*
+ * The largest span that still gives every thread tasks_per_thread tasks,
+ * but never so small that a task does less than MIN_TASK_WORK.
+ */
+static unsigned int stage_span(const stage_model &model,
+    unsigned int width, unsigned int height, int threads)
+{
+    unsigned int tasks = threads * model.tasks_per_thread;
+    unsigned int balance = (height + tasks - 1) / tasks;
+    unsigned int row_work = width * model.cost > 1 ? width * model.cost : 1;
+    unsigned int overhead = (MIN_TASK_WORK + row_work - 1) / row_work;
+    unsigned int span = balance > overhead ? balance : overhead;
+    if (span > height) span = height;
+    return span > 0 ? span : 1;
+}
+
+/* in tasksys.cpp, built for the task system chosen by make TASKSYS= */
+extern "C" int ISPCTaskThreads();
+
+int Anime4kCpu::task_threads()
+{
+    return ISPCTaskThreads();
+}
+
+bool Anime4kCpu::has_target(const char *target)
+{
+    return find_target(target) != NULL;
+}
+
 Anime4kCpu::Anime4kCpu(
+    unsigned int width, unsigned int height, unsigned char *image,
+    unsigned int new_width, unsigned int new_height, const char *target)
+{
+    kernels_ = find_target(target);
+    if (ISPCInstrumentTarget) {
+        ISPCInstrumentTarget(kernels_->name, kernels_->gang_size());
+    }
+    int tasks = task_threads();
+    threads_ = tasks > 0 ? tasks : omp_get_max_threads();
+    memset(&override_, 0, sizeof(override_));
+    capacity_ = 0;
+    enlarge_red_ = NULL;
+    enlarge_green_ = NULL;
+    enlarge_blue_ = NULL;
+    lum1_ = NULL;
+    thinlines_red_ = NULL;
+    thinlines_green_ = NULL;
+    thinlines_blue_ = NULL;
+    lum2_ = NULL;
+    gradients_ = NULL;
+    result_ = NULL;
+
+    reconfigure(width, height, image, new_width, new_height);
+}
+
+void Anime4kCpu::reconfigure(
     unsigned int width, unsigned int height, unsigned char *image,
     unsigned int new_width, unsigned int new_height)
 {
@@ -20,86 +153,104 @@ Anime4kCpu::Anime4kCpu(
     width_ = new_width;
     height_ = new_height;
 
-    /* ghost pixels added to avoid out-of-bounds */
-    unsigned int pixels = (new_width + 2) * (new_height + 2);
+    /* borders are clamped inside the stencils, no ghost pixels needed */
+    /* the planes have padded rows, result_ stays dense RGBA */
+    stride_ = plane_stride(new_width, sizeof(plane_t));
+    unsigned int pixels = stride_ * new_height;
+
+    /* planes only grow, smaller frames use a prefix of them */
+    if (pixels > capacity_) {
+        plane_free(enlarge_red_);
+        plane_free(enlarge_green_);
+        plane_free(enlarge_blue_);
+        plane_free(lum1_);
+        plane_free(thinlines_red_);
+        plane_free(thinlines_green_);
+        plane_free(thinlines_blue_);
+        plane_free(lum2_);
+        plane_free(gradients_);
+        plane_free(result_);
 
-    enlarge_red_ = new float[pixels];
-    enlarge_green_ = new float[pixels];
-    enlarge_blue_ = new float[pixels];
+        enlarge_red_ = plane_new<plane_t>(pixels);
+        enlarge_green_ = plane_new<plane_t>(pixels);
+        enlarge_blue_ = plane_new<plane_t>(pixels);
 
-    lum1_ = new float[pixels];
+        lum1_ = plane_new<plane_t>(pixels);
 
-    thinlines_red_ = new float[pixels];
-    thinlines_green_ = new float[pixels];
-    thinlines_blue_ = new float[pixels];
+        thinlines_red_ = plane_new<plane_t>(pixels);
+        thinlines_green_ = plane_new<plane_t>(pixels);
+        thinlines_blue_ = plane_new<plane_t>(pixels);
 
-    lum2_ = new float[pixels];
+        lum2_ = plane_new<plane_t>(pixels);
 
-    gradients_ = new float[pixels];
+        gradients_ = plane_new<plane_t>(pixels);
 
-    // result does not need ghost pixels
-    result_ = new unsigned char[4 * new_width * new_height];
+        result_ = plane_new<unsigned char>(4 * pixels);
+        capacity_ = pixels;
+
+        /*
+         * Spread over the nodes in row blocks. The tasks hand out their
+         * spans dynamically, so this only evens out the placement.
+         */
+        plane_t *planes[] = {
+            enlarge_red_, enlarge_green_, enlarge_blue_, lum1_,
+            thinlines_red_, thinlines_green_, thinlines_blue_, lum2_,
+            gradients_
+        };
+        for (unsigned int k = 0; k < sizeof(planes) / sizeof(planes[0]); k++) {
+            first_touch_rows(planes[k], stride_ * sizeof(plane_t), new_height);
+        }
+        first_touch_rows(result_, 4 * new_width, new_height);
+    }
 
     strength_thinlines_ =
         min((float)new_width / width / 6, 1.0f);
     strength_refine_ =
         min((float)new_width / width / 2, 1.0f);
+
+    pick_spans();
 }
 
-static void extend(float *buf, unsigned int width, unsigned int height)
+void Anime4kCpu::set_spans(const task_spans &spans)
 {
-    unsigned int new_width = width + 2;
-
-    for (unsigned int i = 1; i <= height; i++) {
-        /* left */
-        int left = i * new_width;
-        buf[left] = buf[left + 1];
-
-        /* right */
-        int right = i * new_width + width;
-        buf[right + 1] = buf[right];
-    }
-
-    for (unsigned int i = 0; i < new_width; i++) {
-        /* top */
-        buf[i] = buf[i + new_width];
+    override_ = spans;
+    pick_spans();
+}
 
-        /* bottom */
-        int bottom_from = height * new_width + i;
-        int bottom_to = bottom_from + new_width;
-        buf[bottom_to] = buf[bottom_from];
-    }
+void Anime4kCpu::pick_spans()
+{
+    spans_.linear = override_.linear ? override_.linear :
+        stage_span(linear_model, width_, height_, threads_);
+    spans_.thinlines = override_.thinlines ? override_.thinlines :
+        stage_span(thinlines_model, width_, height_, threads_);
+    spans_.gradient = override_.gradient ? override_.gradient :
+        stage_span(gradient_model, width_, height_, threads_);
+    spans_.refine = override_.refine ? override_.refine :
+        stage_span(refine_model, width_, height_, threads_);
 }
 
 void Anime4kCpu::run()
 {
     START_ACTIVITY(ACTIVITY_LINEAR);
-    ispc::task_linear_upscale(old_width_, old_height_, (int *)image_,
-        width_, height_,
+    kernels_->linear_upscale(spans_.linear,
+        old_width_, old_height_, (int *)image_, width_, height_, stride_,
         enlarge_red_, enlarge_green_, enlarge_blue_, lum1_);
-    extend(enlarge_red_, width_, height_);
-    extend(enlarge_green_, width_, height_);
-    extend(enlarge_blue_, width_, height_);
-    extend(lum1_, width_, height_);
     FINISH_ACTIVITY(ACTIVITY_LINEAR);
 
     START_ACTIVITY(ACTIVITY_THINLINES);
-    ispc::task_thin_lines(strength_thinlines_, width_, height_,
+    kernels_->thin_lines(spans_.thinlines, strength_thinlines_,
+        width_, height_, stride_,
         enlarge_red_, enlarge_green_, enlarge_blue_, lum1_,
         thinlines_red_, thinlines_green_, thinlines_blue_, lum2_);
-    extend(thinlines_red_, width_, height_);
-    extend(thinlines_green_, width_, height_);
-    extend(thinlines_blue_, width_, height_);
-    extend(lum2_, width_, height_);
     FINISH_ACTIVITY(ACTIVITY_THINLINES);
 
     START_ACTIVITY(ACTIVITY_GRADIENT);
-    ispc::task_compute_gradient(width_, height_, lum2_, gradients_);
-    extend(gradients_, width_, height_);
+    kernels_->compute_gradient(spans_.gradient, width_, height_, stride_,
+        lum2_, gradients_);
     FINISH_ACTIVITY(ACTIVITY_GRADIENT);
 
     START_ACTIVITY(ACTIVITY_REFINE);
-    ispc::task_refine(strength_refine_, width_, height_,
+    kernels_->refine(spans_.refine, strength_refine_, width_, height_, stride_,
         thinlines_red_, thinlines_green_, thinlines_blue_,
         gradients_, (int *)result_);
     FINISH_ACTIVITY(ACTIVITY_REFINE);
@@ -107,14 +258,14 @@ void Anime4kCpu::run()
 
 Anime4kCpu::~Anime4kCpu()
 {
-    delete [] enlarge_red_;
-    delete [] enlarge_green_;
-    delete [] enlarge_blue_;
-    delete [] lum1_;
-    delete [] thinlines_red_;
-    delete [] thinlines_green_;
-    delete [] thinlines_blue_;
-    delete [] lum2_;
-    delete [] gradients_;
-    delete [] result_;
+    plane_free(enlarge_red_);
+    plane_free(enlarge_green_);
+    plane_free(enlarge_blue_);
+    plane_free(lum1_);
+    plane_free(thinlines_red_);
+    plane_free(thinlines_green_);
+    plane_free(thinlines_blue_);
+    plane_free(lum2_);
+    plane_free(gradients_);
+    plane_free(result_);
 }
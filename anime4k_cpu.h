@@ -2,6 +2,18 @@
 #define ANIME4K_CPU_H_
 
 #include "anime4k.h"
+#include "anime4k_plane.h"
+
+/* kernels of one ISPC target, see has_target() */
+struct ispc_task_kernels;
+
+/* rows per ISPC task of each stage, 0 leaves the choice to the cost model */
+struct task_spans {
+    unsigned int linear;
+    unsigned int thinlines;
+    unsigned int gradient;
+    unsigned int refine;
+};
 
 class Anime4kCpu : public Anime4k {
 private:
@@ -10,25 +22,47 @@ private:
     unsigned char *image_;
     unsigned int width_;
     unsigned int height_;
-    float *enlarge_red_;
-    float *enlarge_green_;
-    float *enlarge_blue_;
-    float *lum1_;
-    float *thinlines_red_;
-    float *thinlines_green_;
-    float *thinlines_blue_;
-    float *lum2_;
-    float *gradients_;
+    /* elements per row of the output-size planes, see plane_stride() */
+    unsigned int stride_;
+    unsigned int capacity_;
+    plane_t *enlarge_red_;
+    plane_t *enlarge_green_;
+    plane_t *enlarge_blue_;
+    plane_t *lum1_;
+    plane_t *thinlines_red_;
+    plane_t *thinlines_green_;
+    plane_t *thinlines_blue_;
+    plane_t *lum2_;
+    plane_t *gradients_;
     unsigned char *result_;
+    const ispc_task_kernels *kernels_;
     float strength_thinlines_;
     float strength_refine_;
+    int threads_;
+    task_spans override_;
+    task_spans spans_;
+    void pick_spans();
 public:
     Anime4kCpu(
         unsigned int width, unsigned int height, unsigned char *image,
-        unsigned int new_width, unsigned int new_height);
+        unsigned int new_width, unsigned int new_height,
+        const char *target = "auto");
     virtual ~Anime4kCpu();
     void run();
     unsigned char *get_image() { return result_; }
+    void reconfigure(
+        unsigned int width, unsigned int height, unsigned char *image,
+        unsigned int new_width, unsigned int new_height);
+    /* fix the spans of the stages that are non-zero in spans */
+    void set_spans(const task_spans &spans);
+    const task_spans &get_spans() const { return spans_; }
+    /* target is "auto", "sse4", "avx2" or "avx512skx" */
+    static bool has_target(const char *target);
+    /*
+     * Threads the tasks run on, fixed by the task system when it starts;
+     * 0 with the OpenMP one, which follows omp_set_num_threads()
+     */
+    static int task_threads();
 };
 
 #endif /* ANIME4K_CPU_H_ */
@@ -1,5 +1,6 @@
 #include "anime4k_cuda.h"
 #include "instrument.h"
+#include "plane_alloc.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,6 +22,19 @@ __global__ void kernel(unsigned char *src, unsigned char *dst);
 Anime4kCuda::Anime4kCuda(
     unsigned int width, unsigned int height, unsigned char *image,
     unsigned int new_width, unsigned int new_height)
+{
+    src_capacity_ = 0;
+    dst_capacity_ = 0;
+    result_ = NULL;
+    cudaImage = NULL;
+    cudaResult = NULL;
+
+    reconfigure(width, height, image, new_width, new_height);
+}
+
+void Anime4kCuda::reconfigure(
+    unsigned int width, unsigned int height, unsigned char *image,
+    unsigned int new_width, unsigned int new_height)
 {
     param.src_width = width;
     param.src_height = height;
@@ -31,10 +45,20 @@ Anime4kCuda::Anime4kCuda(
     param.strength_preprocessing = min((float)new_width / width / 6.0f, 1.0f);
     param.strength_push = min((float)new_width / width / 2.0f, 1.0f);
     image_ = image;
-    result_ = new unsigned char[param.dst_bytes];
 
-    cudaMalloc(&cudaImage, param.src_bytes);
-    cudaMalloc(&cudaResult, param.dst_bytes);
+    // device and host buffers only grow
+    if (param.src_bytes > src_capacity_) {
+        cudaFree(cudaImage);
+        cudaMalloc(&cudaImage, param.src_bytes);
+        src_capacity_ = param.src_bytes;
+    }
+    if (param.dst_bytes > dst_capacity_) {
+        plane_free(result_);
+        result_ = plane_new<unsigned char>(param.dst_bytes);
+        cudaFree(cudaResult);
+        cudaMalloc(&cudaResult, param.dst_bytes);
+        dst_capacity_ = param.dst_bytes;
+    }
     cudaMemcpyToSymbol(cudaParam, &param, sizeof(Param));
 }
 
@@ -50,7 +74,7 @@ void Anime4kCuda::run()
 
 Anime4kCuda::~Anime4kCuda()
 {
-    delete [] result_;
+    plane_free(result_);
     cudaFree(cudaImage);
     cudaFree(cudaResult);
 }
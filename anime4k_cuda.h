@@ -19,6 +19,8 @@ private:
     Param param;
     unsigned char *image_;
     unsigned char *result_;
+    unsigned int src_capacity_;
+    unsigned int dst_capacity_;
 
 public:
     Anime4kCuda(
@@ -27,6 +29,9 @@ public:
     virtual ~Anime4kCuda();
     void run();
     unsigned char *get_image() { return result_; }
+    void reconfigure(
+        unsigned int width, unsigned int height, unsigned char *image,
+        unsigned int new_width, unsigned int new_height);
 };
 
 #endif /* ANIME4K_SEQ_H_ */
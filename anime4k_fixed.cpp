@@ -0,0 +1,636 @@
+#include "anime4k_fixed.h"
+
+#include "instrument.h"
+#include "plane_alloc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <immintrin.h>
+
+/* 1.0 in the fixed point format, 8-bit value with 6 fractional bits */
+#define ONE (255 << 6)
+/* int16 lanes per AVX2 register */
+#define LANES 16
+
+static inline float min(float a, float b)
+{
+    return a < b ? a : b;
+}
+
+/* strengths are applied with _mm256_mulhrs_epi16, i.e. in Q15 */
+static inline int16_t to_q15(float x)
+{
+    int q = (int)(x * 32768 + 0.5f);
+    return q > 32767 ? 32767 : q;
+}
+
+Anime4kFixed::Anime4kFixed(
+    unsigned int width, unsigned int height, unsigned char *image,
+    unsigned int new_width, unsigned int new_height)
+{
+    capacity_ = 0;
+    column_capacity_ = 0;
+    enlarge_red_ = NULL;
+    enlarge_green_ = NULL;
+    enlarge_blue_ = NULL;
+    lum1_ = NULL;
+    thinlines_red_ = NULL;
+    thinlines_green_ = NULL;
+    thinlines_blue_ = NULL;
+    lum2_ = NULL;
+    gradients_ = NULL;
+    column_left_ = NULL;
+    column_right_ = NULL;
+    column_weight_ = NULL;
+    result_ = NULL;
+
+    reconfigure(width, height, image, new_width, new_height);
+}
+
+void Anime4kFixed::reconfigure(
+    unsigned int width, unsigned int height, unsigned char *image,
+    unsigned int new_width, unsigned int new_height)
+{
+    old_width_ = width;
+    old_height_ = height;
+    image_ = image;
+    width_ = new_width;
+    height_ = new_height;
+
+    /* the planes have padded rows, result_ stays dense RGBA */
+    stride_ = plane_stride(new_width, sizeof(int16_t));
+    unsigned int pixels = stride_ * new_height;
+
+    /* planes and tables only grow, smaller frames use a prefix of them */
+    if (pixels > capacity_) {
+        plane_free(enlarge_red_);
+        plane_free(enlarge_green_);
+        plane_free(enlarge_blue_);
+        plane_free(lum1_);
+        plane_free(thinlines_red_);
+        plane_free(thinlines_green_);
+        plane_free(thinlines_blue_);
+        plane_free(lum2_);
+        plane_free(gradients_);
+        plane_free(result_);
+
+        enlarge_red_ = plane_new<int16_t>(pixels);
+        enlarge_green_ = plane_new<int16_t>(pixels);
+        enlarge_blue_ = plane_new<int16_t>(pixels);
+
+        lum1_ = plane_new<int16_t>(pixels);
+
+        thinlines_red_ = plane_new<int16_t>(pixels);
+        thinlines_green_ = plane_new<int16_t>(pixels);
+        thinlines_blue_ = plane_new<int16_t>(pixels);
+
+        lum2_ = plane_new<int16_t>(pixels);
+
+        gradients_ = plane_new<int16_t>(pixels);
+
+        result_ = plane_new<unsigned char>(4 * pixels);
+        capacity_ = pixels;
+    }
+
+    if (new_width > column_capacity_) {
+        delete [] column_left_;
+        delete [] column_right_;
+        delete [] column_weight_;
+
+        column_left_ = new int[new_width];
+        column_right_ = new int[new_width];
+        column_weight_ = new int[new_width];
+        column_capacity_ = new_width;
+    }
+
+    int maxw = width - 1;
+    for (unsigned int j = 0; j < new_width; j++) {
+        float y = (float)(j * width) / new_width;
+        float floor_y = floor(y);
+        int wl = (int)floor_y;
+        column_left_[j] = wl;
+        column_right_[j] = wl < maxw ? wl + 1 : maxw;
+        column_weight_[j] = (int)((y - floor_y) * 256 + 0.5f);
+    }
+
+    strength_thinlines_ =
+        to_q15(min((float)new_width / width / 6, 1.0f));
+    strength_refine_ =
+        to_q15(min((float)new_width / width / 2, 1.0f));
+}
+
+static void linear_upscale(
+    unsigned int old_width, unsigned int old_height, unsigned char *src,
+    unsigned int width, unsigned int height, unsigned int stride,
+    const int *column_left, const int *column_right, const int *column_weight,
+    int16_t *red, int16_t *green, int16_t *blue, int16_t *lum)
+{
+    START_ACTIVITY(ACTIVITY_LINEAR);
+
+    int maxh = old_height - 1;
+
+    #pragma omp parallel for schedule(static)
+    for (unsigned int i = 0; i < height; i++) {
+        float x = (float)(i * old_height) / height;
+        float floor_x = floor(x);
+        int ht = (int)floor_x;
+        int hb = ht < maxh ? ht + 1 : maxh;
+        int f = (int)((x - floor_x) * 256 + 0.5f);
+
+        unsigned char *top = src + 4 * ht * old_width;
+        unsigned char *bottom = src + 4 * hb * old_width;
+        int row = i * stride;
+
+        for (unsigned int j = 0; j < width; j++) {
+            int wl = 4 * column_left[j];
+            int wr = 4 * column_right[j];
+            int g = column_weight[j];
+            int color[3];
+
+            for (int c = 0; c < 3; c++) {
+                int l = top[wl + c] * (256 - f) + bottom[wl + c] * f;
+                int r = top[wr + c] * (256 - f) + bottom[wr + c] * f;
+                /* 16 fractional bits down to 6 */
+                color[c] = (l * (256 - g) + r * g + 512) >> 10;
+            }
+
+            red[row + j] = color[0];
+            green[row + j] = color[1];
+            blue[row + j] = color[2];
+            lum[row + j] = (color[0] * 2 + color[1] * 3 + color[2] + 3) / 6;
+        }
+    }
+
+    FINISH_ACTIVITY(ACTIVITY_LINEAR);
+}
+
+/* three rows of one plane, each pointing at the first pixel of a block */
+struct rows3 {
+    const int16_t *t;
+    const int16_t *c;
+    const int16_t *b;
+};
+
+/* positions in a 3x3 neighbourhood */
+enum { TL, T, TR, L, CC, R, BL, B, BR };
+
+/* neighbours averaged by patterns 0, 4, 1, 5, 2, 6, 3 and 7 */
+static const int pattern[8][3] = {
+    { TL, T, TR }, { BR, B, BL },
+    { R, T, TR }, { BL, L, B },
+    { R, BR, TR }, { L, TL, BL },
+    { R, BR, B }, { T, L, TL },
+};
+
+static inline __m256i load(const int16_t *p)
+{
+    return _mm256_loadu_si256((const __m256i *)p);
+}
+
+static inline void load_stencil(__m256i v[9], const rows3 &p)
+{
+    v[TL] = load(p.t - 1);
+    v[T] = load(p.t);
+    v[TR] = load(p.t + 1);
+    v[L] = load(p.c - 1);
+    v[CC] = load(p.c);
+    v[R] = load(p.c + 1);
+    v[BL] = load(p.b - 1);
+    v[B] = load(p.b);
+    v[BR] = load(p.b + 1);
+}
+
+static inline __m256i min3v(__m256i a, __m256i b, __m256i c)
+{
+    return _mm256_min_epi16(_mm256_min_epi16(a, b), c);
+}
+
+static inline __m256i max3v(__m256i a, __m256i b, __m256i c)
+{
+    return _mm256_max_epi16(_mm256_max_epi16(a, b), c);
+}
+
+/* mask ? a : b */
+static inline __m256i select(__m256i mask, __m256i a, __m256i b)
+{
+    return _mm256_blendv_epi8(b, a, mask);
+}
+
+/* (a + b + c) / 3, the sum of three values up to ONE fits in uint16 */
+static inline __m256i avg3(__m256i a, __m256i b, __m256i c)
+{
+    __m256i sum = _mm256_add_epi16(_mm256_add_epi16(a, b), c);
+    return _mm256_mulhi_epu16(sum, _mm256_set1_epi16(21846));
+}
+
+/* cc * (1 - strength) + avg * strength */
+static inline __m256i mix(__m256i strength, __m256i cc, __m256i avg)
+{
+    return _mm256_add_epi16(cc,
+        _mm256_mulhrs_epi16(_mm256_sub_epi16(avg, cc), strength));
+}
+
+/* (red * 2 + green * 3 + blue) / 6 without leaving 16 bits */
+static inline __m256i luminance(__m256i red, __m256i green, __m256i blue)
+{
+    return _mm256_add_epi16(
+        _mm256_add_epi16(
+            _mm256_mulhrs_epi16(red, _mm256_set1_epi16(10923)),
+            _mm256_mulhrs_epi16(green, _mm256_set1_epi16(16384))),
+        _mm256_mulhrs_epi16(blue, _mm256_set1_epi16(5461)));
+}
+
+/* minLight > maxDark, and optionally minLight > cc */
+static inline __m256i light(__m256i minLight, __m256i maxDark, __m256i cc)
+{
+    return _mm256_and_si256(_mm256_cmpgt_epi16(minLight, maxDark),
+        _mm256_cmpgt_epi16(minLight, cc));
+}
+
+/* lane masks of patterns 0, 4, 1, 5, 2, 6, 3 and 7 */
+static inline void pattern_masks(const __m256i v[9], __m256i mask[8])
+{
+    __m256i top_min = min3v(v[TL], v[T], v[TR]);
+    __m256i top_max = max3v(v[TL], v[T], v[TR]);
+    __m256i bottom_min = min3v(v[BR], v[B], v[BL]);
+    __m256i bottom_max = max3v(v[BR], v[B], v[BL]);
+    __m256i left_min = min3v(v[L], v[TL], v[BL]);
+    __m256i left_max = max3v(v[L], v[TL], v[BL]);
+    __m256i right_min = min3v(v[R], v[BR], v[TR]);
+    __m256i right_max = max3v(v[R], v[BR], v[TR]);
+
+    /* pattern 0 and 4 */
+    mask[0] = light(top_min, bottom_max, v[CC]);
+    mask[1] = light(bottom_min, top_max, v[CC]);
+
+    /* pattern 1 and 5 */
+    mask[2] = _mm256_cmpgt_epi16(min3v(v[R], v[T], v[TR]),
+        max3v(v[CC], v[L], v[B]));
+    mask[3] = _mm256_cmpgt_epi16(min3v(v[BL], v[L], v[B]),
+        max3v(v[CC], v[R], v[T]));
+
+    /* pattern 2 and 6 */
+    mask[4] = light(right_min, left_max, v[CC]);
+    mask[5] = light(left_min, right_max, v[CC]);
+
+    /* pattern 3 and 7 */
+    mask[6] = _mm256_cmpgt_epi16(min3v(v[R], v[BR], v[B]),
+        max3v(v[CC], v[L], v[T]));
+    mask[7] = _mm256_cmpgt_epi16(min3v(v[T], v[L], v[TL]),
+        max3v(v[CC], v[R], v[B]));
+}
+
+/* average of the three neighbours of pattern a where first is set, else b */
+static inline __m256i pattern_avg(const __m256i v[9], __m256i first,
+    const int a[3], const int b[3])
+{
+    return avg3(select(first, v[a[0]], v[b[0]]),
+        select(first, v[a[1]], v[b[1]]),
+        select(first, v[a[2]], v[b[2]]));
+}
+
+/* planes are ordered lum, red, green, blue */
+static inline void thin_lines_block(__m256i strength,
+    const rows3 src[4], int16_t *const dst[4])
+{
+    __m256i v[4][9];
+    for (int k = 0; k < 4; k++) {
+        load_stencil(v[k], src[k]);
+    }
+
+    __m256i mask[8];
+    pattern_masks(v[0], mask);
+
+    __m256i color[4];
+    for (int k = 0; k < 4; k++) {
+        color[k] = v[k][CC];
+    }
+
+    for (int g = 0; g < 4; g++) {
+        /* the second pattern of a pair is only tried if the first fails */
+        __m256i first = mask[2 * g];
+        __m256i take = _mm256_or_si256(first,
+            _mm256_andnot_si256(first, mask[2 * g + 1]));
+        if (_mm256_testz_si256(take, take)) {
+            continue;
+        }
+
+        const int *a = pattern[2 * g];
+        const int *b = pattern[2 * g + 1];
+
+        __m256i new_lum = mix(strength, v[0][CC],
+            pattern_avg(v[0], first, a, b));
+        __m256i update = _mm256_and_si256(take,
+            _mm256_cmpgt_epi16(new_lum, color[0]));
+
+        color[0] = select(update, new_lum, color[0]);
+        for (int k = 1; k < 4; k++) {
+            color[k] = select(update, mix(strength, v[k][CC],
+                pattern_avg(v[k], first, a, b)), color[k]);
+        }
+    }
+
+    _mm256_storeu_si256((__m256i *)dst[0],
+        luminance(color[1], color[2], color[3]));
+    for (int k = 1; k < 4; k++) {
+        _mm256_storeu_si256((__m256i *)dst[k], color[k]);
+    }
+}
+
+static inline __m256i half(__m256i x, int h)
+{
+    return _mm256_cvtepi16_epi32(h ? _mm256_extracti128_si256(x, 1) :
+        _mm256_castsi256_si128(x));
+}
+
+static inline void gradient_block(const rows3 &src, int16_t *dst)
+{
+    __m256i v[9];
+    load_stencil(v, src);
+
+    __m256 one = _mm256_set1_ps(ONE);
+    __m256i res[2];
+
+    for (int h = 0; h < 2; h++) {
+        __m256i tl = half(v[TL], h), t = half(v[T], h), tr = half(v[TR], h);
+        __m256i l = half(v[L], h), r = half(v[R], h);
+        __m256i bl = half(v[BL], h), b = half(v[B], h), br = half(v[BR], h);
+
+        /* Horizontal Gradient
+         * [-1  0  1]
+         * [-2  0  2]
+         * [-1  0  1]
+         */
+        __m256i xgrad = _mm256_add_epi32(
+            _mm256_add_epi32(_mm256_sub_epi32(tr, tl), _mm256_sub_epi32(br, bl)),
+            _mm256_slli_epi32(_mm256_sub_epi32(r, l), 1));
+
+        /* Vertical Gradient
+         * [-1 -2 -1]
+         * [ 0  0  0]
+         * [ 1  2  1]
+         */
+        __m256i ygrad = _mm256_add_epi32(
+            _mm256_add_epi32(_mm256_sub_epi32(bl, tl), _mm256_sub_epi32(br, tr)),
+            _mm256_slli_epi32(_mm256_sub_epi32(b, t), 1));
+
+        __m256 x = _mm256_cvtepi32_ps(xgrad);
+        __m256 y = _mm256_cvtepi32_ps(ygrad);
+        __m256 norm = _mm256_sqrt_ps(
+            _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)));
+
+        res[h] = _mm256_cvtps_epi32(
+            _mm256_sub_ps(one, _mm256_min_ps(norm, one)));
+    }
+
+    /* packs works per 128-bit lane, put the quarters back in order */
+    __m256i packed = _mm256_packs_epi32(res[0], res[1]);
+    _mm256_storeu_si256((__m256i *)dst,
+        _mm256_permute4x64_epi64(packed, 0xD8));
+}
+
+/* planes of image are ordered red, green, blue */
+static inline void refine_block(__m256i strength, const rows3 &gradients,
+    const rows3 image[3], uint32_t *dst)
+{
+    __m256i grad[9];
+    load_stencil(grad, gradients);
+
+    __m256i mask[8];
+    pattern_masks(grad, mask);
+
+    __m256i v[3][9];
+    for (int k = 0; k < 3; k++) {
+        load_stencil(v[k], image[k]);
+    }
+
+    /* the first matching pattern wins */
+    __m256i done = _mm256_setzero_si256();
+    __m256i n[3][3];
+    for (int k = 0; k < 3; k++) {
+        n[k][0] = n[k][1] = n[k][2] = v[k][CC];
+    }
+
+    for (int p = 0; p < 8; p++) {
+        __m256i m = _mm256_andnot_si256(done, mask[p]);
+        done = _mm256_or_si256(done, m);
+        for (int k = 0; k < 3; k++) {
+            for (int t = 0; t < 3; t++) {
+                n[k][t] = select(m, v[k][pattern[p][t]], n[k][t]);
+            }
+        }
+    }
+
+    __m256i color[3];
+    for (int k = 0; k < 3; k++) {
+        __m256i avg = mix(strength, v[k][CC], avg3(n[k][0], n[k][1], n[k][2]));
+        /* quantize, the fractional bits are truncated */
+        color[k] = _mm256_srli_epi16(select(done, avg, v[k][CC]), 6);
+    }
+
+    __m256i alpha = _mm256_set1_epi16((short)0xFF00);
+    __m256i rg = _mm256_or_si256(color[0], _mm256_slli_epi16(color[1], 8));
+    __m256i ba = _mm256_or_si256(color[2], alpha);
+    __m256i lo = _mm256_unpacklo_epi16(rg, ba);
+    __m256i hi = _mm256_unpackhi_epi16(rg, ba);
+
+    /* unpack works per 128-bit lane: lo holds pixels 0-3 and 8-11 */
+    _mm256_storeu_si256((__m256i *)dst, _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+/*
+ * Copy columns j - 1 .. j + LANES of a row into buf with clamped borders,
+ * so the blocks on the image border can use the interior code path.
+ */
+static inline const int16_t *edge_row(int16_t *buf, const int16_t *row,
+    int j, int width)
+{
+    for (int k = 0; k < LANES + 2; k++) {
+        int c = j + k - 1;
+        buf[k] = row[c < 0 ? 0 : (c >= width ? width - 1 : c)];
+    }
+    return buf + 1;
+}
+
+static inline rows3 block_rows(const int16_t *plane, int ix, int up, int down)
+{
+    rows3 p;
+    p.t = plane + ix + up;
+    p.c = plane + ix;
+    p.b = plane + ix + down;
+    return p;
+}
+
+static inline rows3 edge_rows(int16_t buf[3][LANES + 2], const int16_t *plane,
+    int row, int up, int down, int j, int width)
+{
+    rows3 p;
+    p.t = edge_row(buf[0], plane + row + up, j, width);
+    p.c = edge_row(buf[1], plane + row, j, width);
+    p.b = edge_row(buf[2], plane + row + down, j, width);
+    return p;
+}
+
+static void thin_lines(int16_t strength, unsigned int width, unsigned int height,
+    unsigned int stride,
+    int16_t *red, int16_t *green, int16_t *blue, int16_t *lum,
+    int16_t *dst_red, int16_t *dst_green, int16_t *dst_blue, int16_t *dst_lum)
+{
+    START_ACTIVITY(ACTIVITY_THINLINES);
+
+    __m256i s = _mm256_set1_epi16(strength);
+    const int16_t *src[4] = { lum, red, green, blue };
+    int16_t *dst[4] = { dst_lum, dst_red, dst_green, dst_blue };
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned int i = 0; i < height; i++) {
+        int row = i * stride;
+        int up = i > 0 ? -(int)stride : 0;
+        int down = i + 1 < height ? (int)stride : 0;
+        rows3 p[4];
+        int16_t *out[4];
+
+        /* interior blocks */
+        int j = 1;
+        for (; j + LANES < (int)width; j += LANES) {
+            for (int k = 0; k < 4; k++) {
+                p[k] = block_rows(src[k], row + j, up, down);
+                out[k] = dst[k] + row + j;
+            }
+            thin_lines_block(s, p, out);
+        }
+
+        /* left column and the remaining columns, clamped */
+        int16_t buf[4][3][LANES + 2];
+        int16_t res[4][LANES];
+        for (int k = 0; k < 4; k++) {
+            out[k] = res[k];
+        }
+
+        for (int e = 0; e < (int)width; e = e ? e + LANES : j) {
+            int count = e ? (int)width - e : 1;
+            count = count < LANES ? count : LANES;
+            for (int k = 0; k < 4; k++) {
+                p[k] = edge_rows(buf[k], src[k], row, up, down, e, width);
+            }
+            thin_lines_block(s, p, out);
+            for (int k = 0; k < 4; k++) {
+                memcpy(dst[k] + row + e, res[k], count * sizeof(int16_t));
+            }
+        }
+    }
+
+    FINISH_ACTIVITY(ACTIVITY_THINLINES);
+}
+
+static void compute_gradient(unsigned int width, unsigned int height,
+    unsigned int stride, int16_t *src, int16_t *dst)
+{
+    START_ACTIVITY(ACTIVITY_GRADIENT);
+
+    #pragma omp parallel for schedule(static)
+    for (unsigned int i = 0; i < height; i++) {
+        int row = i * stride;
+        int up = i > 0 ? -(int)stride : 0;
+        int down = i + 1 < height ? (int)stride : 0;
+
+        /* interior blocks */
+        int j = 1;
+        for (; j + LANES < (int)width; j += LANES) {
+            gradient_block(block_rows(src, row + j, up, down), dst + row + j);
+        }
+
+        /* left column and the remaining columns, clamped */
+        int16_t buf[3][LANES + 2];
+        int16_t res[LANES];
+
+        for (int e = 0; e < (int)width; e = e ? e + LANES : j) {
+            int count = e ? (int)width - e : 1;
+            count = count < LANES ? count : LANES;
+            gradient_block(edge_rows(buf, src, row, up, down, e, width), res);
+            memcpy(dst + row + e, res, count * sizeof(int16_t));
+        }
+    }
+
+    FINISH_ACTIVITY(ACTIVITY_GRADIENT);
+}
+
+static void refine(int16_t strength, unsigned int width, unsigned int height,
+    unsigned int stride,
+    int16_t *red, int16_t *green, int16_t *blue, int16_t *gradients,
+    uint32_t *dst)
+{
+    START_ACTIVITY(ACTIVITY_REFINE);
+
+    __m256i s = _mm256_set1_epi16(strength);
+    const int16_t *image[3] = { red, green, blue };
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned int i = 0; i < height; i++) {
+        int row = i * stride;
+        int out = i * width;
+        int up = i > 0 ? -(int)stride : 0;
+        int down = i + 1 < height ? (int)stride : 0;
+        rows3 p[3];
+
+        /* interior blocks */
+        int j = 1;
+        for (; j + LANES < (int)width; j += LANES) {
+            for (int k = 0; k < 3; k++) {
+                p[k] = block_rows(image[k], row + j, up, down);
+            }
+            refine_block(s, block_rows(gradients, row + j, up, down),
+                p, dst + out + j);
+        }
+
+        /* left column and the remaining columns, clamped */
+        int16_t buf[4][3][LANES + 2];
+        uint32_t res[LANES];
+
+        for (int e = 0; e < (int)width; e = e ? e + LANES : j) {
+            int count = e ? (int)width - e : 1;
+            count = count < LANES ? count : LANES;
+            for (int k = 0; k < 3; k++) {
+                p[k] = edge_rows(buf[k], image[k], row, up, down, e, width);
+            }
+            refine_block(s,
+                edge_rows(buf[3], gradients, row, up, down, e, width), p, res);
+            memcpy(dst + out + e, res, count * sizeof(uint32_t));
+        }
+    }
+
+    FINISH_ACTIVITY(ACTIVITY_REFINE);
+}
+
+void Anime4kFixed::run()
+{
+    linear_upscale(old_width_, old_height_, image_, width_, height_, stride_,
+        column_left_, column_right_, column_weight_,
+        enlarge_red_, enlarge_green_, enlarge_blue_, lum1_);
+    thin_lines(strength_thinlines_, width_, height_, stride_,
+        enlarge_red_, enlarge_green_, enlarge_blue_, lum1_,
+        thinlines_red_, thinlines_green_, thinlines_blue_, lum2_);
+    compute_gradient(width_, height_, stride_, lum2_, gradients_);
+    refine(strength_refine_, width_, height_, stride_,
+        thinlines_red_, thinlines_green_, thinlines_blue_,
+        gradients_, (uint32_t *)result_);
+}
+
+Anime4kFixed::~Anime4kFixed()
+{
+    plane_free(enlarge_red_);
+    plane_free(enlarge_green_);
+    plane_free(enlarge_blue_);
+    plane_free(lum1_);
+    plane_free(thinlines_red_);
+    plane_free(thinlines_green_);
+    plane_free(thinlines_blue_);
+    plane_free(lum2_);
+    plane_free(gradients_);
+    delete [] column_left_;
+    delete [] column_right_;
+    delete [] column_weight_;
+    plane_free(result_);
+}
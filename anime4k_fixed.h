@@ -0,0 +1,52 @@
+#ifndef ANIME4K_FIXED_H_
+#define ANIME4K_FIXED_H_
+
+#include "anime4k.h"
+
+#include <stdint.h>
+
+/*
+ * Fixed point CPU backend: all intermediates are int16 holding the 8-bit
+ * channel value with 6 fractional bits (1.0 == 255 << 6), so the pattern
+ * comparisons of thin_lines and refine run 16 lanes per AVX2 register.
+ */
+class Anime4kFixed : public Anime4k {
+private:
+    unsigned int old_width_;
+    unsigned int old_height_;
+    unsigned char *image_;
+    unsigned int width_;
+    unsigned int height_;
+    /* int16s per row of the planes, see plane_stride() */
+    unsigned int stride_;
+    unsigned int capacity_;
+    unsigned int column_capacity_;
+    int16_t *enlarge_red_;
+    int16_t *enlarge_green_;
+    int16_t *enlarge_blue_;
+    int16_t *lum1_;
+    int16_t *thinlines_red_;
+    int16_t *thinlines_green_;
+    int16_t *thinlines_blue_;
+    int16_t *lum2_;
+    int16_t *gradients_;
+    /* per output column source taps and weight of linear_upscale */
+    int *column_left_;
+    int *column_right_;
+    int *column_weight_;
+    unsigned char *result_;
+    int16_t strength_thinlines_;
+    int16_t strength_refine_;
+public:
+    Anime4kFixed(
+        unsigned int width, unsigned int height, unsigned char *image,
+        unsigned int new_width, unsigned int new_height);
+    virtual ~Anime4kFixed();
+    void run();
+    unsigned char *get_image() { return result_; }
+    void reconfigure(
+        unsigned int width, unsigned int height, unsigned char *image,
+        unsigned int new_width, unsigned int new_height);
+};
+
+#endif /* ANIME4K_FIXED_H_ */
@@ -1,16 +1,109 @@
 #include "anime4k_ispc.h"
 
 #include "instrument.h"
+#include "ispc_instrument.h"
+#include "plane_alloc.h"
 #include "anime4k_kernel_ispc.h"
+/* per-target entry points of the multi-target build */
+#include "anime4k_kernel_ispc_sse4.h"
+#include "anime4k_kernel_ispc_avx2.h"
+#include "anime4k_kernel_ispc_avx512skx.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 static inline float min(float a, float b)
 {
     return a < b ? a : b;
 }
 
+/* entry points of one ISPC target, "auto" goes through the dispatcher */
+struct ispc_kernels {
+    const char *name;
+    decltype(&ispc::decode) decode;
+    decltype(&ispc::linear_upscale) linear_upscale;
+    decltype(&ispc::linear_upscale_int) linear_upscale_int;
+    decltype(&ispc::thin_lines) thin_lines;
+    decltype(&ispc::compute_gradient) compute_gradient;
+    decltype(&ispc::refine) refine;
+    decltype(&ispc::gang_size) gang_size;
+};
+
+#define KERNELS(name, suffix) { name, \
+    ispc::decode##suffix, \
+    ispc::linear_upscale##suffix, \
+    ispc::linear_upscale_int##suffix, \
+    ispc::thin_lines##suffix, \
+    ispc::compute_gradient##suffix, \
+    ispc::refine##suffix, \
+    ispc::gang_size##suffix }
+
+/* __builtin_cpu_supports() only takes literals */
+static bool cpu_supports(const char *isa)
+{
+    if (strcmp(isa, "sse4") == 0) {
+        return __builtin_cpu_supports("sse4.1");
+    } else if (strcmp(isa, "avx2") == 0) {
+        return __builtin_cpu_supports("avx2");
+    } else if (strcmp(isa, "avx512skx") == 0) {
+        return __builtin_cpu_supports("avx512f") &&
+            __builtin_cpu_supports("avx512bw") &&
+            __builtin_cpu_supports("avx512dq") &&
+            __builtin_cpu_supports("avx512vl");
+    }
+    return true;
+}
+
+static const ispc_kernels targets[] = {
+    KERNELS("auto", ),
+    KERNELS("sse4", _sse4),
+    KERNELS("avx2", _avx2),
+    KERNELS("avx512skx", _avx512skx),
+};
+
+static const ispc_kernels *find_target(const char *target)
+{
+    for (unsigned int i = 0; i < sizeof(targets) / sizeof(targets[0]); i++) {
+        if (strcasecmp(targets[i].name, target) == 0) {
+            return cpu_supports(targets[i].name) ? &targets[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+bool Anime4kIspc::has_target(const char *target)
+{
+    return find_target(target) != NULL;
+}
+
 Anime4kIspc::Anime4kIspc(
+    unsigned int width, unsigned int height, unsigned char *image,
+    unsigned int new_width, unsigned int new_height, const char *target)
+{
+    kernels_ = find_target(target);
+    if (ISPCInstrumentTarget) {
+        ISPCInstrumentTarget(kernels_->name, kernels_->gang_size());
+    }
+    old_capacity_ = 0;
+    capacity_ = 0;
+    original_red_ = NULL;
+    original_green_ = NULL;
+    original_blue_ = NULL;
+    enlarge_red_ = NULL;
+    enlarge_green_ = NULL;
+    enlarge_blue_ = NULL;
+    lum1_ = NULL;
+    thinlines_red_ = NULL;
+    thinlines_green_ = NULL;
+    thinlines_blue_ = NULL;
+    lum2_ = NULL;
+    gradients_ = NULL;
+    result_ = NULL;
+
+    reconfigure(width, height, image, new_width, new_height);
+}
+
+void Anime4kIspc::reconfigure(
     unsigned int width, unsigned int height, unsigned char *image,
     unsigned int new_width, unsigned int new_height)
 {
@@ -20,100 +113,94 @@ Anime4kIspc::Anime4kIspc(
     width_ = new_width;
     height_ = new_height;
 
-    /* ghost pixels added to avoid out-of-bounds */
-    unsigned int old_pixels = (width + 2) * (height + 2);
-    unsigned int pixels = (new_width + 2) * (new_height + 2);
+    /* borders are clamped inside the stencils, no ghost pixels needed */
+    unsigned int old_pixels = width * height;
+    /* the output-size planes have padded rows, result_ stays dense RGBA */
+    stride_ = plane_stride(new_width, sizeof(plane_t));
+    unsigned int pixels = stride_ * new_height;
+
+    /* planes only grow, smaller frames use a prefix of them */
+    if (old_pixels > old_capacity_) {
+        plane_free(original_red_);
+        plane_free(original_green_);
+        plane_free(original_blue_);
+
+        original_red_ = plane_new<plane_t>(old_pixels);
+        original_green_ = plane_new<plane_t>(old_pixels);
+        original_blue_ = plane_new<plane_t>(old_pixels);
+        old_capacity_ = old_pixels;
+    }
 
-    original_red_ = new float[old_pixels];
-    original_green_ = new float[old_pixels];
-    original_blue_ = new float[old_pixels];
+    if (pixels > capacity_) {
+        plane_free(enlarge_red_);
+        plane_free(enlarge_green_);
+        plane_free(enlarge_blue_);
+        plane_free(lum1_);
+        plane_free(thinlines_red_);
+        plane_free(thinlines_green_);
+        plane_free(thinlines_blue_);
+        plane_free(lum2_);
+        plane_free(gradients_);
+        plane_free(result_);
 
-    enlarge_red_ = new float[pixels];
-    enlarge_green_ = new float[pixels];
-    enlarge_blue_ = new float[pixels];
+        enlarge_red_ = plane_new<plane_t>(pixels);
+        enlarge_green_ = plane_new<plane_t>(pixels);
+        enlarge_blue_ = plane_new<plane_t>(pixels);
 
-    lum1_ = new float[pixels];
+        lum1_ = plane_new<plane_t>(pixels);
 
-    thinlines_red_ = new float[pixels];
-    thinlines_green_ = new float[pixels];
-    thinlines_blue_ = new float[pixels];
+        thinlines_red_ = plane_new<plane_t>(pixels);
+        thinlines_green_ = plane_new<plane_t>(pixels);
+        thinlines_blue_ = plane_new<plane_t>(pixels);
 
-    lum2_ = new float[pixels];
+        lum2_ = plane_new<plane_t>(pixels);
 
-    gradients_ = new float[pixels];
+        gradients_ = plane_new<plane_t>(pixels);
 
-    // result does not need ghost pixels
-    result_ = new unsigned char[4 * new_width * new_height];
+        result_ = plane_new<unsigned char>(4 * pixels);
+        capacity_ = pixels;
+    }
 
     strength_thinlines_ =
         min((float)new_width / width / 6, 1.0f);
     strength_refine_ =
         min((float)new_width / width / 2, 1.0f);
-}
-
-static void extend(float *buf, unsigned int width, unsigned int height)
-{
-    unsigned int new_width = width + 2;
-
-    for (unsigned int i = 1; i <= height; i++) {
-        /* left */
-        int left = i * new_width;
-        buf[left] = buf[left + 1];
-
-        /* right */
-        int right = i * new_width + width;
-        buf[right + 1] = buf[right];
-    }
 
-    for (unsigned int i = 0; i < new_width; i++) {
-        /* top */
-        buf[i] = buf[i + new_width];
-
-        /* bottom */
-        int bottom_from = height * new_width + i;
-        int bottom_to = bottom_from + new_width;
-        buf[bottom_to] = buf[bottom_from];
-    }
+    scale_ = integer_scale(width, height, new_width, new_height);
 }
 
 void Anime4kIspc::run()
 {
     START_ACTIVITY(ACTIVITY_DECODE);
-    ispc::decode(old_width_, old_height_, (int *)image_,
+    kernels_->decode(old_width_, old_height_, (int *)image_,
         original_red_, original_green_, original_blue_);
-    extend(original_red_, old_width_, old_height_);
-    extend(original_green_, old_width_, old_height_);
-    extend(original_blue_, old_width_, old_height_);
     FINISH_ACTIVITY(ACTIVITY_DECODE);
 
     START_ACTIVITY(ACTIVITY_LINEAR);
-    ispc::linear_upscale(old_width_, old_height_,
-        original_red_, original_green_, original_blue_,
-        width_, height_,
-        enlarge_red_, enlarge_green_, enlarge_blue_, lum1_);
-    extend(enlarge_red_, width_, height_);
-    extend(enlarge_green_, width_, height_);
-    extend(enlarge_blue_, width_, height_);
-    extend(lum1_, width_, height_);
+    if (scale_) {
+        kernels_->linear_upscale_int(old_width_, old_height_,
+            original_red_, original_green_, original_blue_, scale_, stride_,
+            enlarge_red_, enlarge_green_, enlarge_blue_, lum1_);
+    } else {
+        kernels_->linear_upscale(old_width_, old_height_,
+            original_red_, original_green_, original_blue_,
+            width_, height_, stride_,
+            enlarge_red_, enlarge_green_, enlarge_blue_, lum1_);
+    }
     FINISH_ACTIVITY(ACTIVITY_LINEAR);
 
     START_ACTIVITY(ACTIVITY_THINLINES);
-    ispc::thin_lines(strength_thinlines_, width_, height_,
+    kernels_->thin_lines(strength_thinlines_, width_, height_, stride_,
         enlarge_red_, enlarge_green_, enlarge_blue_, lum1_,
         thinlines_red_, thinlines_green_, thinlines_blue_, lum2_);
-    extend(thinlines_red_, width_, height_);
-    extend(thinlines_green_, width_, height_);
-    extend(thinlines_blue_, width_, height_);
-    extend(lum2_, width_, height_);
     FINISH_ACTIVITY(ACTIVITY_THINLINES);
 
     START_ACTIVITY(ACTIVITY_GRADIENT);
-    ispc::compute_gradient(width_, height_, lum2_, gradients_);
-    extend(gradients_, width_, height_);
+    kernels_->compute_gradient(width_, height_, stride_, lum2_, gradients_);
     FINISH_ACTIVITY(ACTIVITY_GRADIENT);
 
     START_ACTIVITY(ACTIVITY_REFINE);
-    ispc::refine(strength_refine_, width_, height_,
+    kernels_->refine(strength_refine_, width_, height_, stride_,
         thinlines_red_, thinlines_green_, thinlines_blue_,
         gradients_, (int *)result_);
     FINISH_ACTIVITY(ACTIVITY_REFINE);
@@ -121,17 +208,17 @@ void Anime4kIspc::run()
 
 Anime4kIspc::~Anime4kIspc()
 {
-    delete [] original_red_;
-    delete [] original_green_;
-    delete [] original_blue_;
-    delete [] enlarge_red_;
-    delete [] enlarge_green_;
-    delete [] enlarge_blue_;
-    delete [] lum1_;
-    delete [] thinlines_red_;
-    delete [] thinlines_green_;
-    delete [] thinlines_blue_;
-    delete [] lum2_;
-    delete [] gradients_;
-    delete [] result_;
+    plane_free(original_red_);
+    plane_free(original_green_);
+    plane_free(original_blue_);
+    plane_free(enlarge_red_);
+    plane_free(enlarge_green_);
+    plane_free(enlarge_blue_);
+    plane_free(lum1_);
+    plane_free(thinlines_red_);
+    plane_free(thinlines_green_);
+    plane_free(thinlines_blue_);
+    plane_free(lum2_);
+    plane_free(gradients_);
+    plane_free(result_);
 }
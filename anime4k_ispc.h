@@ -2,6 +2,10 @@
 #define ANIME4K_ISPC_H_
 
 #include "anime4k.h"
+#include "anime4k_plane.h"
+
+/* kernels of one ISPC target, see has_target() */
+struct ispc_kernels;
 
 class Anime4kIspc : public Anime4k {
 private:
@@ -10,28 +14,40 @@ private:
     unsigned char *image_;
     unsigned int width_;
     unsigned int height_;
-    float *original_red_;
-    float *original_green_;
-    float *original_blue_;
-    float *enlarge_red_;
-    float *enlarge_green_;
-    float *enlarge_blue_;
-    float *lum1_;
-    float *thinlines_red_;
-    float *thinlines_green_;
-    float *thinlines_blue_;
-    float *lum2_;
-    float *gradients_;
+    /* elements per row of the output-size planes, see plane_stride() */
+    unsigned int stride_;
+    unsigned int old_capacity_;
+    unsigned int capacity_;
+    plane_t *original_red_;
+    plane_t *original_green_;
+    plane_t *original_blue_;
+    plane_t *enlarge_red_;
+    plane_t *enlarge_green_;
+    plane_t *enlarge_blue_;
+    plane_t *lum1_;
+    plane_t *thinlines_red_;
+    plane_t *thinlines_green_;
+    plane_t *thinlines_blue_;
+    plane_t *lum2_;
+    plane_t *gradients_;
     unsigned char *result_;
+    const ispc_kernels *kernels_;
     float strength_thinlines_;
     float strength_refine_;
+    int scale_;
 public:
     Anime4kIspc(
         unsigned int width, unsigned int height, unsigned char *image,
-        unsigned int new_width, unsigned int new_height);
+        unsigned int new_width, unsigned int new_height,
+        const char *target = "auto");
     virtual ~Anime4kIspc();
     void run();
     unsigned char *get_image() { return result_; }
+    void reconfigure(
+        unsigned int width, unsigned int height, unsigned char *image,
+        unsigned int new_width, unsigned int new_height);
+    /* target is "auto", "sse4", "avx2" or "avx512skx" */
+    static bool has_target(const char *target);
 };
 
 #endif /* ANIME4K_ISPC_H_ */
@@ -1,9 +1,15 @@
 #include "anime4k_omp.h"
 
 #include "instrument.h"
+#include "plane_alloc.h"
+#include "placement.h"
 
 #include <stdlib.h>
 #include <math.h>
+#include <sched.h>
+
+/* rows per task of the wavefront mode */
+#define WAVE_BAND 8
 
 static inline float min(float a, float b)
 {
@@ -23,9 +29,84 @@ static inline float max3v(float a, float b, float c) {
     return max(max(a, b), c);
 }
 
+/*
+ * Bilinear sample positions along one axis: output k blends source
+ * index[2k] and index[2k + 1] with weight[k] on the second, computed as
+ * in the seq backend.
+ */
+static void sample_table(unsigned int old_size, unsigned int size,
+    int *index, float *weight)
+{
+    int maxi = old_size - 1;
+    for (unsigned int k = 0; k < size; k++) {
+        float x = (float)(k * old_size) / size;
+        float floor_x = floor(x);
+        int lo = (int)floor_x;
+        index[2 * k] = lo;
+        index[2 * k + 1] = lo < maxi ? lo + 1 : maxi;
+        weight[k] = x - floor_x;
+    }
+}
+
+/*
+ * The stages run inside the one parallel region of run() and share out
+ * their rows with nowait loops. finish_stage() is the barrier before the
+ * next stage reads neighbouring rows; the master thread times each stage
+ * up to it, every thread its own share of the rows up to the barrier.
+ */
+static inline void start_stage(activity_t a)
+{
+    #pragma omp master
+    START_ACTIVITY(a);
+    START_ACTIVITY(a);
+}
+
+static inline void finish_stage(activity_t a)
+{
+    FINISH_LOCAL_ACTIVITY(a);
+    #pragma omp barrier
+    #pragma omp master
+    FINISH_ACTIVITY(a);
+}
+
+/* luminance of one row, by the thread that just wrote the row */
+static inline void luminance_row(unsigned int width, const float *src, float *dst)
+{
+    for (unsigned int j = 0; j < width; j++) {
+        dst[j] = (src[3 * j] * 2 + src[3 * j + 1] * 3 + src[3 * j + 2]) / 6;
+    }
+}
+
 Anime4kOmp::Anime4kOmp(
     unsigned int width, unsigned int height, unsigned char *image,
     unsigned int new_width, unsigned int new_height)
+{
+    old_capacity_ = 0;
+    capacity_ = 0;
+    original_ = NULL;
+    enlarge_ = NULL;
+    lum_ = NULL;
+    thinlines_ = NULL;
+    lum2_ = NULL;
+    gradients_ = NULL;
+    result_ = NULL;
+    column_capacity_ = 0;
+    row_capacity_ = 0;
+    column_index_ = NULL;
+    column_weight_ = NULL;
+    row_index_ = NULL;
+    row_weight_ = NULL;
+    wavefront_ = false;
+    frame_ = 0;
+    band_capacity_ = 0;
+    band_done_ = NULL;
+
+    reconfigure(width, height, image, new_width, new_height);
+}
+
+void Anime4kOmp::reconfigure(
+    unsigned int width, unsigned int height, unsigned char *image,
+    unsigned int new_width, unsigned int new_height)
 {
     old_width_ = width;
     old_height_ = height;
@@ -33,175 +114,216 @@ Anime4kOmp::Anime4kOmp(
     width_ = new_width;
     height_ = new_height;
 
-    /* ghost pixels added to avoid out-of-bounds */
-    unsigned int old_pixels = (width + 2) * (height + 2);
-    unsigned int pixels = (new_width + 2) * (new_height + 2);
-
-    original_ = new float[3 * old_pixels];
-    enlarge_ = new float[3 * pixels];
-    lum_ = new float[pixels];
-    thinlines_ = new float[3 * pixels];
-    gradients_ = new float[pixels];
+    /* borders are clamped inside the stencils, no ghost pixels needed */
+    unsigned int old_pixels = width * height;
+    /* the internal planes have padded rows, result_ stays dense RGBA */
+    stride_ = plane_stride(new_width, sizeof(float));
+    unsigned int pixels = stride_ * new_height;
+
+    /* planes only grow, smaller frames use a prefix of them */
+    if (old_pixels > old_capacity_) {
+        plane_free(original_);
+        original_ = plane_new<float>(3 * old_pixels);
+        first_touch_rows(original_, 3 * width * sizeof(float), height);
+        old_capacity_ = old_pixels;
+    }
 
-    // result does not need ghost pixels
-    result_ = new unsigned char[4 * new_width * new_height];
+    if (pixels > capacity_) {
+        plane_free(enlarge_);
+        plane_free(lum_);
+        plane_free(thinlines_);
+        plane_free(lum2_);
+        plane_free(gradients_);
+        plane_free(result_);
+
+        enlarge_ = plane_new<float>(3 * pixels);
+        lum_ = plane_new<float>(pixels);
+        thinlines_ = plane_new<float>(3 * pixels);
+        lum2_ = plane_new<float>(pixels);
+        gradients_ = plane_new<float>(pixels);
+
+        result_ = plane_new<unsigned char>(4 * pixels);
+        capacity_ = pixels;
+
+        /* on the nodes of the threads that compute their rows */
+        first_touch_rows(enlarge_, 3 * stride_ * sizeof(float), new_height);
+        first_touch_rows(lum_, stride_ * sizeof(float), new_height);
+        first_touch_rows(thinlines_, 3 * stride_ * sizeof(float), new_height);
+        first_touch_rows(lum2_, stride_ * sizeof(float), new_height);
+        first_touch_rows(gradients_, stride_ * sizeof(float), new_height);
+        first_touch_rows(result_, 4 * new_width, new_height);
+    }
 
     strength_thinlines_ =
         min((float)new_width / width / 6, 1.0f);
     strength_refine_ =
         min((float)new_width / width / 2, 1.0f);
-}
 
-static inline void extend(float *buf, unsigned int width, unsigned int height)
-{
-    unsigned int new_width = width + 2;
-
-    for (unsigned int i = 1; i <= height; i++) {
-        /* left */
-        int left = i * new_width;
-        buf[left] = buf[left + 1];
+    scale_ = integer_scale(width, height, new_width, new_height);
 
-        /* right */
-        int right = i * new_width + width;
-        buf[right + 1] = buf[right];
+    if (new_width > column_capacity_) {
+        delete [] column_index_;
+        delete [] column_weight_;
+        column_index_ = new int[2 * new_width];
+        column_weight_ = new float[new_width];
+        column_capacity_ = new_width;
     }
-
-    for (unsigned int i = 0; i < new_width; i++) {
-        /* top */
-        buf[i] = buf[i + new_width];
-
-        /* bottom */
-        int bottom_from = height * new_width + i;
-        int bottom_to = bottom_from + new_width;
-        buf[bottom_to] = buf[bottom_from];
+    if (new_height > row_capacity_) {
+        delete [] row_index_;
+        delete [] row_weight_;
+        row_index_ = new int[2 * new_height];
+        row_weight_ = new float[new_height];
+        row_capacity_ = new_height;
     }
-}
-
-static inline void extend_rgb(float *buf, unsigned int width, unsigned int height)
-{
-    unsigned int new_width = width + 2;
-
-    for (unsigned int i = 1; i <= height; i++) {
-        /* left */
-        int left = 3 * (i * new_width + 1);
-        buf[left - 3] = buf[left];
-        buf[left - 2] = buf[left + 1];
-        buf[left - 1] = buf[left + 2];
-
-        /* right */
-        int right = 3 * (i * new_width + width);
-        buf[right + 3] = buf[right];
-        buf[right + 4] = buf[right + 1];
-        buf[right + 5] = buf[right + 2];
-    }
-
-    for (unsigned int i = 0; i < new_width; i++) {
-        /* top */
-        int top_from = 3 * (new_width + i);
-        int top_to = 3 * i;
-        buf[top_to] = buf[top_from];
-        buf[top_to + 1] = buf[top_from + 1];
-        buf[top_to + 2] = buf[top_from + 2];
-
-        /* bottom */
-        int bottom_from = 3 * (height * new_width + i);
-        int bottom_to = 3 * ((height + 1) * new_width + i);
-        buf[bottom_to] = buf[bottom_from];
-        buf[bottom_to + 1] = buf[bottom_from + 1];
-        buf[bottom_to + 2] = buf[bottom_from + 2];
+    sample_table(width, new_width, column_index_, column_weight_);
+    sample_table(height, new_height, row_index_, row_weight_);
+
+    /* completion of the bands of every stage but the last */
+    unsigned int bands = (new_height + WAVE_BAND - 1) / WAVE_BAND;
+    if ((STAGE_COUNT - 1) * bands > band_capacity_) {
+        delete [] band_done_;
+        band_capacity_ = (STAGE_COUNT - 1) * bands;
+        band_done_ = new std::atomic<unsigned int>[band_capacity_];
+        for (unsigned int i = 0; i < band_capacity_; i++) {
+            band_done_[i] = 0;
+        }
     }
 }
 
 static void decode(unsigned int width, unsigned int height,
     unsigned char *src, float *dst)
 {
-    START_ACTIVITY(ACTIVITY_DECODE);
+    start_stage(ACTIVITY_DECODE);
 
-    #pragma omp parallel for schedule(static)
+    #pragma omp for schedule(static) nowait
     for (unsigned int i = 0; i < height; i++) {
         for (unsigned int j = 0; j < width; j++) {
             int old_ix = 4 * (i * width + j);
-            int new_ix = 3 * ((i + 1) * (width + 2) + j + 1);
+            int new_ix = 3 * (i * width + j);
             dst[new_ix] = src[old_ix] / 255.0f;
             dst[new_ix + 1] = src[old_ix + 1] / 255.0f;
             dst[new_ix + 2] = src[old_ix + 2] / 255.0f;
         }
     }
-
-    extend_rgb(dst, width, height);
-
-    FINISH_ACTIVITY(ACTIVITY_DECODE);
 }
 
-static inline float interpolate(
-    float tl, float tr,
-    float bl, float br, float f, float g)
+/*
+ * linear_upscale for an exact integer scale K: the horizontal weights
+ * repeat with period K, so each source column is blended vertically once
+ * and its two neighbours are read contiguously. s / K is exact for 2x and
+ * 4x, which stay bit-identical to the seq backend. 1/3 is not, so 3x
+ * rounds wl + s / 3 the same way, but FMA contraction of the blends can
+ * still differ from the seq backend in the last bit.
+ */
+template <int K>
+static void linear_upscale_int_row(
+    unsigned int old_width, unsigned int old_height, unsigned int stride,
+    unsigned int i, float *src, float *dst, float *lum)
 {
-    float l = tl * (1 - f) + bl * f;
-    float r = tr * (1 - f) + br * f;
-    return l * (1 - g) + r * g;
-}
+    unsigned int width = K * old_width;
+    unsigned int height = K * old_height;
+    int maxh = old_height - 1;
+    int maxw = old_width - 1;
+
+    float x = (float)(i * old_height) / height;
+    float floor_x = floor(x);
+    int ht = (int)floor_x;
+    int hb = ht < maxh ? ht + 1 : maxh;
+    float f = x - floor_x;
+
+    float *top = src + 3 * ht * old_width;
+    float *bottom = src + 3 * hb * old_width;
+    float *out = dst + 3 * i * stride;
+
+    float l[3], r[3];
+    for (int c = 0; c < 3; c++) {
+        l[c] = top[c] * (1 - f) + bottom[c] * f;
+    }
 
-static void linear_upscale(
-    unsigned int old_width, unsigned int old_height, float *src,
-    unsigned int width, unsigned int height, float *dst)
-{
-    START_ACTIVITY(ACTIVITY_LINEAR);
+    for (int wl = 0; wl <= maxw; wl++) {
+        int wr = wl < maxw ? wl + 1 : maxw;
+        for (int c = 0; c < 3; c++) {
+            r[c] = top[3 * wr + c] * (1 - f) + bottom[3 * wr + c] * f;
+        }
 
-    #pragma omp parallel for schedule(static)
-    for (unsigned int i = 0; i < height; i++) {
-        for (unsigned int j = 0; j < width; j++) {
-            float x = (float)(i * old_height) / height;
-            float y = (float)(j * old_width) / width;
-            float floor_x = floor(x);
-            float floor_y = floor(y);
-            int h = (int)floor_x + 1;
-            int w = (int)floor_y + 1;
-            float f = x - floor_x;
-            float g = y - floor_y;
-
-            int ix = 3 * ((i + 1) * (width + 2) + j + 1);
-            int tl = 3 * (h * (old_width + 2) + w);
-            int tr = tl + 3;
-            int bl = tl + 3 * (old_width + 2);
-            int br = bl + 3;
-
-            dst[ix] = interpolate(
-                src[tl], src[tr],
-                src[bl], src[br], f, g);
-
-            dst[ix + 1] = interpolate(
-                src[tl + 1], src[tr + 1],
-                src[bl + 1], src[br + 1], f, g);
-
-            dst[ix + 2] = interpolate(
-                src[tl + 2], src[tr + 2],
-                src[bl + 2], src[br + 2], f, g);
+        for (int s = 0; s < K; s++) {
+            float g = K == 3 ? (float)(K * wl + s) / K - wl : (float)s / K;
+            for (int c = 0; c < 3; c++) {
+                out[3 * (K * wl + s) + c] = l[c] * (1 - g) + r[c] * g;
+            }
         }
-    }
 
-    extend_rgb(dst, width, height);
+        for (int c = 0; c < 3; c++) {
+            l[c] = r[c];
+        }
+    }
 
-    FINISH_ACTIVITY(ACTIVITY_LINEAR);
+    luminance_row(width, out, lum + i * stride);
 }
 
-static void compute_luminance(
-    unsigned int width, unsigned int height, float *src, float *dst)
+/* the two horizontally resampled source rows one thread has cached */
+struct row_cache {
+    float *rows;
+    int cached[2];
+};
+
+/*
+ * linear_upscale for any ratio, separable through the precomputed tables:
+ * source rows are resampled horizontally once into a per-thread cache of
+ * the two rows the current output row blends, and output rows are a
+ * streaming vertical blend of the cache. Each thread runs contiguous
+ * bands of output rows, so consecutive rows mostly hit the cache.
+ * Blending horizontally first rounds differently from the seq backend.
+ */
+static void linear_upscale_table_row(
+    unsigned int old_width, float *src, unsigned int width,
+    unsigned int stride, unsigned int i,
+    const int *column_index, const float *column_weight,
+    const int *row_index, const float *row_weight, row_cache *rc,
+    float *dst, float *lum)
 {
-    START_ACTIVITY(ACTIVITY_LUM);
-
-    #pragma omp parallel for schedule(dynamic, 1)
-    for (unsigned int i = 0; i < height + 2; i++) {
-        for (unsigned int j = 0; j < width + 2; j++) {
-            int lum_ix = i * (width + 2) + j;
-            int ix = 3 * lum_ix;
+    float *cache = rc->rows;
+    int *cached = rc->cached;
+
+    int ht = row_index[2 * i];
+    int hb = row_index[2 * i + 1];
+
+    /* keep a cached row if it is still needed, the top one often was the bottom */
+    int top_slot = cached[0] == ht ? 0 : (cached[1] == ht ? 1 :
+        (cached[0] == hb ? 1 : 0));
+    int bottom_slot = hb == ht ? top_slot : 1 - top_slot;
+
+    int slots[2] = { top_slot, bottom_slot };
+    int needed[2] = { ht, hb };
+    for (int k = 0; k < 2; k++) {
+        int slot = slots[k];
+        int h = needed[k];
+        if (cached[slot] == h) {
+            continue;
+        }
 
-            dst[lum_ix] =
-                (src[ix] * 2 + src[ix + 1] * 3 + src[ix + 2]) / 6;
+        const float *s = src + 3 * h * old_width;
+        float *row = cache + 3 * width * slot;
+        for (unsigned int j = 0; j < width; j++) {
+            const float *l = s + 3 * column_index[2 * j];
+            const float *r = s + 3 * column_index[2 * j + 1];
+            float g = column_weight[j];
+            row[3 * j] = l[0] * (1 - g) + r[0] * g;
+            row[3 * j + 1] = l[1] * (1 - g) + r[1] * g;
+            row[3 * j + 2] = l[2] * (1 - g) + r[2] * g;
         }
+        cached[slot] = h;
     }
 
-    FINISH_ACTIVITY(ACTIVITY_LUM);
+    float f = row_weight[i];
+    const float *top = cache + 3 * width * top_slot;
+    const float *bottom = cache + 3 * width * bottom_slot;
+    float *out = dst + 3 * i * stride;
+    for (unsigned int j = 0; j < 3 * width; j++) {
+        out[j] = top[j] * (1 - f) + bottom[j] * f;
+    }
+
+    luminance_row(width, out, lum + i * stride);
 }
 
 static inline void get_largest(float strength, float *image, float *lum,
@@ -221,121 +343,140 @@ static inline void get_largest(float strength, float *image, float *lum,
     }
 }
 
-static void thin_lines(
-    float strength, unsigned int width, unsigned int height,
-    float *image, float *lum, float *dst)
+/*
+ * left, right, up and down are the offsets of the neighbours; they are 0 on the
+ * image border, which clamps the stencil to the nearest valid pixel.
+ */
+static inline void thin_lines_pixel(float strength,
+    float *image, float *lum, float *dst,
+    int cc_ix, int left, int right, int up, int down)
 {
-    START_ACTIVITY(ACTIVITY_THINLINES);
-
-    unsigned int new_width = width + 2;
-
-    #pragma omp parallel for schedule(dynamic, 1)
-    for (unsigned int i = 1; i <= height; i++) {
-        for (unsigned int j = 1; j <= width; j++) {
-            /*
-             * [tl  t tr]
-             * [ l cc  r]
-             * [bl  b br]
-             */
-            int cc_ix = i * new_width + j;
-            int r_ix = cc_ix + 1;
-            int l_ix = cc_ix - 1;
-            int t_ix = cc_ix - new_width;
-            int tl_ix = t_ix - 1;
-            int tr_ix = t_ix + 1;
-            int b_ix = cc_ix + new_width;
-            int bl_ix = b_ix - 1;
-            int br_ix = b_ix + 1;
-
-            float cc = lum[cc_ix];
-            float r = lum[r_ix];
-            float l = lum[l_ix];
-            float t = lum[t_ix];
-            float tl = lum[tl_ix];
-            float tr = lum[tr_ix];
-            float b = lum[b_ix];
-            float bl = lum[bl_ix];
-            float br = lum[br_ix];
-
-            float color[4];
-            color[0] = image[3 * cc_ix];
-            color[1] = image[3 * cc_ix + 1];
-            color[2] = image[3 * cc_ix + 2];
-            color[3] = cc;
-
-            /* pattern 0 and 4 */
-            float maxDark = max3v(br, b, bl);
-            float minLight = min3v(tl, t, tr);
-
-            if (minLight > cc && minLight > maxDark) {
-                get_largest(strength, image, lum, color,
-                    cc_ix, tl_ix, t_ix, tr_ix);
-            } else {
-                maxDark = max3v(tl, t, tr);
-                minLight = min3v(br, b, bl);
-                if (minLight > cc && minLight > maxDark) {
-                    get_largest(strength, image, lum, color,
-                        cc_ix, br_ix, b_ix, bl_ix);
-                }
-            }
-
-            /* pattern 1 and 5 */
-            maxDark = max3v(cc, l, b);
-            minLight = min3v(r, t, tr);
-
-            if (minLight > maxDark) {
-                get_largest(strength, image, lum, color,
-                    cc_ix, r_ix, t_ix, tr_ix);
-            } else {
-                maxDark = max3v(cc, r, t);
-                minLight = min3v(bl, l, b);
-                if (minLight > maxDark) {
-                    get_largest(strength, image, lum, color,
-                        cc_ix, bl_ix, l_ix, b_ix);
-                }
-            }
+    /*
+     * [tl  t tr]
+     * [ l cc  r]
+     * [bl  b br]
+     */
+    int r_ix = cc_ix + right;
+    int l_ix = cc_ix + left;
+    int t_ix = cc_ix + up;
+    int tl_ix = t_ix + left;
+    int tr_ix = t_ix + right;
+    int b_ix = cc_ix + down;
+    int bl_ix = b_ix + left;
+    int br_ix = b_ix + right;
+
+    float cc = lum[cc_ix];
+    float r = lum[r_ix];
+    float l = lum[l_ix];
+    float t = lum[t_ix];
+    float tl = lum[tl_ix];
+    float tr = lum[tr_ix];
+    float b = lum[b_ix];
+    float bl = lum[bl_ix];
+    float br = lum[br_ix];
+
+    float color[4];
+    color[0] = image[3 * cc_ix];
+    color[1] = image[3 * cc_ix + 1];
+    color[2] = image[3 * cc_ix + 2];
+    color[3] = cc;
+
+    /* pattern 0 and 4 */
+    float maxDark = max3v(br, b, bl);
+    float minLight = min3v(tl, t, tr);
+
+    if (minLight > cc && minLight > maxDark) {
+        get_largest(strength, image, lum, color,
+            cc_ix, tl_ix, t_ix, tr_ix);
+    } else {
+        maxDark = max3v(tl, t, tr);
+        minLight = min3v(br, b, bl);
+        if (minLight > cc && minLight > maxDark) {
+            get_largest(strength, image, lum, color,
+                cc_ix, br_ix, b_ix, bl_ix);
+        }
+    }
 
-            /* pattern 2 and 6 */
-            maxDark = max3v(l, tl, bl);
-            minLight = min3v(r, br, tr);
+    /* pattern 1 and 5 */
+    maxDark = max3v(cc, l, b);
+    minLight = min3v(r, t, tr);
+
+    if (minLight > maxDark) {
+        get_largest(strength, image, lum, color,
+            cc_ix, r_ix, t_ix, tr_ix);
+    } else {
+        maxDark = max3v(cc, r, t);
+        minLight = min3v(bl, l, b);
+        if (minLight > maxDark) {
+            get_largest(strength, image, lum, color,
+                cc_ix, bl_ix, l_ix, b_ix);
+        }
+    }
 
-            if (minLight > cc && minLight > maxDark) {
-                get_largest(strength, image, lum, color,
-                    cc_ix, r_ix, br_ix, tr_ix);
-            } else {
-                maxDark = max3v(r, br, tr);
-                minLight = min3v(l, tl, bl);
-                if (minLight > cc && minLight > maxDark) {
-                    get_largest(strength, image, lum, color,
-                        cc_ix, l_ix, tl_ix, bl_ix);
-                }
-            }
+    /* pattern 2 and 6 */
+    maxDark = max3v(l, tl, bl);
+    minLight = min3v(r, br, tr);
+
+    if (minLight > cc && minLight > maxDark) {
+        get_largest(strength, image, lum, color,
+            cc_ix, r_ix, br_ix, tr_ix);
+    } else {
+        maxDark = max3v(r, br, tr);
+        minLight = min3v(l, tl, bl);
+        if (minLight > cc && minLight > maxDark) {
+            get_largest(strength, image, lum, color,
+                cc_ix, l_ix, tl_ix, bl_ix);
+        }
+    }
 
-            /* pattern 3 and 7 */
-            maxDark = max3v(cc, l, t);
-            minLight = min3v(r, br, b);
+    /* pattern 3 and 7 */
+    maxDark = max3v(cc, l, t);
+    minLight = min3v(r, br, b);
+
+    if (minLight > maxDark) {
+        get_largest(strength, image, lum, color,
+            cc_ix, r_ix, br_ix, b_ix);
+    } else {
+        maxDark = max3v(cc, r, b);
+        minLight = min3v(t, l, tl);
+        if (minLight > maxDark) {
+            get_largest(strength, image, lum, color,
+                cc_ix, t_ix, l_ix, tl_ix);
+        }
+    }
 
-            if (minLight > maxDark) {
-                get_largest(strength, image, lum, color,
-                    cc_ix, r_ix, br_ix, b_ix);
-            } else {
-                maxDark = max3v(cc, r, b);
-                minLight = min3v(t, l, tl);
-                if (minLight > maxDark) {
-                    get_largest(strength, image, lum, color,
-                        cc_ix, t_ix, l_ix, tl_ix);
-                }
-            }
+    dst[3 * cc_ix] = color[0];
+    dst[3 * cc_ix + 1] = color[1];
+    dst[3 * cc_ix + 2] = color[2];
+}
 
-            dst[3 * cc_ix] = color[0];
-            dst[3 * cc_ix + 1] = color[1];
-            dst[3 * cc_ix + 2] = color[2];
-        }
+/* also writes the luminance of the result to dst_lum */
+static void thin_lines_row(
+    float strength, unsigned int width, unsigned int height,
+    unsigned int stride, unsigned int i,
+    float *image, float *lum, float *dst, float *dst_lum)
+{
+    int last = width - 1;
+    int row = i * stride;
+    int up = i > 0 ? -(int)stride : 0;
+    int down = i + 1 < height ? (int)stride : 0;
+
+    /* left column */
+    thin_lines_pixel(strength, image, lum, dst,
+        row, 0, last > 0 ? 1 : 0, up, down);
+
+    for (int j = 1; j < last; j++) {
+        thin_lines_pixel(strength, image, lum, dst,
+            row + j, -1, 1, up, down);
     }
 
-    extend_rgb(dst, width, height);
+    /* right column */
+    if (last > 0) {
+        thin_lines_pixel(strength, image, lum, dst,
+            row + last, -1, 0, up, down);
+    }
 
-    FINISH_ACTIVITY(ACTIVITY_THINLINES);
+    luminance_row(width, dst + 3 * row, dst_lum + row);
 }
 
 static inline float clamp(float x, float lower, float upper)
@@ -343,62 +484,69 @@ static inline float clamp(float x, float lower, float upper)
     return x < lower ? lower : (x > upper ? upper : x);
 }
 
-static void compute_gradient(unsigned int width, unsigned int height,
-    float *src, float *dst)
+static inline void gradient_pixel(float *src, float *dst,
+    int cc_ix, int left, int right, int up, int down)
 {
-    START_ACTIVITY(ACTIVITY_GRADIENT);
-
-    unsigned int new_width = width + 2;
-
-    #pragma omp parallel for schedule(static)
-    for (unsigned int i = 1; i <= height; i++) {
-        for (unsigned int j = 1; j <= width; j++) {
-            /*
-             * [tl  t tr]
-             * [ l cc  r]
-             * [bl  b br]
-             */
-            int cc_ix = i * new_width + j;
-            int r_ix = cc_ix + 1;
-            int l_ix = cc_ix - 1;
-            int t_ix = cc_ix - new_width;
-            int tl_ix = t_ix - 1;
-            int tr_ix = t_ix + 1;
-            int b_ix = cc_ix + new_width;
-            int bl_ix = b_ix - 1;
-            int br_ix = b_ix + 1;
-
-            float r = src[r_ix];
-            float l = src[l_ix];
-            float t = src[t_ix];
-            float tl = src[tl_ix];
-            float tr = src[tr_ix];
-            float b = src[b_ix];
-            float bl = src[bl_ix];
-            float br = src[br_ix];
-
-            /* Horizontal Gradient
-             * [-1  0  1]
-             * [-2  0  2]
-             * [-1  0  1]
-             */
-            float xgrad = tr - tl + r + r - l - l + br - bl;
-
-            /* Vertical Gradient
-             * [-1 -2 -1]
-             * [ 0  0  0]
-             * [ 1  2  1]
-             */
-            float ygrad = bl - tl + b + b - t - t + br - tr;
-
-            dst[cc_ix] =
-                1.0f - clamp(sqrt(xgrad * xgrad + ygrad * ygrad), 0.0f, 1.0f);
-        }
-    }
+    /*
+     * [tl  t tr]
+     * [ l cc  r]
+     * [bl  b br]
+     */
+    int r_ix = cc_ix + right;
+    int l_ix = cc_ix + left;
+    int t_ix = cc_ix + up;
+    int tl_ix = t_ix + left;
+    int tr_ix = t_ix + right;
+    int b_ix = cc_ix + down;
+    int bl_ix = b_ix + left;
+    int br_ix = b_ix + right;
+
+    float r = src[r_ix];
+    float l = src[l_ix];
+    float t = src[t_ix];
+    float tl = src[tl_ix];
+    float tr = src[tr_ix];
+    float b = src[b_ix];
+    float bl = src[bl_ix];
+    float br = src[br_ix];
+
+    /* Horizontal Gradient
+     * [-1  0  1]
+     * [-2  0  2]
+     * [-1  0  1]
+     */
+    float xgrad = tr - tl + r + r - l - l + br - bl;
+
+    /* Vertical Gradient
+     * [-1 -2 -1]
+     * [ 0  0  0]
+     * [ 1  2  1]
+     */
+    float ygrad = bl - tl + b + b - t - t + br - tr;
+
+    dst[cc_ix] =
+        1.0f - clamp(sqrt(xgrad * xgrad + ygrad * ygrad), 0.0f, 1.0f);
+}
+
+static void gradient_row(unsigned int width, unsigned int height,
+    unsigned int stride, unsigned int i, float *src, float *dst)
+{
+    int last = width - 1;
+    int row = i * stride;
+    int up = i > 0 ? -(int)stride : 0;
+    int down = i + 1 < height ? (int)stride : 0;
+
+    /* left column */
+    gradient_pixel(src, dst, row, 0, last > 0 ? 1 : 0, up, down);
 
-    extend(dst, width, height);
+    for (int j = 1; j < last; j++) {
+        gradient_pixel(src, dst, row + j, -1, 1, up, down);
+    }
 
-    FINISH_ACTIVITY(ACTIVITY_GRADIENT);
+    /* right column */
+    if (last > 0) {
+        gradient_pixel(src, dst, row + last, -1, 0, up, down);
+    }
 }
 
 static inline unsigned char quantize(float x)
@@ -423,146 +571,341 @@ static inline void get_average(float strength, float *src, unsigned char *dst,
     dst[ix + 3] = 255;
 }
 
-static void refine(float strength, unsigned int width, unsigned int height,
+/* ix is the byte offset of the pixel in the dense RGBA dst */
+static inline void refine_pixel(float strength,
+    float *image, float *gradients, unsigned char *dst, int ix,
+    int cc_ix, int left, int right, int up, int down)
+{
+    /*
+     * [tl  t tr]
+     * [ l cc  r]
+     * [bl  b br]
+     */
+    int r_ix = cc_ix + right;
+    int l_ix = cc_ix + left;
+    int t_ix = cc_ix + up;
+    int tl_ix = t_ix + left;
+    int tr_ix = t_ix + right;
+    int b_ix = cc_ix + down;
+    int bl_ix = b_ix + left;
+    int br_ix = b_ix + right;
+
+    float cc = gradients[cc_ix];
+    float r = gradients[r_ix];
+    float l = gradients[l_ix];
+    float t = gradients[t_ix];
+    float tl = gradients[tl_ix];
+    float tr = gradients[tr_ix];
+    float b = gradients[b_ix];
+    float bl = gradients[bl_ix];
+    float br = gradients[br_ix];
+
+    /* pattern 0 and 4 */
+    float maxDark = max3v(br, b, bl);
+    float minLight = min3v(tl, t, tr);
+
+    if (minLight > cc && minLight > maxDark) {
+        get_average(strength, image, dst,
+            ix, cc_ix, tl_ix, t_ix, tr_ix);
+        return;
+    } else {
+        maxDark = max3v(tl, t, tr);
+        minLight = min3v(br, b, bl);
+        if (minLight > cc && minLight > maxDark) {
+            get_average(strength, image, dst,
+                ix, cc_ix, br_ix, b_ix, bl_ix);
+            return;
+        }
+    }
+
+    /* pattern 1 and 5 */
+    maxDark = max3v(cc, l, b);
+    minLight = min3v(r, t, tr);
+
+    if (minLight > maxDark) {
+        get_average(strength, image, dst,
+            ix, cc_ix, r_ix, t_ix, tr_ix);
+        return;
+    } else {
+        maxDark = max3v(cc, r, t);
+        minLight = min3v(bl, l, b);
+        if (minLight > maxDark) {
+            get_average(strength, image, dst,
+                ix, cc_ix, bl_ix, l_ix, b_ix);
+            return;
+        }
+    }
+
+    /* pattern 2 and 6 */
+    maxDark = max3v(l, tl, bl);
+    minLight = min3v(r, br, tr);
+
+    if (minLight > cc && minLight > maxDark) {
+        get_average(strength, image, dst,
+            ix, cc_ix, r_ix, br_ix, tr_ix);
+        return;
+    } else {
+        maxDark = max3v(r, br, tr);
+        minLight = min3v(l, tl, bl);
+        if (minLight > cc && minLight > maxDark) {
+            get_average(strength, image, dst,
+                ix, cc_ix, l_ix, tl_ix, bl_ix);
+            return;
+        }
+    }
+
+    /* pattern 3 and 7 */
+    maxDark = max3v(cc, l, t);
+    minLight = min3v(r, br, b);
+
+    if (minLight > maxDark) {
+        get_average(strength, image, dst,
+            ix, cc_ix, r_ix, br_ix, b_ix);
+        return;
+    } else {
+        maxDark = max3v(cc, r, b);
+        minLight = min3v(t, l, tl);
+        if (minLight > maxDark) {
+            get_average(strength, image, dst,
+                ix, cc_ix, t_ix, l_ix, tl_ix);
+            return;
+        }
+    }
+
+    /* fallback */
+    dst[ix] = quantize(image[3 * cc_ix]);
+    dst[ix + 1] = quantize(image[3 * cc_ix + 1]);
+    dst[ix + 2] = quantize(image[3 * cc_ix + 2]);
+    dst[ix + 3] = 255;
+}
+
+static void refine_row(float strength, unsigned int width, unsigned int height,
+    unsigned int stride, unsigned int i,
     float *image, float *gradients, unsigned char *dst)
 {
-    START_ACTIVITY(ACTIVITY_REFINE);
-
-    unsigned int new_width = width + 2;
-
-    #pragma omp parallel for schedule(dynamic, 1)
-    for (unsigned int i = 1; i <= height; i++) {
-        for (unsigned int j = 1; j <= width; j++) {
-            /*
-             * [tl  t tr]
-             * [ l cc  r]
-             * [bl  b br]
-             */
-            int ix = 4 * ((i - 1) * width + j - 1);
-            int cc_ix = i * new_width + j;
-            int r_ix = cc_ix + 1;
-            int l_ix = cc_ix - 1;
-            int t_ix = cc_ix - new_width;
-            int tl_ix = t_ix - 1;
-            int tr_ix = t_ix + 1;
-            int b_ix = cc_ix + new_width;
-            int bl_ix = b_ix - 1;
-            int br_ix = b_ix + 1;
-
-            float cc = gradients[cc_ix];
-            float r = gradients[r_ix];
-            float l = gradients[l_ix];
-            float t = gradients[t_ix];
-            float tl = gradients[tl_ix];
-            float tr = gradients[tr_ix];
-            float b = gradients[b_ix];
-            float bl = gradients[bl_ix];
-            float br = gradients[br_ix];
-
-            /* pattern 0 and 4 */
-            float maxDark = max3v(br, b, bl);
-            float minLight = min3v(tl, t, tr);
-
-            if (minLight > cc && minLight > maxDark) {
-                get_average(strength, image, dst,
-                    ix, cc_ix, tl_ix, t_ix, tr_ix);
-                continue;
-            } else {
-                maxDark = max3v(tl, t, tr);
-                minLight = min3v(br, b, bl);
-                if (minLight > cc && minLight > maxDark) {
-                    get_average(strength, image, dst,
-                        ix, cc_ix, br_ix, b_ix, bl_ix);
-                    continue;
-                }
-            }
+    int last = width - 1;
+    int row = i * stride;
+    int out = 4 * i * width;
+    int up = i > 0 ? -(int)stride : 0;
+    int down = i + 1 < height ? (int)stride : 0;
+
+    /* left column */
+    refine_pixel(strength, image, gradients, dst, out,
+        row, 0, last > 0 ? 1 : 0, up, down);
+
+    for (int j = 1; j < last; j++) {
+        refine_pixel(strength, image, gradients, dst, out + 4 * j,
+            row + j, -1, 1, up, down);
+    }
 
-            /* pattern 1 and 5 */
-            maxDark = max3v(cc, l, b);
-            minLight = min3v(r, t, tr);
+    /* right column */
+    if (last > 0) {
+        refine_pixel(strength, image, gradients, dst, out + 4 * last,
+            row + last, -1, 0, up, down);
+    }
+}
 
-            if (minLight > maxDark) {
-                get_average(strength, image, dst,
-                    ix, cc_ix, r_ix, t_ix, tr_ix);
-                continue;
+void Anime4kOmp::run_rows(int stage, unsigned int begin, unsigned int end,
+    row_cache *cache)
+{
+    for (unsigned int i = begin; i < end; i++) {
+        switch (stage) {
+        case STAGE_LINEAR:
+            if (scale_ == 2) {
+                linear_upscale_int_row<2>(old_width_, old_height_,
+                    stride_, i, original_, enlarge_, lum_);
+            } else if (scale_ == 3) {
+                linear_upscale_int_row<3>(old_width_, old_height_,
+                    stride_, i, original_, enlarge_, lum_);
+            } else if (scale_ == 4) {
+                linear_upscale_int_row<4>(old_width_, old_height_,
+                    stride_, i, original_, enlarge_, lum_);
             } else {
-                maxDark = max3v(cc, r, t);
-                minLight = min3v(bl, l, b);
-                if (minLight > maxDark) {
-                    get_average(strength, image, dst,
-                        ix, cc_ix, bl_ix, l_ix, b_ix);
-                    continue;
-                }
+                linear_upscale_table_row(old_width_, original_, width_,
+                    stride_, i,
+                    column_index_, column_weight_, row_index_, row_weight_,
+                    cache, enlarge_, lum_);
             }
+            break;
+        case STAGE_THINLINES:
+            thin_lines_row(strength_thinlines_, width_, height_, stride_, i,
+                enlarge_, lum_, thinlines_, lum2_);
+            break;
+        case STAGE_GRADIENT:
+            gradient_row(width_, height_, stride_, i, lum2_, gradients_);
+            break;
+        case STAGE_REFINE:
+            refine_row(strength_refine_, width_, height_, stride_, i,
+                thinlines_, gradients_, result_);
+            break;
+        }
+    }
+}
 
-            /* pattern 2 and 6 */
-            maxDark = max3v(l, tl, bl);
-            minLight = min3v(r, br, tr);
+/*
+ * One parallel region per frame: the stages are orphaned worksharing
+ * loops, separated only by the barriers their stencils need.
+ */
+void Anime4kOmp::run()
+{
+    if (wavefront_) {
+        run_wavefront();
+        return;
+    }
 
-            if (minLight > cc && minLight > maxDark) {
-                get_average(strength, image, dst,
-                    ix, cc_ix, r_ix, br_ix, tr_ix);
-                continue;
-            } else {
-                maxDark = max3v(r, br, tr);
-                minLight = min3v(l, tl, bl);
-                if (minLight > cc && minLight > maxDark) {
-                    get_average(strength, image, dst,
-                        ix, cc_ix, l_ix, tl_ix, bl_ix);
+    #pragma omp parallel
+    {
+        row_cache cache = { new float[2 * 3 * width_], { -1, -1 } };
+
+        decode(old_width_, old_height_, image_, original_);
+        finish_stage(ACTIVITY_DECODE);
+
+        start_stage(ACTIVITY_LINEAR);
+        #pragma omp for schedule(static) nowait
+        for (unsigned int i = 0; i < height_; i++) {
+            run_rows(STAGE_LINEAR, i, i + 1, &cache);
+        }
+        finish_stage(ACTIVITY_LINEAR);
+
+        start_stage(ACTIVITY_THINLINES);
+        #pragma omp for schedule(dynamic, 1) nowait
+        for (unsigned int i = 0; i < height_; i++) {
+            run_rows(STAGE_THINLINES, i, i + 1, &cache);
+        }
+        finish_stage(ACTIVITY_THINLINES);
+
+        start_stage(ACTIVITY_GRADIENT);
+        #pragma omp for schedule(static) nowait
+        for (unsigned int i = 0; i < height_; i++) {
+            run_rows(STAGE_GRADIENT, i, i + 1, &cache);
+        }
+        finish_stage(ACTIVITY_GRADIENT);
+
+        start_stage(ACTIVITY_REFINE);
+        #pragma omp for schedule(dynamic, 1) nowait
+        for (unsigned int i = 0; i < height_; i++) {
+            run_rows(STAGE_REFINE, i, i + 1, &cache);
+        }
+        FINISH_LOCAL_ACTIVITY(ACTIVITY_REFINE);
+
+        delete [] cache.rows;
+    }
+    FINISH_ACTIVITY(ACTIVITY_REFINE);
+}
+
+/*
+ * Wavefront mode: after decode, the frame is cut into bands of WAVE_BAND
+ * rows and every band of every stage is a task of its own. Band b of a
+ * stencil stage is runnable as soon as bands b - 1 .. b + 1 of the stage
+ * before it are done, so there are no barriers between stages and a
+ * consumer band mostly reads rows that were just produced and are still
+ * in cache. The bands of one stage are claimed in order, and threads try
+ * the last stage first so that the pipeline drains instead of widening.
+ */
+/* the activity each stage of run_rows() is timed as */
+static const activity_t stage_activity[] = {
+    ACTIVITY_LINEAR, ACTIVITY_THINLINES, ACTIVITY_GRADIENT, ACTIVITY_REFINE
+};
+
+void Anime4kOmp::run_wavefront()
+{
+    unsigned int bands = (height_ + WAVE_BAND - 1) / WAVE_BAND;
+    std::atomic<unsigned int> next[STAGE_COUNT];
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        next[stage] = 0;
+    }
+
+    /* band_done_ holds the frame that last completed each band */
+    if (++frame_ == 0) {
+        frame_ = 1;
+    }
+    unsigned int frame = frame_;
+
+    #pragma omp parallel
+    {
+        row_cache cache = { new float[2 * 3 * width_], { -1, -1 } };
+
+        decode(old_width_, old_height_, image_, original_);
+        finish_stage(ACTIVITY_DECODE);
+
+        start_stage(ACTIVITY_FUSED);
+        while (next[STAGE_REFINE].load(std::memory_order_relaxed) < bands) {
+            bool ran = false;
+            for (int stage = STAGE_COUNT - 1; stage >= 0 && !ran; stage--) {
+                unsigned int b = next[stage].load(std::memory_order_relaxed);
+                if (b >= bands) {
                     continue;
                 }
-            }
 
-            /* pattern 3 and 7 */
-            maxDark = max3v(cc, l, t);
-            minLight = min3v(r, br, b);
+                if (stage > 0) {
+                    std::atomic<unsigned int> *done = band_done_ + (stage - 1) * bands;
+                    unsigned int lo = b > 0 ? b - 1 : 0;
+                    unsigned int hi = b + 1 < bands ? b + 1 : b;
+                    bool ready = true;
+                    for (unsigned int k = lo; k <= hi && ready; k++) {
+                        ready = done[k].load(std::memory_order_acquire) == frame;
+                    }
+                    if (!ready) {
+                        continue;
+                    }
+                }
 
-            if (minLight > maxDark) {
-                get_average(strength, image, dst,
-                    ix, cc_ix, r_ix, br_ix, b_ix);
-                continue;
-            } else {
-                maxDark = max3v(cc, r, b);
-                minLight = min3v(t, l, tl);
-                if (minLight > maxDark) {
-                    get_average(strength, image, dst,
-                        ix, cc_ix, t_ix, l_ix, tl_ix);
+                if (!next[stage].compare_exchange_strong(b, b + 1)) {
                     continue;
                 }
+
+                unsigned int end = (b + 1) * WAVE_BAND;
+                START_ACTIVITY(stage_activity[stage]);
+                run_rows(stage, b * WAVE_BAND, end < height_ ? end : height_, &cache);
+                FINISH_LOCAL_ACTIVITY(stage_activity[stage]);
+                if (stage < STAGE_REFINE) {
+                    band_done_[stage * bands + b].store(frame, std::memory_order_release);
+                }
+                ran = true;
             }
 
-            /* fallback */
-            dst[ix] = quantize(image[3 * cc_ix]);
-            dst[ix + 1] = quantize(image[3 * cc_ix + 1]);
-            dst[ix + 2] = quantize(image[3 * cc_ix + 2]);
-            dst[ix + 3] = 255;
+            /* every runnable band is taken, wait for the ones in flight */
+            if (!ran) {
+                sched_yield();
+            }
         }
-    }
+        FINISH_LOCAL_ACTIVITY(ACTIVITY_FUSED);
 
-    /* this is the final step, no need to extend the border */
+        delete [] cache.rows;
+    }
+    FINISH_ACTIVITY(ACTIVITY_FUSED);
+}
 
-    FINISH_ACTIVITY(ACTIVITY_REFINE);
+void Anime4kOmp::set_wavefront(bool wavefront)
+{
+    wavefront_ = wavefront;
 }
 
-void Anime4kOmp::run()
+void Anime4kOmp::report_placement(FILE *f)
 {
-    decode(old_width_, old_height_, image_, original_);
-    linear_upscale(old_width_, old_height_, original_,
-        width_, height_, enlarge_);
-    compute_luminance(width_, height_, enlarge_, lum_);
-    thin_lines(strength_thinlines_, width_, height_,
-        enlarge_, lum_, thinlines_);
-    compute_luminance(width_, height_, thinlines_, lum_);
-    compute_gradient(width_, height_, lum_, gradients_);
-    refine(strength_refine_, width_, height_, thinlines_, gradients_, result_);
+    placement_stats stats = { 0, 0, 0 };
+    placement_count(original_, 3 * old_width_ * sizeof(float), old_height_, &stats);
+    placement_count(enlarge_, 3 * stride_ * sizeof(float), height_, &stats);
+    placement_count(lum_, stride_ * sizeof(float), height_, &stats);
+    placement_count(thinlines_, 3 * stride_ * sizeof(float), height_, &stats);
+    placement_count(lum2_, stride_ * sizeof(float), height_, &stats);
+    placement_count(gradients_, stride_ * sizeof(float), height_, &stats);
+    placement_count(result_, 4 * width_, height_, &stats);
+    placement_report(f, stats);
 }
 
 Anime4kOmp::~Anime4kOmp()
 {
-    delete [] original_;
-    delete [] enlarge_;
-    delete [] lum_;
-    delete [] thinlines_;
-    delete [] gradients_;
-    delete [] result_;
+    plane_free(original_);
+    plane_free(enlarge_);
+    plane_free(lum_);
+    plane_free(thinlines_);
+    plane_free(lum2_);
+    plane_free(gradients_);
+    plane_free(result_);
+    delete [] column_index_;
+    delete [] column_weight_;
+    delete [] row_index_;
+    delete [] row_weight_;
+    delete [] band_done_;
 }
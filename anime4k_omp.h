@@ -3,6 +3,11 @@
 
 #include "anime4k.h"
 
+#include <atomic>
+#include <stdio.h>
+
+struct row_cache;
+
 class Anime4kOmp : public Anime4k {
 private:
     unsigned int old_width_;
@@ -10,14 +15,40 @@ private:
     unsigned char *image_;
     unsigned int width_;
     unsigned int height_;
+    /* floats per row of the internal planes, see plane_stride() */
+    unsigned int stride_;
+    unsigned int old_capacity_;
+    unsigned int capacity_;
     float *original_;
     float *enlarge_;
     float *lum_;
     float *thinlines_;
+    /* luminance of thinlines_, lum_ is still read while it is written */
+    float *lum2_;
     float *gradients_;
     unsigned char *result_;
     float strength_thinlines_;
     float strength_refine_;
+    int scale_;
+    /* source index pairs and weights of every output column and row */
+    unsigned int column_capacity_;
+    unsigned int row_capacity_;
+    int *column_index_;
+    float *column_weight_;
+    int *row_index_;
+    float *row_weight_;
+    /* wavefront mode: frame number that last completed each row band */
+    bool wavefront_;
+    unsigned int frame_;
+    unsigned int band_capacity_;
+    std::atomic<unsigned int> *band_done_;
+    enum {
+        STAGE_LINEAR, STAGE_THINLINES, STAGE_GRADIENT, STAGE_REFINE,
+        STAGE_COUNT
+    };
+    void run_rows(int stage, unsigned int begin, unsigned int end,
+        row_cache *cache);
+    void run_wavefront();
 public:
     Anime4kOmp(
         unsigned int width, unsigned int height, unsigned char *image,
@@ -25,6 +56,16 @@ public:
     virtual ~Anime4kOmp();
     void run();
     unsigned char *get_image() { return result_; }
+    void reconfigure(
+        unsigned int width, unsigned int height, unsigned char *image,
+        unsigned int new_width, unsigned int new_height);
+    /*
+     * Run the stages as a dataflow of row bands instead of one stage
+     * after the other, see run_wavefront().
+     */
+    void set_wavefront(bool wavefront);
+    /* how many plane pages sit on the node of the threads computing them */
+    void report_placement(FILE *f);
 };
 
 #endif /* ANIME4K_OMP_H_ */
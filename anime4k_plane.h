@@ -0,0 +1,17 @@
+#ifndef ANIME4K_PLANE_H_
+#define ANIME4K_PLANE_H_
+
+#include <stdint.h>
+
+/*
+ * Element type of the intermediate planes of the ispc and cpu backends.
+ * With ANIME4K_FP16 (make HALF=1) they hold IEEE half, which the ISPC
+ * kernels convert to and from fp32 in registers.
+ */
+#ifdef ANIME4K_FP16
+typedef uint16_t plane_t;
+#else
+typedef float plane_t;
+#endif
+
+#endif /* ANIME4K_PLANE_H_ */
@@ -1,6 +1,7 @@
 #include "anime4k_seq.h"
 
 #include "instrument.h"
+#include "plane_alloc.h"
 
 #include <stdlib.h>
 #include <math.h>
@@ -26,6 +27,22 @@ static inline float max3v(float a, float b, float c) {
 Anime4kSeq::Anime4kSeq(
     unsigned int width, unsigned int height, unsigned char *image,
     unsigned int new_width, unsigned int new_height)
+{
+    old_capacity_ = 0;
+    capacity_ = 0;
+    original_ = NULL;
+    enlarge_ = NULL;
+    lum_ = NULL;
+    thinlines_ = NULL;
+    gradients_ = NULL;
+    result_ = NULL;
+
+    reconfigure(width, height, image, new_width, new_height);
+}
+
+void Anime4kSeq::reconfigure(
+    unsigned int width, unsigned int height, unsigned char *image,
+    unsigned int new_width, unsigned int new_height)
 {
     old_width_ = width;
     old_height_ = height;
@@ -33,83 +50,37 @@ Anime4kSeq::Anime4kSeq(
     width_ = new_width;
     height_ = new_height;
 
-    /* ghost pixels added to avoid out-of-bounds */
-    unsigned int old_pixels = (width + 2) * (height + 2);
-    unsigned int pixels = (new_width + 2) * (new_height + 2);
-
-    original_ = new float[3 * old_pixels];
-    enlarge_ = new float[3 * pixels];
-    lum_ = new float[pixels];
-    thinlines_ = new float[3 * pixels];
-    gradients_ = new float[pixels];
+    /* borders are clamped inside the stencils, no ghost pixels needed */
+    unsigned int old_pixels = width * height;
+    unsigned int pixels = new_width * new_height;
 
-    // result does not need ghost pixels
-    result_ = new unsigned char[4 * new_width * new_height];
-
-    strength_thinlines_ =
-        min((float)new_width / width / 6, 1.0f);
-    strength_refine_ =
-        min((float)new_width / width / 2, 1.0f);
-}
-
-static inline void extend(float *buf, unsigned int width, unsigned int height)
-{
-    unsigned int new_width = width + 2;
-
-    for (unsigned int i = 1; i <= height; i++) {
-        /* left */
-        int left = i * new_width;
-        buf[left] = buf[left + 1];
-
-        /* right */
-        int right = i * new_width + width;
-        buf[right + 1] = buf[right];
+    /* planes only grow, smaller frames use a prefix of them */
+    if (old_pixels > old_capacity_) {
+        plane_free(original_);
+        original_ = plane_new<float>(3 * old_pixels);
+        old_capacity_ = old_pixels;
     }
 
-    for (unsigned int i = 0; i < new_width; i++) {
-        /* top */
-        buf[i] = buf[i + new_width];
+    if (pixels > capacity_) {
+        plane_free(enlarge_);
+        plane_free(lum_);
+        plane_free(thinlines_);
+        plane_free(gradients_);
+        plane_free(result_);
 
-        /* bottom */
-        int bottom_from = height * new_width + i;
-        int bottom_to = bottom_from + new_width;
-        buf[bottom_to] = buf[bottom_from];
-    }
-}
+        enlarge_ = plane_new<float>(3 * pixels);
+        lum_ = plane_new<float>(pixels);
+        thinlines_ = plane_new<float>(3 * pixels);
+        gradients_ = plane_new<float>(pixels);
 
-static inline void extend_rgb(float *buf, unsigned int width, unsigned int height)
-{
-    unsigned int new_width = width + 2;
-
-    for (unsigned int i = 1; i <= height; i++) {
-        /* left */
-        int left = 3 * (i * new_width + 1);
-        buf[left - 3] = buf[left];
-        buf[left - 2] = buf[left + 1];
-        buf[left - 1] = buf[left + 2];
-
-        /* right */
-        int right = 3 * (i * new_width + width);
-        buf[right + 3] = buf[right];
-        buf[right + 4] = buf[right + 1];
-        buf[right + 5] = buf[right + 2];
+        result_ = plane_new<unsigned char>(4 * pixels);
+        capacity_ = pixels;
     }
 
-    for (unsigned int i = 0; i < new_width; i++) {
-        /* top */
-        int top_from = 3 * (new_width + i);
-        int top_to = 3 * i;
-        buf[top_to] = buf[top_from];
-        buf[top_to + 1] = buf[top_from + 1];
-        buf[top_to + 2] = buf[top_from + 2];
-
-        /* bottom */
-        int bottom_from = 3 * (height * new_width + i);
-        int bottom_to = 3 * ((height + 1) * new_width + i);
-        buf[bottom_to] = buf[bottom_from];
-        buf[bottom_to + 1] = buf[bottom_from + 1];
-        buf[bottom_to + 2] = buf[bottom_from + 2];
-    }
+    strength_thinlines_ =
+        min((float)new_width / width / 6, 1.0f);
+    strength_refine_ =
+        min((float)new_width / width / 2, 1.0f);
 }
 
 static void decode(unsigned int width, unsigned int height,
@@ -120,15 +91,13 @@ static void decode(unsigned int width, unsigned int height,
     for (unsigned int i = 0; i < height; i++) {
         for (unsigned int j = 0; j < width; j++) {
             int old_ix = 4 * (i * width + j);
-            int new_ix = 3 * ((i + 1) * (width + 2) + j + 1);
+            int new_ix = 3 * (i * width + j);
             dst[new_ix] = src[old_ix] / 255.0f;
             dst[new_ix + 1] = src[old_ix + 1] / 255.0f;
             dst[new_ix + 2] = src[old_ix + 2] / 255.0f;
         }
     }
 
-    extend_rgb(dst, width, height);
-
     FINISH_ACTIVITY(ACTIVITY_DECODE);
 }
 
@@ -147,22 +116,27 @@ static void linear_upscale(
 {
     START_ACTIVITY(ACTIVITY_LINEAR);
 
+    int maxh = old_height - 1;
+    int maxw = old_width - 1;
+
     for (unsigned int i = 0; i < height; i++) {
         for (unsigned int j = 0; j < width; j++) {
             float x = (float)(i * old_height) / height;
             float y = (float)(j * old_width) / width;
             float floor_x = floor(x);
             float floor_y = floor(y);
-            int h = (int)floor_x + 1;
-            int w = (int)floor_y + 1;
+            int ht = (int)floor_x;
+            int hb = ht < maxh ? ht + 1 : maxh;
+            int wl = (int)floor_y;
+            int wr = wl < maxw ? wl + 1 : maxw;
             float f = x - floor_x;
             float g = y - floor_y;
 
-            int ix = 3 * ((i + 1) * (width + 2) + j + 1);
-            int tl = 3 * (h * (old_width + 2) + w);
-            int tr = tl + 3;
-            int bl = tl + 3 * (old_width + 2);
-            int br = bl + 3;
+            int ix = 3 * (i * width + j);
+            int tl = 3 * (ht * old_width + wl);
+            int tr = 3 * (ht * old_width + wr);
+            int bl = 3 * (hb * old_width + wl);
+            int br = 3 * (hb * old_width + wr);
 
             dst[ix] = interpolate(
                 src[tl], src[tr],
@@ -178,8 +152,6 @@ static void linear_upscale(
         }
     }
 
-    extend_rgb(dst, width, height);
-
     FINISH_ACTIVITY(ACTIVITY_LINEAR);
 }
 
@@ -188,9 +160,9 @@ static void compute_luminance(
 {
     START_ACTIVITY(ACTIVITY_LUM);
 
-    for (unsigned int i = 0; i < height + 2; i++) {
-        for (unsigned int j = 0; j < width + 2; j++) {
-            int lum_ix = i * (width + 2) + j;
+    for (unsigned int i = 0; i < height; i++) {
+        for (unsigned int j = 0; j < width; j++) {
+            int lum_ix = i * width + j;
             int ix = 3 * lum_ix;
 
             dst[lum_ix] =
@@ -218,118 +190,141 @@ static inline void get_largest(float strength, float *image, float *lum,
     }
 }
 
+/*
+ * left, right, up and down are the offsets of the neighbours; they are 0 on the
+ * image border, which clamps the stencil to the nearest valid pixel.
+ */
+static inline void thin_lines_pixel(float strength,
+    float *image, float *lum, float *dst,
+    int cc_ix, int left, int right, int up, int down)
+{
+    /*
+     * [tl  t tr]
+     * [ l cc  r]
+     * [bl  b br]
+     */
+    int r_ix = cc_ix + right;
+    int l_ix = cc_ix + left;
+    int t_ix = cc_ix + up;
+    int tl_ix = t_ix + left;
+    int tr_ix = t_ix + right;
+    int b_ix = cc_ix + down;
+    int bl_ix = b_ix + left;
+    int br_ix = b_ix + right;
+
+    float cc = lum[cc_ix];
+    float r = lum[r_ix];
+    float l = lum[l_ix];
+    float t = lum[t_ix];
+    float tl = lum[tl_ix];
+    float tr = lum[tr_ix];
+    float b = lum[b_ix];
+    float bl = lum[bl_ix];
+    float br = lum[br_ix];
+
+    float color[4];
+    color[0] = image[3 * cc_ix];
+    color[1] = image[3 * cc_ix + 1];
+    color[2] = image[3 * cc_ix + 2];
+    color[3] = cc;
+
+    /* pattern 0 and 4 */
+    float maxDark = max3v(br, b, bl);
+    float minLight = min3v(tl, t, tr);
+
+    if (minLight > cc && minLight > maxDark) {
+        get_largest(strength, image, lum, color,
+            cc_ix, tl_ix, t_ix, tr_ix);
+    } else {
+        maxDark = max3v(tl, t, tr);
+        minLight = min3v(br, b, bl);
+        if (minLight > cc && minLight > maxDark) {
+            get_largest(strength, image, lum, color,
+                cc_ix, br_ix, b_ix, bl_ix);
+        }
+    }
+
+    /* pattern 1 and 5 */
+    maxDark = max3v(cc, l, b);
+    minLight = min3v(r, t, tr);
+
+    if (minLight > maxDark) {
+        get_largest(strength, image, lum, color,
+            cc_ix, r_ix, t_ix, tr_ix);
+    } else {
+        maxDark = max3v(cc, r, t);
+        minLight = min3v(bl, l, b);
+        if (minLight > maxDark) {
+            get_largest(strength, image, lum, color,
+                cc_ix, bl_ix, l_ix, b_ix);
+        }
+    }
+
+    /* pattern 2 and 6 */
+    maxDark = max3v(l, tl, bl);
+    minLight = min3v(r, br, tr);
+
+    if (minLight > cc && minLight > maxDark) {
+        get_largest(strength, image, lum, color,
+            cc_ix, r_ix, br_ix, tr_ix);
+    } else {
+        maxDark = max3v(r, br, tr);
+        minLight = min3v(l, tl, bl);
+        if (minLight > cc && minLight > maxDark) {
+            get_largest(strength, image, lum, color,
+                cc_ix, l_ix, tl_ix, bl_ix);
+        }
+    }
+
+    /* pattern 3 and 7 */
+    maxDark = max3v(cc, l, t);
+    minLight = min3v(r, br, b);
+
+    if (minLight > maxDark) {
+        get_largest(strength, image, lum, color,
+            cc_ix, r_ix, br_ix, b_ix);
+    } else {
+        maxDark = max3v(cc, r, b);
+        minLight = min3v(t, l, tl);
+        if (minLight > maxDark) {
+            get_largest(strength, image, lum, color,
+                cc_ix, t_ix, l_ix, tl_ix);
+        }
+    }
+
+    dst[3 * cc_ix] = color[0];
+    dst[3 * cc_ix + 1] = color[1];
+    dst[3 * cc_ix + 2] = color[2];
+}
+
 static void thin_lines(
     float strength, unsigned int width, unsigned int height,
     float *image, float *lum, float *dst)
 {
     START_ACTIVITY(ACTIVITY_THINLINES);
 
-    unsigned int new_width = width + 2;
-
-    for (unsigned int i = 1; i <= height; i++) {
-        for (unsigned int j = 1; j <= width; j++) {
-            /*
-             * [tl  t tr]
-             * [ l cc  r]
-             * [bl  b br]
-             */
-            int cc_ix = i * new_width + j;
-            int r_ix = cc_ix + 1;
-            int l_ix = cc_ix - 1;
-            int t_ix = cc_ix - new_width;
-            int tl_ix = t_ix - 1;
-            int tr_ix = t_ix + 1;
-            int b_ix = cc_ix + new_width;
-            int bl_ix = b_ix - 1;
-            int br_ix = b_ix + 1;
-
-            float cc = lum[cc_ix];
-            float r = lum[r_ix];
-            float l = lum[l_ix];
-            float t = lum[t_ix];
-            float tl = lum[tl_ix];
-            float tr = lum[tr_ix];
-            float b = lum[b_ix];
-            float bl = lum[bl_ix];
-            float br = lum[br_ix];
-
-            float color[4];
-            color[0] = image[3 * cc_ix];
-            color[1] = image[3 * cc_ix + 1];
-            color[2] = image[3 * cc_ix + 2];
-            color[3] = cc;
-
-            /* pattern 0 and 4 */
-            float maxDark = max3v(br, b, bl);
-            float minLight = min3v(tl, t, tr);
-
-            if (minLight > cc && minLight > maxDark) {
-                get_largest(strength, image, lum, color,
-                    cc_ix, tl_ix, t_ix, tr_ix);
-            } else {
-                maxDark = max3v(tl, t, tr);
-                minLight = min3v(br, b, bl);
-                if (minLight > cc && minLight > maxDark) {
-                    get_largest(strength, image, lum, color,
-                        cc_ix, br_ix, b_ix, bl_ix);
-                }
-            }
-
-            /* pattern 1 and 5 */
-            maxDark = max3v(cc, l, b);
-            minLight = min3v(r, t, tr);
-
-            if (minLight > maxDark) {
-                get_largest(strength, image, lum, color,
-                    cc_ix, r_ix, t_ix, tr_ix);
-            } else {
-                maxDark = max3v(cc, r, t);
-                minLight = min3v(bl, l, b);
-                if (minLight > maxDark) {
-                    get_largest(strength, image, lum, color,
-                        cc_ix, bl_ix, l_ix, b_ix);
-                }
-            }
-
-            /* pattern 2 and 6 */
-            maxDark = max3v(l, tl, bl);
-            minLight = min3v(r, br, tr);
-
-            if (minLight > cc && minLight > maxDark) {
-                get_largest(strength, image, lum, color,
-                    cc_ix, r_ix, br_ix, tr_ix);
-            } else {
-                maxDark = max3v(r, br, tr);
-                minLight = min3v(l, tl, bl);
-                if (minLight > cc && minLight > maxDark) {
-                    get_largest(strength, image, lum, color,
-                        cc_ix, l_ix, tl_ix, bl_ix);
-                }
-            }
-
-            /* pattern 3 and 7 */
-            maxDark = max3v(cc, l, t);
-            minLight = min3v(r, br, b);
-
-            if (minLight > maxDark) {
-                get_largest(strength, image, lum, color,
-                    cc_ix, r_ix, br_ix, b_ix);
-            } else {
-                maxDark = max3v(cc, r, b);
-                minLight = min3v(t, l, tl);
-                if (minLight > maxDark) {
-                    get_largest(strength, image, lum, color,
-                        cc_ix, t_ix, l_ix, tl_ix);
-                }
-            }
-
-            dst[3 * cc_ix] = color[0];
-            dst[3 * cc_ix + 1] = color[1];
-            dst[3 * cc_ix + 2] = color[2];
+    int last = width - 1;
+
+    for (unsigned int i = 0; i < height; i++) {
+        int row = i * width;
+        int up = i > 0 ? -(int)width : 0;
+        int down = i + 1 < height ? (int)width : 0;
+
+        /* left column */
+        thin_lines_pixel(strength, image, lum, dst,
+            row, 0, last > 0 ? 1 : 0, up, down);
+
+        for (int j = 1; j < last; j++) {
+            thin_lines_pixel(strength, image, lum, dst,
+                row + j, -1, 1, up, down);
         }
-    }
 
-    extend_rgb(dst, width, height);
+        /* right column */
+        if (last > 0) {
+            thin_lines_pixel(strength, image, lum, dst,
+                row + last, -1, 0, up, down);
+        }
+    }
 
     FINISH_ACTIVITY(ACTIVITY_THINLINES);
 }
@@ -339,59 +334,74 @@ static inline float clamp(float x, float lower, float upper)
     return x < lower ? lower : (x > upper ? upper : x);
 }
 
+static inline void gradient_pixel(float *src, float *dst,
+    int cc_ix, int left, int right, int up, int down)
+{
+    /*
+     * [tl  t tr]
+     * [ l cc  r]
+     * [bl  b br]
+     */
+    int r_ix = cc_ix + right;
+    int l_ix = cc_ix + left;
+    int t_ix = cc_ix + up;
+    int tl_ix = t_ix + left;
+    int tr_ix = t_ix + right;
+    int b_ix = cc_ix + down;
+    int bl_ix = b_ix + left;
+    int br_ix = b_ix + right;
+
+    float r = src[r_ix];
+    float l = src[l_ix];
+    float t = src[t_ix];
+    float tl = src[tl_ix];
+    float tr = src[tr_ix];
+    float b = src[b_ix];
+    float bl = src[bl_ix];
+    float br = src[br_ix];
+
+    /* Horizontal Gradient
+     * [-1  0  1]
+     * [-2  0  2]
+     * [-1  0  1]
+     */
+    float xgrad = tr - tl + r + r - l - l + br - bl;
+
+    /* Vertical Gradient
+     * [-1 -2 -1]
+     * [ 0  0  0]
+     * [ 1  2  1]
+     */
+    float ygrad = bl - tl + b + b - t - t + br - tr;
+
+    dst[cc_ix] =
+        1.0f - clamp(sqrt(xgrad * xgrad + ygrad * ygrad), 0.0f, 1.0f);
+}
+
 static void compute_gradient(unsigned int width, unsigned int height,
     float *src, float *dst)
 {
     START_ACTIVITY(ACTIVITY_GRADIENT);
 
-    unsigned int new_width = width + 2;
-
-    for (unsigned int i = 1; i <= height; i++) {
-        for (unsigned int j = 1; j <= width; j++) {
-            /*
-             * [tl  t tr]
-             * [ l cc  r]
-             * [bl  b br]
-             */
-            int cc_ix = i * new_width + j;
-            int r_ix = cc_ix + 1;
-            int l_ix = cc_ix - 1;
-            int t_ix = cc_ix - new_width;
-            int tl_ix = t_ix - 1;
-            int tr_ix = t_ix + 1;
-            int b_ix = cc_ix + new_width;
-            int bl_ix = b_ix - 1;
-            int br_ix = b_ix + 1;
-
-            float r = src[r_ix];
-            float l = src[l_ix];
-            float t = src[t_ix];
-            float tl = src[tl_ix];
-            float tr = src[tr_ix];
-            float b = src[b_ix];
-            float bl = src[bl_ix];
-            float br = src[br_ix];
-
-            /* Horizontal Gradient
-             * [-1  0  1]
-             * [-2  0  2]
-             * [-1  0  1]
-             */
-            float xgrad = tr - tl + r + r - l - l + br - bl;
-
-            /* Vertical Gradient
-             * [-1 -2 -1]
-             * [ 0  0  0]
-             * [ 1  2  1]
-             */
-            float ygrad = bl - tl + b + b - t - t + br - tr;
-
-            dst[cc_ix] =
-                1.0f - clamp(sqrt(xgrad * xgrad + ygrad * ygrad), 0.0f, 1.0f);
+    int last = width - 1;
+
+    for (unsigned int i = 0; i < height; i++) {
+        int row = i * width;
+        int up = i > 0 ? -(int)width : 0;
+        int down = i + 1 < height ? (int)width : 0;
+
+        /* left column */
+        gradient_pixel(src, dst, row, 0, last > 0 ? 1 : 0, up, down);
+
+        for (int j = 1; j < last; j++) {
+            gradient_pixel(src, dst, row + j, -1, 1, up, down);
         }
-    }
 
-    extend(dst, width, height);
+        /* right column */
+        if (last > 0) {
+            gradient_pixel(src, dst, row + last, -1, 0, up, down);
+        }
+    }
 
     FINISH_ACTIVITY(ACTIVITY_GRADIENT);
 }
@@ -418,122 +428,141 @@ static inline void get_average(float strength, float *src, unsigned char *dst,
     dst[ix + 3] = 255;
 }
 
+static inline void refine_pixel(float strength,
+    float *image, float *gradients, unsigned char *dst,
+    int cc_ix, int left, int right, int up, int down)
+{
+    /*
+     * [tl  t tr]
+     * [ l cc  r]
+     * [bl  b br]
+     */
+    int ix = 4 * cc_ix;
+    int r_ix = cc_ix + right;
+    int l_ix = cc_ix + left;
+    int t_ix = cc_ix + up;
+    int tl_ix = t_ix + left;
+    int tr_ix = t_ix + right;
+    int b_ix = cc_ix + down;
+    int bl_ix = b_ix + left;
+    int br_ix = b_ix + right;
+
+    float cc = gradients[cc_ix];
+    float r = gradients[r_ix];
+    float l = gradients[l_ix];
+    float t = gradients[t_ix];
+    float tl = gradients[tl_ix];
+    float tr = gradients[tr_ix];
+    float b = gradients[b_ix];
+    float bl = gradients[bl_ix];
+    float br = gradients[br_ix];
+
+    /* pattern 0 and 4 */
+    float maxDark = max3v(br, b, bl);
+    float minLight = min3v(tl, t, tr);
+
+    if (minLight > cc && minLight > maxDark) {
+        get_average(strength, image, dst,
+            ix, cc_ix, tl_ix, t_ix, tr_ix);
+        return;
+    } else {
+        maxDark = max3v(tl, t, tr);
+        minLight = min3v(br, b, bl);
+        if (minLight > cc && minLight > maxDark) {
+            get_average(strength, image, dst,
+                ix, cc_ix, br_ix, b_ix, bl_ix);
+            return;
+        }
+    }
+
+    /* pattern 1 and 5 */
+    maxDark = max3v(cc, l, b);
+    minLight = min3v(r, t, tr);
+
+    if (minLight > maxDark) {
+        get_average(strength, image, dst,
+            ix, cc_ix, r_ix, t_ix, tr_ix);
+        return;
+    } else {
+        maxDark = max3v(cc, r, t);
+        minLight = min3v(bl, l, b);
+        if (minLight > maxDark) {
+            get_average(strength, image, dst,
+                ix, cc_ix, bl_ix, l_ix, b_ix);
+            return;
+        }
+    }
+
+    /* pattern 2 and 6 */
+    maxDark = max3v(l, tl, bl);
+    minLight = min3v(r, br, tr);
+
+    if (minLight > cc && minLight > maxDark) {
+        get_average(strength, image, dst,
+            ix, cc_ix, r_ix, br_ix, tr_ix);
+        return;
+    } else {
+        maxDark = max3v(r, br, tr);
+        minLight = min3v(l, tl, bl);
+        if (minLight > cc && minLight > maxDark) {
+            get_average(strength, image, dst,
+                ix, cc_ix, l_ix, tl_ix, bl_ix);
+            return;
+        }
+    }
+
+    /* pattern 3 and 7 */
+    maxDark = max3v(cc, l, t);
+    minLight = min3v(r, br, b);
+
+    if (minLight > maxDark) {
+        get_average(strength, image, dst,
+            ix, cc_ix, r_ix, br_ix, b_ix);
+        return;
+    } else {
+        maxDark = max3v(cc, r, b);
+        minLight = min3v(t, l, tl);
+        if (minLight > maxDark) {
+            get_average(strength, image, dst,
+                ix, cc_ix, t_ix, l_ix, tl_ix);
+            return;
+        }
+    }
+
+    /* fallback */
+    dst[ix] = quantize(image[3 * cc_ix]);
+    dst[ix + 1] = quantize(image[3 * cc_ix + 1]);
+    dst[ix + 2] = quantize(image[3 * cc_ix + 2]);
+    dst[ix + 3] = 255;
+}
+
 static void refine(float strength, unsigned int width, unsigned int height,
     float *image, float *gradients, unsigned char *dst)
 {
     START_ACTIVITY(ACTIVITY_REFINE);
 
-    unsigned int new_width = width + 2;
-
-    for (unsigned int i = 1; i <= height; i++) {
-        for (unsigned int j = 1; j <= width; j++) {
-            /*
-             * [tl  t tr]
-             * [ l cc  r]
-             * [bl  b br]
-             */
-            int ix = 4 * ((i - 1) * width + j - 1);
-            int cc_ix = i * new_width + j;
-            int r_ix = cc_ix + 1;
-            int l_ix = cc_ix - 1;
-            int t_ix = cc_ix - new_width;
-            int tl_ix = t_ix - 1;
-            int tr_ix = t_ix + 1;
-            int b_ix = cc_ix + new_width;
-            int bl_ix = b_ix - 1;
-            int br_ix = b_ix + 1;
-
-            float cc = gradients[cc_ix];
-            float r = gradients[r_ix];
-            float l = gradients[l_ix];
-            float t = gradients[t_ix];
-            float tl = gradients[tl_ix];
-            float tr = gradients[tr_ix];
-            float b = gradients[b_ix];
-            float bl = gradients[bl_ix];
-            float br = gradients[br_ix];
-
-            /* pattern 0 and 4 */
-            float maxDark = max3v(br, b, bl);
-            float minLight = min3v(tl, t, tr);
-
-            if (minLight > cc && minLight > maxDark) {
-                get_average(strength, image, dst,
-                    ix, cc_ix, tl_ix, t_ix, tr_ix);
-                continue;
-            } else {
-                maxDark = max3v(tl, t, tr);
-                minLight = min3v(br, b, bl);
-                if (minLight > cc && minLight > maxDark) {
-                    get_average(strength, image, dst,
-                        ix, cc_ix, br_ix, b_ix, bl_ix);
-                    continue;
-                }
-            }
-
-            /* pattern 1 and 5 */
-            maxDark = max3v(cc, l, b);
-            minLight = min3v(r, t, tr);
-
-            if (minLight > maxDark) {
-                get_average(strength, image, dst,
-                    ix, cc_ix, r_ix, t_ix, tr_ix);
-                continue;
-            } else {
-                maxDark = max3v(cc, r, t);
-                minLight = min3v(bl, l, b);
-                if (minLight > maxDark) {
-                    get_average(strength, image, dst,
-                        ix, cc_ix, bl_ix, l_ix, b_ix);
-                    continue;
-                }
-            }
-
-            /* pattern 2 and 6 */
-            maxDark = max3v(l, tl, bl);
-            minLight = min3v(r, br, tr);
-
-            if (minLight > cc && minLight > maxDark) {
-                get_average(strength, image, dst,
-                    ix, cc_ix, r_ix, br_ix, tr_ix);
-                continue;
-            } else {
-                maxDark = max3v(r, br, tr);
-                minLight = min3v(l, tl, bl);
-                if (minLight > cc && minLight > maxDark) {
-                    get_average(strength, image, dst,
-                        ix, cc_ix, l_ix, tl_ix, bl_ix);
-                    continue;
-                }
-            }
-
-            /* pattern 3 and 7 */
-            maxDark = max3v(cc, l, t);
-            minLight = min3v(r, br, b);
-
-            if (minLight > maxDark) {
-                get_average(strength, image, dst,
-                    ix, cc_ix, r_ix, br_ix, b_ix);
-                continue;
-            } else {
-                maxDark = max3v(cc, r, b);
-                minLight = min3v(t, l, tl);
-                if (minLight > maxDark) {
-                    get_average(strength, image, dst,
-                        ix, cc_ix, t_ix, l_ix, tl_ix);
-                    continue;
-                }
-            }
-
-            /* fallback */
-            dst[ix] = quantize(image[3 * cc_ix]);
-            dst[ix + 1] = quantize(image[3 * cc_ix + 1]);
-            dst[ix + 2] = quantize(image[3 * cc_ix + 2]);
-            dst[ix + 3] = 255;
+    int last = width - 1;
+
+    for (unsigned int i = 0; i < height; i++) {
+        int row = i * width;
+        int up = i > 0 ? -(int)width : 0;
+        int down = i + 1 < height ? (int)width : 0;
+
+        /* left column */
+        refine_pixel(strength, image, gradients, dst,
+            row, 0, last > 0 ? 1 : 0, up, down);
+
+        for (int j = 1; j < last; j++) {
+            refine_pixel(strength, image, gradients, dst,
+                row + j, -1, 1, up, down);
         }
-    }
 
-    /* this is the final step, no need to extend the border */
+        /* right column */
+        if (last > 0) {
+            refine_pixel(strength, image, gradients, dst,
+                row + last, -1, 0, up, down);
+        }
+    }
 
     FINISH_ACTIVITY(ACTIVITY_REFINE);
 }
@@ -553,10 +582,10 @@ void Anime4kSeq::run()
 
 Anime4kSeq::~Anime4kSeq()
 {
-    delete [] original_;
-    delete [] enlarge_;
-    delete [] lum_;
-    delete [] thinlines_;
-    delete [] gradients_;
-    delete [] result_;
+    plane_free(original_);
+    plane_free(enlarge_);
+    plane_free(lum_);
+    plane_free(thinlines_);
+    plane_free(gradients_);
+    plane_free(result_);
 }
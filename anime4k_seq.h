@@ -10,6 +10,8 @@ private:
     unsigned char *image_;
     unsigned int width_;
     unsigned int height_;
+    unsigned int old_capacity_;
+    unsigned int capacity_;
     float *original_;
     float *enlarge_;
     float *lum_;
@@ -25,6 +27,9 @@ public:
     virtual ~Anime4kSeq();
     void run();
     unsigned char *get_image() { return result_; }
+    void reconfigure(
+        unsigned int width, unsigned int height, unsigned char *image,
+        unsigned int new_width, unsigned int new_height);
 };
 
 #endif /* ANIME4K_SEQ_H_ */
@@ -0,0 +1,512 @@
+#include "anime4k_stream.h"
+
+#include "instrument.h"
+#include "plane_alloc.h"
+
+#include <stdlib.h>
+#include <math.h>
+#include <omp.h>
+
+/*
+ * Rows kept per intermediate plane, one row of lag per 3x3 stencil:
+ * thin_lines(k - 1) needs enlarge k - 2 .. k,
+ * compute_gradient(k - 2) needs thinlines k - 3 .. k - 1,
+ * refine(k - 3) needs thinlines and gradient k - 4 .. k - 2.
+ */
+#define RING 4
+#define LAG 3
+
+static inline float min(float a, float b)
+{
+    return a < b ? a : b;
+}
+
+static inline float min3v(float a, float b, float c) {
+    return min(min(a, b), c);
+}
+
+static inline float max(float a, float b)
+{
+    return a > b ? a : b;
+}
+
+static inline float max3v(float a, float b, float c) {
+    return max(max(a, b), c);
+}
+
+Anime4kStream::Anime4kStream(
+    unsigned int width, unsigned int height, unsigned char *image,
+    unsigned int new_width, unsigned int new_height)
+{
+    threads_ = omp_get_max_threads();
+    ring_capacity_ = 0;
+    rings_ = NULL;
+    capacity_ = 0;
+    result_ = NULL;
+    sink_ = NULL;
+    sink_arg_ = NULL;
+
+    reconfigure(width, height, image, new_width, new_height);
+}
+
+void Anime4kStream::reconfigure(
+    unsigned int width, unsigned int height, unsigned char *image,
+    unsigned int new_width, unsigned int new_height)
+{
+    old_width_ = width;
+    old_height_ = height;
+    image_ = image;
+    width_ = new_width;
+    height_ = new_height;
+
+    /* enlarge + lum1 + thinlines + lum2 + gradient rows */
+    ring_size_ = RING * 9 * new_width;
+
+    /* rings and result only grow, smaller frames use a prefix of them */
+    if (threads_ * ring_size_ > ring_capacity_) {
+        plane_free(rings_);
+        ring_capacity_ = threads_ * ring_size_;
+        rings_ = plane_new<float>(ring_capacity_);
+    }
+
+    unsigned int pixels = new_width * new_height;
+    if (pixels > capacity_) {
+        plane_free(result_);
+        result_ = plane_new<unsigned char>(4 * pixels);
+        capacity_ = pixels;
+    }
+
+    strength_thinlines_ =
+        min((float)new_width / width / 6, 1.0f);
+    strength_refine_ =
+        min((float)new_width / width / 2, 1.0f);
+}
+
+static inline float interpolate(
+    float tl, float tr,
+    float bl, float br, float f, float g)
+{
+    float l = tl * (1 - f) + bl * f;
+    float r = tr * (1 - f) + br * f;
+    return l * (1 - g) + r * g;
+}
+
+static void linear_upscale_row(
+    unsigned int old_width, unsigned int old_height, unsigned char *src,
+    unsigned int width, unsigned int height, unsigned int i,
+    float *dst, float *lum)
+{
+    int maxh = old_height - 1;
+    int maxw = old_width - 1;
+
+    float x = (float)(i * old_height) / height;
+    float floor_x = floor(x);
+    int ht = (int)floor_x;
+    int hb = ht + 1 > maxh ? maxh : ht + 1;
+    float f = x - floor_x;
+
+    for (unsigned int j = 0; j < width; j++) {
+        float y = (float)(j * old_width) / width;
+        float floor_y = floor(y);
+        int wl = (int)floor_y;
+        int wr = wl + 1 > maxw ? maxw : wl + 1;
+        float g = y - floor_y;
+
+        int tl = 4 * (ht * old_width + wl);
+        int tr = 4 * (ht * old_width + wr);
+        int bl = 4 * (hb * old_width + wl);
+        int br = 4 * (hb * old_width + wr);
+
+        float *color = dst + 3 * j;
+        for (int c = 0; c < 3; c++) {
+            color[c] = interpolate(
+                src[tl + c] / 255.0f, src[tr + c] / 255.0f,
+                src[bl + c] / 255.0f, src[br + c] / 255.0f, f, g);
+        }
+
+        lum[j] = (color[0] * 2 + color[1] * 3 + color[2]) / 6;
+    }
+}
+
+static inline void get_largest(float strength, float color[4],
+    const float *cc, const float *a, const float *b, const float *c,
+    float lcc, float la, float lb, float lc)
+{
+    float new_lum = lcc * (1 - strength) +
+        ((la + lb + lc) / 3) * strength;
+
+    if (new_lum > color[3]) {
+        color[0] = cc[0] * (1 - strength) +
+            ((a[0] + b[0] + c[0]) / 3) * strength;
+        color[1] = cc[1] * (1 - strength) +
+            ((a[1] + b[1] + c[1]) / 3) * strength;
+        color[2] = cc[2] * (1 - strength) +
+            ((a[2] + b[2] + c[2]) / 3) * strength;
+        color[3] = new_lum;
+    }
+}
+
+static void thin_lines_row(float strength, unsigned int width,
+    float *image_t, float *image_c, float *image_b,
+    float *lum_t, float *lum_c, float *lum_b,
+    float *dst, float *dst_lum)
+{
+    for (unsigned int j = 0; j < width; j++) {
+        /* border columns take the value of the nearest valid pixel */
+        unsigned int jl = j > 0 ? j - 1 : 0;
+        unsigned int jr = j + 1 < width ? j + 1 : j;
+
+        /*
+         * [tl  t tr]
+         * [ l cc  r]
+         * [bl  b br]
+         */
+        float *cc_px = image_c + 3 * j;
+        float *r_px = image_c + 3 * jr;
+        float *l_px = image_c + 3 * jl;
+        float *t_px = image_t + 3 * j;
+        float *tl_px = image_t + 3 * jl;
+        float *tr_px = image_t + 3 * jr;
+        float *b_px = image_b + 3 * j;
+        float *bl_px = image_b + 3 * jl;
+        float *br_px = image_b + 3 * jr;
+
+        float cc = lum_c[j];
+        float r = lum_c[jr];
+        float l = lum_c[jl];
+        float t = lum_t[j];
+        float tl = lum_t[jl];
+        float tr = lum_t[jr];
+        float b = lum_b[j];
+        float bl = lum_b[jl];
+        float br = lum_b[jr];
+
+        float color[4];
+        color[0] = cc_px[0];
+        color[1] = cc_px[1];
+        color[2] = cc_px[2];
+        color[3] = cc;
+
+        /* pattern 0 and 4 */
+        float maxDark = max3v(br, b, bl);
+        float minLight = min3v(tl, t, tr);
+
+        if (minLight > cc && minLight > maxDark) {
+            get_largest(strength, color,
+                cc_px, tl_px, t_px, tr_px, cc, tl, t, tr);
+        } else {
+            maxDark = max3v(tl, t, tr);
+            minLight = min3v(br, b, bl);
+            if (minLight > cc && minLight > maxDark) {
+                get_largest(strength, color,
+                    cc_px, br_px, b_px, bl_px, cc, br, b, bl);
+            }
+        }
+
+        /* pattern 1 and 5 */
+        maxDark = max3v(cc, l, b);
+        minLight = min3v(r, t, tr);
+
+        if (minLight > maxDark) {
+            get_largest(strength, color,
+                cc_px, r_px, t_px, tr_px, cc, r, t, tr);
+        } else {
+            maxDark = max3v(cc, r, t);
+            minLight = min3v(bl, l, b);
+            if (minLight > maxDark) {
+                get_largest(strength, color,
+                    cc_px, bl_px, l_px, b_px, cc, bl, l, b);
+            }
+        }
+
+        /* pattern 2 and 6 */
+        maxDark = max3v(l, tl, bl);
+        minLight = min3v(r, br, tr);
+
+        if (minLight > cc && minLight > maxDark) {
+            get_largest(strength, color,
+                cc_px, r_px, br_px, tr_px, cc, r, br, tr);
+        } else {
+            maxDark = max3v(r, br, tr);
+            minLight = min3v(l, tl, bl);
+            if (minLight > cc && minLight > maxDark) {
+                get_largest(strength, color,
+                    cc_px, l_px, tl_px, bl_px, cc, l, tl, bl);
+            }
+        }
+
+        /* pattern 3 and 7 */
+        maxDark = max3v(cc, l, t);
+        minLight = min3v(r, br, b);
+
+        if (minLight > maxDark) {
+            get_largest(strength, color,
+                cc_px, r_px, br_px, b_px, cc, r, br, b);
+        } else {
+            maxDark = max3v(cc, r, b);
+            minLight = min3v(t, l, tl);
+            if (minLight > maxDark) {
+                get_largest(strength, color,
+                    cc_px, t_px, l_px, tl_px, cc, t, l, tl);
+            }
+        }
+
+        dst[3 * j] = color[0];
+        dst[3 * j + 1] = color[1];
+        dst[3 * j + 2] = color[2];
+        dst_lum[j] = (color[0] * 2 + color[1] * 3 + color[2]) / 6;
+    }
+}
+
+static inline float clamp(float x, float lower, float upper)
+{
+    return x < lower ? lower : (x > upper ? upper : x);
+}
+
+static void compute_gradient_row(unsigned int width,
+    float *src_t, float *src_c, float *src_b, float *dst)
+{
+    for (unsigned int j = 0; j < width; j++) {
+        unsigned int jl = j > 0 ? j - 1 : 0;
+        unsigned int jr = j + 1 < width ? j + 1 : j;
+
+        float r = src_c[jr];
+        float l = src_c[jl];
+        float t = src_t[j];
+        float tl = src_t[jl];
+        float tr = src_t[jr];
+        float b = src_b[j];
+        float bl = src_b[jl];
+        float br = src_b[jr];
+
+        /* Horizontal Gradient
+         * [-1  0  1]
+         * [-2  0  2]
+         * [-1  0  1]
+         */
+        float xgrad = tr - tl + r + r - l - l + br - bl;
+
+        /* Vertical Gradient
+         * [-1 -2 -1]
+         * [ 0  0  0]
+         * [ 1  2  1]
+         */
+        float ygrad = bl - tl + b + b - t - t + br - tr;
+
+        dst[j] =
+            1.0f - clamp(sqrt(xgrad * xgrad + ygrad * ygrad), 0.0f, 1.0f);
+    }
+}
+
+static inline unsigned char quantize(float x)
+{
+    int r = x * 255;
+    return r < 0 ? 0 : (r > 255 ? 255 : r);
+}
+
+static inline void get_average(float strength, unsigned char *dst,
+    const float *cc, const float *a, const float *b, const float *c)
+{
+    float red = cc[0] * (1 - strength) +
+        ((a[0] + b[0] + c[0]) / 3) * strength;
+    float green = cc[1] * (1 - strength) +
+        ((a[1] + b[1] + c[1]) / 3) * strength;
+    float blue = cc[2] * (1 - strength) +
+        ((a[2] + b[2] + c[2]) / 3) * strength;
+
+    dst[0] = quantize(red);
+    dst[1] = quantize(green);
+    dst[2] = quantize(blue);
+    dst[3] = 255;
+}
+
+static void refine_row(float strength, unsigned int width,
+    float *image_t, float *image_c, float *image_b,
+    float *grad_t, float *grad_c, float *grad_b, unsigned char *dst)
+{
+    for (unsigned int j = 0; j < width; j++) {
+        unsigned int jl = j > 0 ? j - 1 : 0;
+        unsigned int jr = j + 1 < width ? j + 1 : j;
+
+        /*
+         * [tl  t tr]
+         * [ l cc  r]
+         * [bl  b br]
+         */
+        unsigned char *px = dst + 4 * j;
+        float *cc_px = image_c + 3 * j;
+        float *r_px = image_c + 3 * jr;
+        float *l_px = image_c + 3 * jl;
+        float *t_px = image_t + 3 * j;
+        float *tl_px = image_t + 3 * jl;
+        float *tr_px = image_t + 3 * jr;
+        float *b_px = image_b + 3 * j;
+        float *bl_px = image_b + 3 * jl;
+        float *br_px = image_b + 3 * jr;
+
+        float cc = grad_c[j];
+        float r = grad_c[jr];
+        float l = grad_c[jl];
+        float t = grad_t[j];
+        float tl = grad_t[jl];
+        float tr = grad_t[jr];
+        float b = grad_b[j];
+        float bl = grad_b[jl];
+        float br = grad_b[jr];
+
+        /* pattern 0 and 4 */
+        float maxDark = max3v(br, b, bl);
+        float minLight = min3v(tl, t, tr);
+
+        if (minLight > cc && minLight > maxDark) {
+            get_average(strength, px, cc_px, tl_px, t_px, tr_px);
+            continue;
+        } else {
+            maxDark = max3v(tl, t, tr);
+            minLight = min3v(br, b, bl);
+            if (minLight > cc && minLight > maxDark) {
+                get_average(strength, px, cc_px, br_px, b_px, bl_px);
+                continue;
+            }
+        }
+
+        /* pattern 1 and 5 */
+        maxDark = max3v(cc, l, b);
+        minLight = min3v(r, t, tr);
+
+        if (minLight > maxDark) {
+            get_average(strength, px, cc_px, r_px, t_px, tr_px);
+            continue;
+        } else {
+            maxDark = max3v(cc, r, t);
+            minLight = min3v(bl, l, b);
+            if (minLight > maxDark) {
+                get_average(strength, px, cc_px, bl_px, l_px, b_px);
+                continue;
+            }
+        }
+
+        /* pattern 2 and 6 */
+        maxDark = max3v(l, tl, bl);
+        minLight = min3v(r, br, tr);
+
+        if (minLight > cc && minLight > maxDark) {
+            get_average(strength, px, cc_px, r_px, br_px, tr_px);
+            continue;
+        } else {
+            maxDark = max3v(r, br, tr);
+            minLight = min3v(l, tl, bl);
+            if (minLight > cc && minLight > maxDark) {
+                get_average(strength, px, cc_px, l_px, tl_px, bl_px);
+                continue;
+            }
+        }
+
+        /* pattern 3 and 7 */
+        maxDark = max3v(cc, l, t);
+        minLight = min3v(r, br, b);
+
+        if (minLight > maxDark) {
+            get_average(strength, px, cc_px, r_px, br_px, b_px);
+            continue;
+        } else {
+            maxDark = max3v(cc, r, b);
+            minLight = min3v(t, l, tl);
+            if (minLight > maxDark) {
+                get_average(strength, px, cc_px, t_px, l_px, tl_px);
+                continue;
+            }
+        }
+
+        /* fallback */
+        px[0] = quantize(cc_px[0]);
+        px[1] = quantize(cc_px[1]);
+        px[2] = quantize(cc_px[2]);
+        px[3] = 255;
+    }
+}
+
+void Anime4kStream::run_band(float *ring, unsigned int begin, unsigned int end)
+{
+    unsigned int width = width_;
+    int height = height_;
+
+    float *enlarge = ring;
+    float *lum1 = enlarge + RING * 3 * width;
+    float *thinlines = lum1 + RING * width;
+    float *lum2 = thinlines + RING * 3 * width;
+    float *gradients = lum2 + RING * width;
+
+/* ring slot of row k, rows outside the image map to the nearest valid one */
+#define SLOT(k) ((k) < 0 ? 0 : ((k) >= height ? height - 1 : (k))) % RING
+#define RGB_ROW(buf, k) ((buf) + 3 * width * (SLOT(k)))
+#define ROW(buf, k) ((buf) + width * (SLOT(k)))
+
+    int first = (int)begin;
+    int last = (int)end;
+
+    for (int k = first - LAG; k < last + LAG; k++) {
+        if (k >= 0 && k < height) {
+            linear_upscale_row(old_width_, old_height_, image_,
+                width, height, k, RGB_ROW(enlarge, k), ROW(lum1, k));
+        }
+
+        int kt = k - 1;
+        if (kt >= first - 2 && kt < last + 2 && kt >= 0 && kt < height) {
+            thin_lines_row(strength_thinlines_, width,
+                RGB_ROW(enlarge, kt - 1), RGB_ROW(enlarge, kt),
+                RGB_ROW(enlarge, kt + 1),
+                ROW(lum1, kt - 1), ROW(lum1, kt), ROW(lum1, kt + 1),
+                RGB_ROW(thinlines, kt), ROW(lum2, kt));
+        }
+
+        int kg = k - 2;
+        if (kg >= first - 1 && kg < last + 1 && kg >= 0 && kg < height) {
+            compute_gradient_row(width,
+                ROW(lum2, kg - 1), ROW(lum2, kg), ROW(lum2, kg + 1),
+                ROW(gradients, kg));
+        }
+
+        int kr = k - 3;
+        if (kr >= first && kr < last) {
+            unsigned char *dst = result_ + 4 * width * kr;
+            refine_row(strength_refine_, width,
+                RGB_ROW(thinlines, kr - 1), RGB_ROW(thinlines, kr),
+                RGB_ROW(thinlines, kr + 1),
+                ROW(gradients, kr - 1), ROW(gradients, kr),
+                ROW(gradients, kr + 1), dst);
+            if (sink_) {
+                sink_(sink_arg_, kr, dst);
+            }
+        }
+    }
+
+#undef ROW
+#undef RGB_ROW
+#undef SLOT
+}
+
+void Anime4kStream::run()
+{
+    START_ACTIVITY(ACTIVITY_FUSED);
+
+    #pragma omp parallel num_threads(threads_)
+    {
+        int id = omp_get_thread_num();
+        int count = omp_get_num_threads();
+        unsigned int begin = (unsigned long)height_ * id / count;
+        unsigned int end = (unsigned long)height_ * (id + 1) / count;
+
+        if (begin < end) {
+            run_band(rings_ + id * ring_size_, begin, end);
+        }
+    }
+
+    FINISH_ACTIVITY(ACTIVITY_FUSED);
+}
+
+Anime4kStream::~Anime4kStream()
+{
+    plane_free(rings_);
+    plane_free(result_);
+}
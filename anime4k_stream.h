@@ -0,0 +1,55 @@
+#ifndef ANIME4K_STREAM_H_
+#define ANIME4K_STREAM_H_
+
+#include "anime4k.h"
+
+/* called with each output row (4 * width bytes) as soon as it is final */
+typedef void (*row_sink_t)(void *arg, unsigned int row, unsigned char *pixels);
+
+/*
+ * Streaming CPU backend: linear_upscale -> thin_lines -> compute_gradient
+ * -> refine advance over a small ring of rows per thread, so the working
+ * memory depends on the output width instead of the frame area.
+ * Each thread streams its own band of rows; the few rows of stencil lag
+ * above a band are recomputed.
+ */
+class Anime4kStream : public Anime4k {
+private:
+    unsigned int old_width_;
+    unsigned int old_height_;
+    unsigned char *image_;
+    unsigned int width_;
+    unsigned int height_;
+    unsigned int capacity_;
+    unsigned int ring_capacity_;
+    unsigned int ring_size_;
+    int threads_;
+    float *rings_;
+    unsigned char *result_;
+    row_sink_t sink_;
+    void *sink_arg_;
+    float strength_thinlines_;
+    float strength_refine_;
+    void run_band(float *ring, unsigned int begin, unsigned int end);
+public:
+    Anime4kStream(
+        unsigned int width, unsigned int height, unsigned char *image,
+        unsigned int new_width, unsigned int new_height);
+    virtual ~Anime4kStream();
+    void run();
+    unsigned char *get_image() { return result_; }
+    void reconfigure(
+        unsigned int width, unsigned int height, unsigned char *image,
+        unsigned int new_width, unsigned int new_height);
+    /*
+     * The sink is invoked from the worker thread that finished the row,
+     * so rows of different bands arrive concurrently and out of order.
+     */
+    void set_row_sink(row_sink_t sink, void *arg)
+    {
+        sink_ = sink;
+        sink_arg_ = arg;
+    }
+};
+
+#endif /* ANIME4K_STREAM_H_ */
@@ -0,0 +1,685 @@
+#include "anime4k_tile.h"
+
+#include "instrument.h"
+#include "plane_alloc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <omp.h>
+
+/*
+ * Halo needed around an output tile:
+ * refine reads gradient and thinlines at distance 1,
+ * gradient reads luminance of thinlines at distance 1,
+ * thin_lines reads enlarge and its luminance at distance 1.
+ */
+#define PADDING 3
+
+static inline float min(float a, float b)
+{
+    return a < b ? a : b;
+}
+
+static inline float min3v(float a, float b, float c) {
+    return min(min(a, b), c);
+}
+
+static inline float max(float a, float b)
+{
+    return a > b ? a : b;
+}
+
+static inline float max3v(float a, float b, float c) {
+    return max(max(a, b), c);
+}
+
+static inline int clampi(int x, int lower, int upper)
+{
+    return x < lower ? lower : (x > upper ? upper : x);
+}
+
+/* local window of one tile, local (0, 0) is global (x0, y0) */
+struct region {
+    int x0;
+    int y0;
+    int w;
+    int h;
+    /* local range that lies inside the image */
+    int x_lo;
+    int x_hi;
+    int y_lo;
+    int y_hi;
+};
+
+Anime4kTile::Anime4kTile(
+    unsigned int width, unsigned int height, unsigned char *image,
+    unsigned int new_width, unsigned int new_height,
+    unsigned int tile_width, unsigned int tile_height)
+{
+    tile_width_ = tile_width;
+    tile_height_ = tile_height;
+
+    /* enlarge + lum + thinlines + gradient for one padded tile */
+    unsigned int pixels =
+        (tile_width + 2 * PADDING) * (tile_height + 2 * PADDING);
+    scratch_size_ = 8 * pixels;
+
+    threads_ = omp_get_max_threads();
+    scratch_ = plane_new<float>(threads_ * scratch_size_);
+
+    old_width_ = old_height_ = width_ = height_ = 0;
+    capacity_ = 0;
+    result_ = NULL;
+
+    delta_ = false;
+    delta_valid_ = false;
+    previous_ = NULL;
+    previous_capacity_ = 0;
+    delta_log_ = NULL;
+    frames_ = 0;
+    skipped_sum_ = 0;
+    skipped_min_ = 1;
+    skipped_max_ = 0;
+
+    reconfigure(width, height, image, new_width, new_height);
+}
+
+void Anime4kTile::reconfigure(
+    unsigned int width, unsigned int height, unsigned char *image,
+    unsigned int new_width, unsigned int new_height)
+{
+    /* the previous output can only be reused for the same sizes */
+    if (width != old_width_ || height != old_height_ ||
+        new_width != width_ || new_height != height_) {
+        delta_valid_ = false;
+    }
+
+    old_width_ = width;
+    old_height_ = height;
+    image_ = image;
+    width_ = new_width;
+    height_ = new_height;
+
+    /* the scratch only depends on the tile size, the result only grows */
+    unsigned int pixels = new_width * new_height;
+    if (pixels > capacity_) {
+        plane_free(result_);
+        result_ = plane_new<unsigned char>(4 * pixels);
+        capacity_ = pixels;
+    }
+
+    strength_thinlines_ =
+        min((float)new_width / width / 6, 1.0f);
+    strength_refine_ =
+        min((float)new_width / width / 2, 1.0f);
+}
+
+void Anime4kTile::set_delta(bool delta, FILE *log)
+{
+    delta_ = delta;
+    delta_valid_ = false;
+    delta_log_ = log;
+}
+
+void Anime4kTile::report_delta(FILE *f)
+{
+    if (frames_ == 0) {
+        return;
+    }
+    fprintf(f, "Skipped tiles per frame: mean %.2f%%, min %.2f%%, max %.2f%% "
+        "over %u frames\n", 100 * skipped_sum_ / frames_,
+        100 * skipped_min_, 100 * skipped_max_, frames_);
+}
+
+/*
+ * Fill the cells of ring 'margin' that fall outside the image with their
+ * nearest inside neighbour, the tile-local equivalent of extend().
+ */
+static void extend_local(float *buf, int channels, const region &r, int margin)
+{
+    int lo_x = r.x_lo > margin ? r.x_lo : margin;
+    int hi_x = r.x_hi < r.w - margin ? r.x_hi : r.w - margin;
+    int lo_y = r.y_lo > margin ? r.y_lo : margin;
+    int hi_y = r.y_hi < r.h - margin ? r.y_hi : r.h - margin;
+
+    if (lo_x > margin || hi_x < r.w - margin) {
+        for (int i = lo_y; i < hi_y; i++) {
+            float *row = buf + channels * i * r.w;
+            for (int j = margin; j < lo_x; j++) {
+                memcpy(row + channels * j, row + channels * lo_x,
+                    channels * sizeof(float));
+            }
+            for (int j = hi_x; j < r.w - margin; j++) {
+                memcpy(row + channels * j, row + channels * (hi_x - 1),
+                    channels * sizeof(float));
+            }
+        }
+    }
+
+    size_t row_bytes = channels * (r.w - 2 * margin) * sizeof(float);
+    for (int i = margin; i < lo_y; i++) {
+        memcpy(buf + channels * (i * r.w + margin),
+            buf + channels * (lo_y * r.w + margin), row_bytes);
+    }
+    for (int i = hi_y; i < r.h - margin; i++) {
+        memcpy(buf + channels * (i * r.w + margin),
+            buf + channels * ((hi_y - 1) * r.w + margin), row_bytes);
+    }
+}
+
+static inline float interpolate(
+    float tl, float tr,
+    float bl, float br, float f, float g)
+{
+    float l = tl * (1 - f) + bl * f;
+    float r = tr * (1 - f) + br * f;
+    return l * (1 - g) + r * g;
+}
+
+/* top-left source pixel of the bilinear sample of output index i */
+static inline int source_index(unsigned int i, unsigned int old_size,
+    unsigned int size)
+{
+    return (int)floor((float)(i * old_size) / size);
+}
+
+static void linear_upscale(
+    unsigned int old_width, unsigned int old_height, unsigned char *src,
+    unsigned int width, unsigned int height, const region &r, float *dst)
+{
+    int maxh = old_height - 1;
+    int maxw = old_width - 1;
+
+    for (int li = 0; li < r.h; li++) {
+        /* padded pixels take the value of the nearest valid pixel */
+        unsigned int i = clampi(r.y0 + li, 0, height - 1);
+        float x = (float)(i * old_height) / height;
+        float floor_x = floor(x);
+        int ht = (int)floor_x;
+        int hb = ht + 1 > maxh ? maxh : ht + 1;
+        float f = x - floor_x;
+
+        for (int lj = 0; lj < r.w; lj++) {
+            unsigned int j = clampi(r.x0 + lj, 0, width - 1);
+            float y = (float)(j * old_width) / width;
+            float floor_y = floor(y);
+            int wl = (int)floor_y;
+            int wr = wl + 1 > maxw ? maxw : wl + 1;
+            float g = y - floor_y;
+
+            int ix = 3 * (li * r.w + lj);
+            int tl = 4 * (ht * old_width + wl);
+            int tr = 4 * (ht * old_width + wr);
+            int bl = 4 * (hb * old_width + wl);
+            int br = 4 * (hb * old_width + wr);
+
+            for (int c = 0; c < 3; c++) {
+                dst[ix + c] = interpolate(
+                    src[tl + c] / 255.0f, src[tr + c] / 255.0f,
+                    src[bl + c] / 255.0f, src[br + c] / 255.0f, f, g);
+            }
+        }
+    }
+}
+
+static void compute_luminance(const region &r, int margin,
+    float *src, float *dst)
+{
+    for (int i = margin; i < r.h - margin; i++) {
+        for (int j = margin; j < r.w - margin; j++) {
+            int lum_ix = i * r.w + j;
+            int ix = 3 * lum_ix;
+
+            dst[lum_ix] =
+                (src[ix] * 2 + src[ix + 1] * 3 + src[ix + 2]) / 6;
+        }
+    }
+}
+
+static inline void get_largest(float strength, float *image, float *lum,
+    float color[4], int cc, int a, int b, int c)
+{
+    float new_lum = lum[cc] * (1 - strength) +
+        ((lum[a] + lum[b] + lum[c]) / 3) * strength;
+
+    if (new_lum > color[3]) {
+        color[0] = image[cc * 3] * (1 - strength) +
+            ((image[a * 3] + image[b * 3] + image[c * 3]) / 3) * strength;
+        color[1] = image[cc * 3 + 1] * (1 - strength) +
+            ((image[a * 3 + 1] + image[b * 3 + 1] + image[c * 3 + 1]) / 3) * strength;
+        color[2] = image[cc * 3 + 2] * (1 - strength) +
+            ((image[a * 3 + 2] + image[b * 3 + 2] + image[c * 3 + 2]) / 3) * strength;
+        color[3] = new_lum;
+    }
+}
+
+static void thin_lines(float strength, const region &r, int margin,
+    float *image, float *lum, float *dst)
+{
+    int lo_x = r.x_lo > margin ? r.x_lo : margin;
+    int hi_x = r.x_hi < r.w - margin ? r.x_hi : r.w - margin;
+    int lo_y = r.y_lo > margin ? r.y_lo : margin;
+    int hi_y = r.y_hi < r.h - margin ? r.y_hi : r.h - margin;
+
+    for (int i = lo_y; i < hi_y; i++) {
+        for (int j = lo_x; j < hi_x; j++) {
+            /*
+             * [tl  t tr]
+             * [ l cc  r]
+             * [bl  b br]
+             */
+            int cc_ix = i * r.w + j;
+            int r_ix = cc_ix + 1;
+            int l_ix = cc_ix - 1;
+            int t_ix = cc_ix - r.w;
+            int tl_ix = t_ix - 1;
+            int tr_ix = t_ix + 1;
+            int b_ix = cc_ix + r.w;
+            int bl_ix = b_ix - 1;
+            int br_ix = b_ix + 1;
+
+            float cc = lum[cc_ix];
+            float r = lum[r_ix];
+            float l = lum[l_ix];
+            float t = lum[t_ix];
+            float tl = lum[tl_ix];
+            float tr = lum[tr_ix];
+            float b = lum[b_ix];
+            float bl = lum[bl_ix];
+            float br = lum[br_ix];
+
+            float color[4];
+            color[0] = image[3 * cc_ix];
+            color[1] = image[3 * cc_ix + 1];
+            color[2] = image[3 * cc_ix + 2];
+            color[3] = cc;
+
+            /* pattern 0 and 4 */
+            float maxDark = max3v(br, b, bl);
+            float minLight = min3v(tl, t, tr);
+
+            if (minLight > cc && minLight > maxDark) {
+                get_largest(strength, image, lum, color,
+                    cc_ix, tl_ix, t_ix, tr_ix);
+            } else {
+                maxDark = max3v(tl, t, tr);
+                minLight = min3v(br, b, bl);
+                if (minLight > cc && minLight > maxDark) {
+                    get_largest(strength, image, lum, color,
+                        cc_ix, br_ix, b_ix, bl_ix);
+                }
+            }
+
+            /* pattern 1 and 5 */
+            maxDark = max3v(cc, l, b);
+            minLight = min3v(r, t, tr);
+
+            if (minLight > maxDark) {
+                get_largest(strength, image, lum, color,
+                    cc_ix, r_ix, t_ix, tr_ix);
+            } else {
+                maxDark = max3v(cc, r, t);
+                minLight = min3v(bl, l, b);
+                if (minLight > maxDark) {
+                    get_largest(strength, image, lum, color,
+                        cc_ix, bl_ix, l_ix, b_ix);
+                }
+            }
+
+            /* pattern 2 and 6 */
+            maxDark = max3v(l, tl, bl);
+            minLight = min3v(r, br, tr);
+
+            if (minLight > cc && minLight > maxDark) {
+                get_largest(strength, image, lum, color,
+                    cc_ix, r_ix, br_ix, tr_ix);
+            } else {
+                maxDark = max3v(r, br, tr);
+                minLight = min3v(l, tl, bl);
+                if (minLight > cc && minLight > maxDark) {
+                    get_largest(strength, image, lum, color,
+                        cc_ix, l_ix, tl_ix, bl_ix);
+                }
+            }
+
+            /* pattern 3 and 7 */
+            maxDark = max3v(cc, l, t);
+            minLight = min3v(r, br, b);
+
+            if (minLight > maxDark) {
+                get_largest(strength, image, lum, color,
+                    cc_ix, r_ix, br_ix, b_ix);
+            } else {
+                maxDark = max3v(cc, r, b);
+                minLight = min3v(t, l, tl);
+                if (minLight > maxDark) {
+                    get_largest(strength, image, lum, color,
+                        cc_ix, t_ix, l_ix, tl_ix);
+                }
+            }
+
+            dst[3 * cc_ix] = color[0];
+            dst[3 * cc_ix + 1] = color[1];
+            dst[3 * cc_ix + 2] = color[2];
+        }
+    }
+
+    extend_local(dst, 3, r, margin);
+}
+
+static inline float clamp(float x, float lower, float upper)
+{
+    return x < lower ? lower : (x > upper ? upper : x);
+}
+
+static void compute_gradient(const region &r, int margin,
+    float *src, float *dst)
+{
+    int lo_x = r.x_lo > margin ? r.x_lo : margin;
+    int hi_x = r.x_hi < r.w - margin ? r.x_hi : r.w - margin;
+    int lo_y = r.y_lo > margin ? r.y_lo : margin;
+    int hi_y = r.y_hi < r.h - margin ? r.y_hi : r.h - margin;
+
+    for (int i = lo_y; i < hi_y; i++) {
+        for (int j = lo_x; j < hi_x; j++) {
+            /*
+             * [tl  t tr]
+             * [ l cc  r]
+             * [bl  b br]
+             */
+            int cc_ix = i * r.w + j;
+            int r_ix = cc_ix + 1;
+            int l_ix = cc_ix - 1;
+            int t_ix = cc_ix - r.w;
+            int tl_ix = t_ix - 1;
+            int tr_ix = t_ix + 1;
+            int b_ix = cc_ix + r.w;
+            int bl_ix = b_ix - 1;
+            int br_ix = b_ix + 1;
+
+            float r = src[r_ix];
+            float l = src[l_ix];
+            float t = src[t_ix];
+            float tl = src[tl_ix];
+            float tr = src[tr_ix];
+            float b = src[b_ix];
+            float bl = src[bl_ix];
+            float br = src[br_ix];
+
+            /* Horizontal Gradient
+             * [-1  0  1]
+             * [-2  0  2]
+             * [-1  0  1]
+             */
+            float xgrad = tr - tl + r + r - l - l + br - bl;
+
+            /* Vertical Gradient
+             * [-1 -2 -1]
+             * [ 0  0  0]
+             * [ 1  2  1]
+             */
+            float ygrad = bl - tl + b + b - t - t + br - tr;
+
+            dst[cc_ix] =
+                1.0f - clamp(sqrt(xgrad * xgrad + ygrad * ygrad), 0.0f, 1.0f);
+        }
+    }
+
+    extend_local(dst, 1, r, margin);
+}
+
+static inline unsigned char quantize(float x)
+{
+    int r = x * 255;
+    return r < 0 ? 0 : (r > 255 ? 255 : r);
+}
+
+static inline void get_average(float strength, float *src, unsigned char *dst,
+    int ix, int cc, int a, int b, int c)
+{
+    float red = src[cc * 3] * (1 - strength) +
+        ((src[a * 3] + src[b * 3] + src[c * 3]) / 3) * strength;
+    float green = src[cc * 3 + 1] * (1 - strength) +
+        ((src[a * 3 + 1] + src[b * 3 + 1] + src[c * 3 + 1]) / 3) * strength;
+    float blue = src[cc * 3 + 2] * (1 - strength) +
+        ((src[a * 3 + 2] + src[b * 3 + 2] + src[c * 3 + 2]) / 3) * strength;
+
+    dst[ix] = quantize(red);
+    dst[ix + 1] = quantize(green);
+    dst[ix + 2] = quantize(blue);
+    dst[ix + 3] = 255;
+}
+
+static void refine(float strength, unsigned int width, const region &r,
+    int margin, float *image, float *gradients, unsigned char *dst)
+{
+    for (int i = margin; i < r.h - margin; i++) {
+        for (int j = margin; j < r.w - margin; j++) {
+            /*
+             * [tl  t tr]
+             * [ l cc  r]
+             * [bl  b br]
+             */
+            int ix = 4 * ((r.y0 + i) * width + r.x0 + j);
+            int cc_ix = i * r.w + j;
+            int r_ix = cc_ix + 1;
+            int l_ix = cc_ix - 1;
+            int t_ix = cc_ix - r.w;
+            int tl_ix = t_ix - 1;
+            int tr_ix = t_ix + 1;
+            int b_ix = cc_ix + r.w;
+            int bl_ix = b_ix - 1;
+            int br_ix = b_ix + 1;
+
+            float cc = gradients[cc_ix];
+            float r = gradients[r_ix];
+            float l = gradients[l_ix];
+            float t = gradients[t_ix];
+            float tl = gradients[tl_ix];
+            float tr = gradients[tr_ix];
+            float b = gradients[b_ix];
+            float bl = gradients[bl_ix];
+            float br = gradients[br_ix];
+
+            /* pattern 0 and 4 */
+            float maxDark = max3v(br, b, bl);
+            float minLight = min3v(tl, t, tr);
+
+            if (minLight > cc && minLight > maxDark) {
+                get_average(strength, image, dst,
+                    ix, cc_ix, tl_ix, t_ix, tr_ix);
+                continue;
+            } else {
+                maxDark = max3v(tl, t, tr);
+                minLight = min3v(br, b, bl);
+                if (minLight > cc && minLight > maxDark) {
+                    get_average(strength, image, dst,
+                        ix, cc_ix, br_ix, b_ix, bl_ix);
+                    continue;
+                }
+            }
+
+            /* pattern 1 and 5 */
+            maxDark = max3v(cc, l, b);
+            minLight = min3v(r, t, tr);
+
+            if (minLight > maxDark) {
+                get_average(strength, image, dst,
+                    ix, cc_ix, r_ix, t_ix, tr_ix);
+                continue;
+            } else {
+                maxDark = max3v(cc, r, t);
+                minLight = min3v(bl, l, b);
+                if (minLight > maxDark) {
+                    get_average(strength, image, dst,
+                        ix, cc_ix, bl_ix, l_ix, b_ix);
+                    continue;
+                }
+            }
+
+            /* pattern 2 and 6 */
+            maxDark = max3v(l, tl, bl);
+            minLight = min3v(r, br, tr);
+
+            if (minLight > cc && minLight > maxDark) {
+                get_average(strength, image, dst,
+                    ix, cc_ix, r_ix, br_ix, tr_ix);
+                continue;
+            } else {
+                maxDark = max3v(r, br, tr);
+                minLight = min3v(l, tl, bl);
+                if (minLight > cc && minLight > maxDark) {
+                    get_average(strength, image, dst,
+                        ix, cc_ix, l_ix, tl_ix, bl_ix);
+                    continue;
+                }
+            }
+
+            /* pattern 3 and 7 */
+            maxDark = max3v(cc, l, t);
+            minLight = min3v(r, br, b);
+
+            if (minLight > maxDark) {
+                get_average(strength, image, dst,
+                    ix, cc_ix, r_ix, br_ix, b_ix);
+                continue;
+            } else {
+                maxDark = max3v(cc, r, b);
+                minLight = min3v(t, l, tl);
+                if (minLight > maxDark) {
+                    get_average(strength, image, dst,
+                        ix, cc_ix, t_ix, l_ix, tl_ix);
+                    continue;
+                }
+            }
+
+            /* fallback */
+            dst[ix] = quantize(image[3 * cc_ix]);
+            dst[ix + 1] = quantize(image[3 * cc_ix + 1]);
+            dst[ix + 2] = quantize(image[3 * cc_ix + 2]);
+            dst[ix + 3] = 255;
+        }
+    }
+}
+
+void Anime4kTile::run_tile(float *scratch, unsigned int x0, unsigned int y0)
+{
+    unsigned int tw = width_ - x0 < tile_width_ ? width_ - x0 : tile_width_;
+    unsigned int th = height_ - y0 < tile_height_ ? height_ - y0 : tile_height_;
+
+    region r;
+    r.x0 = (int)x0 - PADDING;
+    r.y0 = (int)y0 - PADDING;
+    r.w = tw + 2 * PADDING;
+    r.h = th + 2 * PADDING;
+    r.x_lo = r.x0 < 0 ? -r.x0 : 0;
+    r.y_lo = r.y0 < 0 ? -r.y0 : 0;
+    r.x_hi = r.x0 + r.w > (int)width_ ? (int)width_ - r.x0 : r.w;
+    r.y_hi = r.y0 + r.h > (int)height_ ? (int)height_ - r.y0 : r.h;
+
+    unsigned int pixels = r.w * r.h;
+    float *enlarge = scratch;
+    float *lum = enlarge + 3 * pixels;
+    float *thinlines = lum + pixels;
+    float *gradients = thinlines + 3 * pixels;
+
+    linear_upscale(old_width_, old_height_, image_,
+        width_, height_, r, enlarge);
+    compute_luminance(r, 0, enlarge, lum);
+    thin_lines(strength_thinlines_, r, 1, enlarge, lum, thinlines);
+    compute_luminance(r, 1, thinlines, lum);
+    compute_gradient(r, 2, lum, gradients);
+    refine(strength_refine_, width_, r, PADDING,
+        thinlines, gradients, result_);
+}
+
+/*
+ * Whether any input pixel read by the tile at (x0, y0), halo included,
+ * differs from the previous frame. linear_upscale is monotonic, so the
+ * footprint is the source rectangle of the first and last padded pixels.
+ */
+bool Anime4kTile::tile_changed(unsigned int x0, unsigned int y0)
+{
+    unsigned int tw = width_ - x0 < tile_width_ ? width_ - x0 : tile_width_;
+    unsigned int th = height_ - y0 < tile_height_ ? height_ - y0 : tile_height_;
+
+    int x_first = clampi((int)x0 - PADDING, 0, width_ - 1);
+    int x_last = clampi((int)(x0 + tw) - 1 + PADDING, 0, width_ - 1);
+    int y_first = clampi((int)y0 - PADDING, 0, height_ - 1);
+    int y_last = clampi((int)(y0 + th) - 1 + PADDING, 0, height_ - 1);
+
+    int wl = source_index(x_first, old_width_, width_);
+    int wr = source_index(x_last, old_width_, width_) + 1;
+    int ht = source_index(y_first, old_height_, height_);
+    int hb = source_index(y_last, old_height_, height_) + 1;
+    wr = wr > (int)old_width_ - 1 ? old_width_ - 1 : wr;
+    hb = hb > (int)old_height_ - 1 ? old_height_ - 1 : hb;
+
+    size_t row_bytes = 4 * (wr - wl + 1);
+    for (int i = ht; i <= hb; i++) {
+        size_t ix = 4 * ((size_t)i * old_width_ + wl);
+        if (memcmp(image_ + ix, previous_ + ix, row_bytes) != 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Anime4kTile::run()
+{
+    START_ACTIVITY(ACTIVITY_FUSED);
+
+    unsigned int tiles_x = (width_ + tile_width_ - 1) / tile_width_;
+    unsigned int tiles_y = (height_ + tile_height_ - 1) / tile_height_;
+    int tiles = tiles_x * tiles_y;
+    bool reuse = delta_ && delta_valid_;
+    int skipped = 0;
+
+    #pragma omp parallel num_threads(threads_) reduction(+:skipped)
+    {
+        float *scratch = scratch_ + omp_get_thread_num() * scratch_size_;
+
+        #pragma omp for schedule(dynamic, 1)
+        for (int t = 0; t < tiles; t++) {
+            unsigned int x0 = (t % tiles_x) * tile_width_;
+            unsigned int y0 = (t / tiles_x) * tile_height_;
+            if (reuse && !tile_changed(x0, y0)) {
+                skipped++;
+                continue;
+            }
+            run_tile(scratch, x0, y0);
+        }
+    }
+
+    if (delta_) {
+        /* keep our own copy, callers may recycle the input buffer */
+        unsigned int pixels = old_width_ * old_height_;
+        if (pixels > previous_capacity_) {
+            plane_free(previous_);
+            previous_ = plane_new<unsigned char>(4 * pixels);
+            previous_capacity_ = pixels;
+        }
+        memcpy(previous_, image_, 4 * (size_t)pixels);
+        delta_valid_ = true;
+
+        double fraction = (double)skipped / tiles;
+        if (delta_log_) {
+            fprintf(delta_log_, "Frame %u: skipped %d of %d tiles (%.2f%%)\n",
+                frames_, skipped, tiles, 100 * fraction);
+        }
+        frames_++;
+        skipped_sum_ += fraction;
+        skipped_min_ = fraction < skipped_min_ ? fraction : skipped_min_;
+        skipped_max_ = fraction > skipped_max_ ? fraction : skipped_max_;
+    }
+
+    FINISH_ACTIVITY(ACTIVITY_FUSED);
+}
+
+Anime4kTile::~Anime4kTile()
+{
+    plane_free(scratch_);
+    plane_free(result_);
+    plane_free(previous_);
+}
@@ -0,0 +1,63 @@
+#ifndef ANIME4K_TILE_H_
+#define ANIME4K_TILE_H_
+
+#include "anime4k.h"
+
+#include <stdio.h>
+
+/*
+ * Fused CPU backend: every stage is computed per output tile with a
+ * recomputed halo, so intermediates stay in a per-thread L1/L2 resident
+ * scratch buffer instead of streaming full frames through DRAM.
+ * This mirrors the REGIONW/REGIONH/PADDING scheme of the CUDA kernel.
+ *
+ * In delta mode, meant for video, a tile is only recomputed when an input
+ * pixel it depends on (through the bilinear footprint of the tile and its
+ * halo) differs from the previous frame; the rest keep the previous output.
+ */
+class Anime4kTile : public Anime4k {
+private:
+    unsigned int old_width_;
+    unsigned int old_height_;
+    unsigned char *image_;
+    unsigned int width_;
+    unsigned int height_;
+    unsigned int capacity_;
+    unsigned int tile_width_;
+    unsigned int tile_height_;
+    unsigned int scratch_size_;
+    int threads_;
+    float *scratch_;
+    unsigned char *result_;
+    float strength_thinlines_;
+    float strength_refine_;
+    /* delta mode: previous input and whether result_ was computed from it */
+    bool delta_;
+    bool delta_valid_;
+    unsigned char *previous_;
+    unsigned int previous_capacity_;
+    FILE *delta_log_;
+    unsigned int frames_;
+    double skipped_sum_;
+    double skipped_min_;
+    double skipped_max_;
+    void run_tile(float *scratch, unsigned int x0, unsigned int y0);
+    bool tile_changed(unsigned int x0, unsigned int y0);
+public:
+    Anime4kTile(
+        unsigned int width, unsigned int height, unsigned char *image,
+        unsigned int new_width, unsigned int new_height,
+        unsigned int tile_width = 64, unsigned int tile_height = 32);
+    virtual ~Anime4kTile();
+    void run();
+    unsigned char *get_image() { return result_; }
+    void reconfigure(
+        unsigned int width, unsigned int height, unsigned char *image,
+        unsigned int new_width, unsigned int new_height);
+    /* enable delta mode, log prints the skipped fraction of every frame */
+    void set_delta(bool delta, FILE *log = NULL);
+    /* skipped tile fraction over the frames run in delta mode */
+    void report_delta(FILE *f);
+};
+
+#endif /* ANIME4K_TILE_H_ */
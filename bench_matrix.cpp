@@ -0,0 +1,412 @@
+#include "lodepng.h"
+#include "cycleTimer.h"
+#include "instrument.h"
+#include "frame_stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <getopt.h>
+#include <omp.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "anime4k.h"
+#include "anime4k_seq.h"
+#include "anime4k_cpu.h"
+#include "anime4k_omp.h"
+#include "anime4k_ispc.h"
+#include "anime4k_tile.h"
+#include "anime4k_stream.h"
+#include "anime4k_fixed.h"
+
+/*
+ * Every image upscaled by every backend to every output size with every
+ * thread count:
+ *   bench_matrix [-b BACKENDS] [-s SIZES] [-t THREADS] [-n TIMES]
+ *                [-w WARMUP] [-o RESULTS.csv] IMAGE...
+ * fps is of the mean round, speedup is against the seq median of the same
+ * image and size, efficiency against the same backend at its fewest
+ * threads. The stage columns are medians in ms. seq and ispc run once on
+ * one thread, and so does cpu on the pool of the work-stealing and
+ * pthreads task systems, labelled with its size.
+ */
+
+static const struct {
+    const char *name;
+    unsigned int width, height;
+} named_sizes[] = {
+    { "1080p", 1920, 1080 },
+    { "1440p", 2560, 1440 },
+    { "4k", 3840, 2160 },
+    { "8k", 7680, 4320 },
+};
+
+/* the stages reported, in pipeline order */
+static const activity_t stage_columns[] = {
+    ACTIVITY_DECODE, ACTIVITY_LINEAR, ACTIVITY_LUM, ACTIVITY_THINLINES,
+    ACTIVITY_GRADIENT, ACTIVITY_REFINE, ACTIVITY_FUSED
+};
+#define STAGE_COLUMNS (sizeof(stage_columns) / sizeof(stage_columns[0]))
+
+struct bench_size {
+    std::string name;
+    unsigned int width, height;
+};
+
+struct bench_row {
+    std::string image;
+    std::string size;
+    std::string backend;
+    int threads;
+    double fps;
+    double median;
+    double p99;
+    /* against seq and the fewest threads, 0 when there was none */
+    double speedup;
+    double efficiency;
+    /* median of each stage_columns entry, negative when it did not run */
+    double stage[STAGE_COLUMNS];
+};
+
+static std::vector<std::string> split(const char *list) {
+    std::vector<std::string> items;
+    std::string s(list);
+    size_t start = 0;
+    while (start <= s.size()) {
+        size_t comma = s.find(',', start);
+        if (comma == std::string::npos) {
+            comma = s.size();
+        }
+        if (comma > start) {
+            items.push_back(s.substr(start, comma - start));
+        }
+        start = comma + 1;
+    }
+    return items;
+}
+
+static bool parse_size(const std::string &s, bench_size *size) {
+    for (size_t i = 0; i < sizeof(named_sizes) / sizeof(named_sizes[0]); i++) {
+        if (strcasecmp(s.c_str(), named_sizes[i].name) == 0) {
+            size->name = named_sizes[i].name;
+            size->width = named_sizes[i].width;
+            size->height = named_sizes[i].height;
+            return true;
+        }
+    }
+    size->name = s;
+    return sscanf(s.c_str(), "%ux%u", &size->width, &size->height) == 2 &&
+        size->width > 0 && size->height > 0;
+}
+
+static const char *backend_names[] = {
+    "seq", "omp", "wave", "ispc", "cpu", "tile", "stream", "fixed"
+};
+
+/*
+ * Threads of the backends that ignore omp_set_num_threads(), 0 for those
+ * that follow it. The cpu backend follows it only under the OpenMP task
+ * system; the others start a pool of their own size on the first launch.
+ */
+static int fixed_threads(const std::string &backend) {
+    if (backend == "seq" || backend == "ispc") {
+        return 1;
+    } else if (backend == "cpu") {
+        return Anime4kCpu::task_threads();
+    }
+    return 0;
+}
+
+static Anime4k *make_backend(const std::string &backend,
+    unsigned int width, unsigned int height, unsigned char *image,
+    unsigned int new_width, unsigned int new_height) {
+    if (backend == "seq") {
+        return new Anime4kSeq(width, height, image, new_width, new_height);
+    } else if (backend == "omp") {
+        return new Anime4kOmp(width, height, image, new_width, new_height);
+    } else if (backend == "wave") {
+        Anime4kOmp *omp = new Anime4kOmp(width, height, image, new_width, new_height);
+        omp->set_wavefront(true);
+        return omp;
+    } else if (backend == "ispc") {
+        return new Anime4kIspc(width, height, image, new_width, new_height);
+    } else if (backend == "cpu") {
+        return new Anime4kCpu(width, height, image, new_width, new_height);
+    } else if (backend == "tile") {
+        return new Anime4kTile(width, height, image, new_width, new_height);
+    } else if (backend == "stream") {
+        return new Anime4kStream(width, height, image, new_width, new_height);
+    } else if (backend == "fixed") {
+        return new Anime4kFixed(width, height, image, new_width, new_height);
+    }
+    return NULL;
+}
+
+/* warm up, then time every round of one configuration */
+static void run_config(Anime4k *upscaler, int times, int warmup, bench_row *row) {
+    /* the first rounds fault in the planes and start the thread pools */
+    for (int i = 0; i < warmup; i++) {
+        upscaler->run();
+    }
+
+    track_activity(true);
+    frame_times frames;
+    double before[ACTIVITY_COUNT], after[ACTIVITY_COUNT];
+    activity_seconds(before);
+    for (int i = 0; i < times; i++) {
+        double frameStart = CycleTimer::currentSeconds();
+        upscaler->run();
+        double frameTime = CycleTimer::currentSeconds() - frameStart;
+        activity_seconds(after);
+        frame_times_add(&frames, frameTime, before, after);
+        memcpy(before, after, sizeof(before));
+    }
+    track_activity(false);
+
+    sample_stats frame = compute_stats(frames.frame);
+    row->fps = 1.0 / frame.mean;
+    row->median = frame.median;
+    row->p99 = frame.p99;
+    for (size_t k = 0; k < STAGE_COLUMNS; k++) {
+        sample_stats s = compute_stats(frames.stage[stage_columns[k]]);
+        row->stage[k] = s.max > 0.0 ? s.median : -1.0;
+    }
+}
+
+static void print_header() {
+    printf("%-24s %-10s %-7s %3s %8s %9s %9s %7s %5s", "image", "size",
+        "backend", "thr", "fps", "median", "p99", "speedup", "eff");
+    for (size_t k = 0; k < STAGE_COLUMNS; k++) {
+        printf(" %10.10s", activity_label(stage_columns[k]));
+    }
+    printf("\n");
+}
+
+static void print_row(const bench_row &r) {
+    printf("%-24s %-10s %-7s %3d %8.2f %9.3f %9.3f", r.image.c_str(),
+        r.size.c_str(), r.backend.c_str(), r.threads, r.fps, r.median * 1e3,
+        r.p99 * 1e3);
+    if (r.speedup > 0.0) {
+        printf(" %6.2fx", r.speedup);
+    } else {
+        printf(" %7s", "-");
+    }
+    if (r.efficiency > 0.0) {
+        printf(" %4.0f%%", r.efficiency * 100.0);
+    } else {
+        printf(" %5s", "-");
+    }
+    for (size_t k = 0; k < STAGE_COLUMNS; k++) {
+        if (r.stage[k] >= 0.0) {
+            printf(" %10.3f", r.stage[k] * 1e3);
+        } else {
+            printf(" %10s", "-");
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static bool write_csv(const char *path, const std::vector<bench_row> &rows) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+
+    fprintf(f, "image,size,backend,threads,fps,median_ms,p99_ms,speedup,efficiency");
+    for (size_t k = 0; k < STAGE_COLUMNS; k++) {
+        fprintf(f, ",%s_ms", activity_label(stage_columns[k]));
+    }
+    fprintf(f, "\n");
+    /* empty fields where there was no baseline or the stage did not run */
+    for (size_t i = 0; i < rows.size(); i++) {
+        const bench_row &r = rows[i];
+        fprintf(f, "%s,%s,%s,%d,%.4f,%.6f,%.6f,", r.image.c_str(),
+            r.size.c_str(), r.backend.c_str(), r.threads, r.fps,
+            r.median * 1e3, r.p99 * 1e3);
+        if (r.speedup > 0.0) {
+            fprintf(f, "%.4f", r.speedup);
+        }
+        fprintf(f, ",");
+        if (r.efficiency > 0.0) {
+            fprintf(f, "%.4f", r.efficiency);
+        }
+        for (size_t k = 0; k < STAGE_COLUMNS; k++) {
+            fprintf(f, ",");
+            if (r.stage[k] >= 0.0) {
+                fprintf(f, "%.6f", r.stage[k] * 1e3);
+            }
+        }
+        fprintf(f, "\n");
+    }
+
+    bool ok = !ferror(f);
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+static void usage(char *name) {
+    printf("Usage: %s [-b BACKENDS] [-s SIZES] [-t THREADS] [-n TIMES] [-w WARMUP] [-o RESULTS.csv] IMAGE...\n", name);
+    printf("   -b BACKENDS  Comma separated, default seq,omp,ispc,cpu; also wave,\n");
+    printf("                tile, stream and fixed\n");
+    printf("   -s SIZES     Output sizes, 1080p, 1440p, 4k, 8k or WxH,\n");
+    printf("                default 1080p,1440p,4k,8k\n");
+    printf("   -t THREADS   Thread counts of the parallel backends, default the\n");
+    printf("                powers of two below the OpenMP maximum and the maximum\n");
+    printf("   -n TIMES     Timed rounds per configuration, default 5\n");
+    printf("   -w WARMUP    Untimed rounds before them, default 1\n");
+    printf("   -o FILE      Also save the results as CSV\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *backend_list = "seq,omp,ispc,cpu";
+    const char *size_list = "1080p,1440p,4k,8k";
+    const char *thread_list = NULL;
+    const char *results = NULL;
+    int times = 5;
+    int warmup = 1;
+
+    int c;
+    while ((c = getopt(argc, argv, "b:s:t:n:w:o:h")) != -1) {
+        switch (c) {
+        case 'b':
+            backend_list = optarg;
+            break;
+        case 's':
+            size_list = optarg;
+            break;
+        case 't':
+            thread_list = optarg;
+            break;
+        case 'n':
+            times = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'o':
+            results = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc || times < 1 || warmup < 0) {
+        usage(argv[0]);
+    }
+
+    /* seq first, the speedup of every other backend is against it */
+    std::vector<std::string> backends = split(backend_list);
+    std::stable_partition(backends.begin(), backends.end(),
+        [](const std::string &b) { return b == "seq"; });
+    for (size_t b = 0; b < backends.size(); b++) {
+        const char **end = backend_names +
+            sizeof(backend_names) / sizeof(backend_names[0]);
+        if (std::find(backend_names, end, backends[b]) == end) {
+            printf("%s backend is not implemented\n", backends[b].c_str());
+            return 1;
+        }
+    }
+
+    std::vector<bench_size> sizes;
+    std::vector<std::string> size_names = split(size_list);
+    for (size_t s = 0; s < size_names.size(); s++) {
+        bench_size size;
+        if (!parse_size(size_names[s], &size)) {
+            printf("Invalid size %s\n", size_names[s].c_str());
+            return 1;
+        }
+        sizes.push_back(size);
+    }
+
+    int max_threads = omp_get_max_threads();
+    std::vector<int> threads;
+    if (thread_list) {
+        std::vector<std::string> items = split(thread_list);
+        for (size_t t = 0; t < items.size(); t++) {
+            threads.push_back(atoi(items[t].c_str()));
+            if (threads.back() < 1) {
+                printf("Invalid thread count %s\n", items[t].c_str());
+                return 1;
+            }
+        }
+    } else {
+        for (int t = 1; t < max_threads; t *= 2) {
+            threads.push_back(t);
+        }
+        threads.push_back(max_threads);
+    }
+    std::sort(threads.begin(), threads.end());
+    threads.erase(std::unique(threads.begin(), threads.end()), threads.end());
+
+    std::vector<bench_row> rows;
+    print_header();
+    for (int i = optind; i < argc; i++) {
+        unsigned char *image;
+        unsigned int width, height;
+        unsigned error = lodepng_decode32_file(&image, &width, &height, argv[i]);
+        if (error) {
+            printf("%s: error %u: %s\n", argv[i], error, lodepng_error_text(error));
+            continue;
+        }
+        const char *slash = strrchr(argv[i], '/');
+        std::string name = slash ? slash + 1 : argv[i];
+
+        for (size_t s = 0; s < sizes.size(); s++) {
+            double seq_median = 0.0;
+            for (size_t b = 0; b < backends.size(); b++) {
+                /* median at the fewest threads of this backend */
+                double base_median = 0.0;
+                int base_threads = 0;
+                int fixed = fixed_threads(backends[b]);
+                for (size_t t = 0; t < threads.size(); t++) {
+                    if (fixed && t > 0) {
+                        break;
+                    }
+                    int n = fixed ? fixed : threads[t];
+                    /* the backends size their pools when constructed */
+                    omp_set_num_threads(n);
+                    Anime4k *upscaler = make_backend(backends[b], width, height,
+                        image, sizes[s].width, sizes[s].height);
+
+                    bench_row row;
+                    row.image = name;
+                    row.size = sizes[s].name;
+                    row.backend = backends[b];
+                    row.threads = n;
+                    run_config(upscaler, times, warmup, &row);
+                    delete upscaler;
+
+                    if (backends[b] == "seq") {
+                        seq_median = row.median;
+                    }
+                    if (base_threads == 0) {
+                        base_median = row.median;
+                        base_threads = n;
+                    }
+                    row.speedup = seq_median > 0.0 ? seq_median / row.median : 0.0;
+                    row.efficiency = fixed ? 0.0 :
+                        base_threads * base_median / (n * row.median);
+                    print_row(row);
+                    rows.push_back(row);
+                }
+            }
+        }
+        free(image);
+    }
+    omp_set_num_threads(max_threads);
+
+    if (results && write_csv(results, rows)) {
+        fprintf(stderr, "Results saved to %s\n", results);
+    }
+    return 0;
+}
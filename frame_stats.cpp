@@ -0,0 +1,216 @@
+#include "frame_stats.h"
+
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+
+#define HISTOGRAM_BINS 10
+#define HISTOGRAM_WIDTH 40
+
+/* the value at or above fraction p of the sorted samples */
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    size_t rank = (size_t)ceil(p * sorted.size());
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+sample_stats compute_stats(std::vector<double> samples)
+{
+    sample_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    if (samples.empty()) {
+        return stats;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    stats.min = samples.front();
+    stats.median = percentile(samples, 0.5);
+    stats.p90 = percentile(samples, 0.9);
+    stats.p99 = percentile(samples, 0.99);
+    stats.max = samples.back();
+
+    double sum = 0.0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        sum += samples[i];
+    }
+    stats.mean = sum / samples.size();
+    double var = 0.0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        var += (samples[i] - stats.mean) * (samples[i] - stats.mean);
+    }
+    stats.stddev = sqrt(var / samples.size());
+    return stats;
+}
+
+void frame_times_add(frame_times *times, double frame,
+    const double before[ACTIVITY_COUNT], const double after[ACTIVITY_COUNT])
+{
+    times->frame.push_back(frame);
+    for (int a = 0; a < ACTIVITY_COUNT; a++) {
+        times->stage[a].push_back(after[a] - before[a]);
+    }
+}
+
+/* stages with any time, the others were not instrumented or did not run */
+static bool stage_ran(const frame_times &times, int a)
+{
+    for (size_t i = 0; i < times.stage[a].size(); i++) {
+        if (times.stage[a][i] > 0.0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void report_line(FILE *f, const char *name, const sample_stats &s)
+{
+    fprintf(f, "    %-10s %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n", name,
+        s.min * 1e3, s.median * 1e3, s.p90 * 1e3, s.p99 * 1e3, s.max * 1e3,
+        s.mean * 1e3, s.stddev * 1e3);
+}
+
+void report_frame_times(FILE *f, const frame_times &times, bool histogram)
+{
+    if (times.frame.empty()) {
+        return;
+    }
+
+    fprintf(f, "    %-10s %9s %9s %9s %9s %9s %9s %9s\n", "ms",
+        "min", "median", "p90", "p99", "max", "mean", "stddev");
+    sample_stats frame = compute_stats(times.frame);
+    report_line(f, "frame", frame);
+    for (int a = 1; a < ACTIVITY_COUNT; a++) {
+        if (stage_ran(times, a)) {
+            report_line(f, activity_label((activity_t)a),
+                compute_stats(times.stage[a]));
+        }
+    }
+
+    if (!histogram || times.frame.size() < 2 || frame.max <= frame.min) {
+        return;
+    }
+
+    /* frame times in equal bins from min to max */
+    unsigned int bins[HISTOGRAM_BINS] = {};
+    unsigned int most = 0;
+    double width = (frame.max - frame.min) / HISTOGRAM_BINS;
+    for (size_t i = 0; i < times.frame.size(); i++) {
+        int b = (int)((times.frame[i] - frame.min) / width);
+        b = b < HISTOGRAM_BINS ? b : HISTOGRAM_BINS - 1;
+        most = std::max(most, ++bins[b]);
+    }
+    fprintf(f, "    Frame times:\n");
+    for (int b = 0; b < HISTOGRAM_BINS; b++) {
+        int bar = (bins[b] * HISTOGRAM_WIDTH + most - 1) / most;
+        fprintf(f, "    %9.3f ms %6u %.*s\n", (frame.min + b * width) * 1e3,
+            bins[b], bar, "########################################");
+    }
+}
+
+/*
+ * kind is "sample" for an iteration, with its number in iteration, and
+ * "stat" for a summary, named in stat; the other of the two is empty.
+ */
+static void write_csv(FILE *f, const frame_times &times)
+{
+    fprintf(f, "kind,iteration,stat,frame_ms");
+    for (int a = 1; a < ACTIVITY_COUNT; a++) {
+        if (stage_ran(times, a)) {
+            fprintf(f, ",%s_ms", activity_label((activity_t)a));
+        }
+    }
+    fprintf(f, "\n");
+
+    for (size_t i = 0; i < times.frame.size(); i++) {
+        fprintf(f, "sample,%zu,,%.6f", i, times.frame[i] * 1e3);
+        for (int a = 1; a < ACTIVITY_COUNT; a++) {
+            if (stage_ran(times, a)) {
+                fprintf(f, ",%.6f", times.stage[a][i] * 1e3);
+            }
+        }
+        fprintf(f, "\n");
+    }
+
+    /* the stats as rows of their own after the samples */
+    static const struct {
+        const char *name;
+        double sample_stats::*field;
+    } rows[] = {
+        { "min", &sample_stats::min },
+        { "median", &sample_stats::median },
+        { "p90", &sample_stats::p90 },
+        { "p99", &sample_stats::p99 },
+        { "max", &sample_stats::max },
+        { "mean", &sample_stats::mean },
+        { "stddev", &sample_stats::stddev }
+    };
+    std::vector<sample_stats> stats;
+    stats.push_back(compute_stats(times.frame));
+    for (int a = 1; a < ACTIVITY_COUNT; a++) {
+        if (stage_ran(times, a)) {
+            stats.push_back(compute_stats(times.stage[a]));
+        }
+    }
+    for (size_t r = 0; r < sizeof(rows) / sizeof(rows[0]); r++) {
+        fprintf(f, "stat,,%s", rows[r].name);
+        for (size_t k = 0; k < stats.size(); k++) {
+            fprintf(f, ",%.6f", stats[k].*rows[r].field * 1e3);
+        }
+        fprintf(f, "\n");
+    }
+}
+
+static void write_json_series(FILE *f, const char *name,
+    const std::vector<double> &samples, bool first)
+{
+    sample_stats s = compute_stats(samples);
+    fprintf(f, "%s\n    \"%s\": {\"min\": %.6f, \"median\": %.6f, \"p90\": %.6f, "
+        "\"p99\": %.6f, \"max\": %.6f, \"mean\": %.6f, \"stddev\": %.6f,\n"
+        "      \"samples\": [", first ? "" : ",", name, s.min * 1e3,
+        s.median * 1e3, s.p90 * 1e3, s.p99 * 1e3, s.max * 1e3, s.mean * 1e3,
+        s.stddev * 1e3);
+    for (size_t i = 0; i < samples.size(); i++) {
+        fprintf(f, "%s%.6f", i ? ", " : "", samples[i] * 1e3);
+    }
+    fprintf(f, "]}");
+}
+
+static void write_json(FILE *f, const frame_times &times, int warmup)
+{
+    fprintf(f, "{\n  \"unit\": \"ms\",\n  \"warmup\": %d,\n  \"iterations\": %zu,\n"
+        "  \"times\": {", warmup, times.frame.size());
+    write_json_series(f, "frame", times.frame, true);
+    for (int a = 1; a < ACTIVITY_COUNT; a++) {
+        if (stage_ran(times, a)) {
+            write_json_series(f, activity_label((activity_t)a),
+                times.stage[a], false);
+        }
+    }
+    fprintf(f, "\n  }\n}\n");
+}
+
+bool write_frame_times(const char *path, const frame_times &times,
+    int warmup)
+{
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return false;
+    }
+
+    const char *dot = strrchr(path, '.');
+    if (dot && strcasecmp(dot + 1, "csv") == 0) {
+        write_csv(f, times);
+    } else {
+        write_json(f, times, warmup);
+    }
+
+    bool ok = !ferror(f);
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return false;
+    }
+    return true;
+}
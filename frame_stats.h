@@ -0,0 +1,51 @@
+#ifndef FRAME_STATS_H_
+#define FRAME_STATS_H_
+
+#include <stdio.h>
+
+#include <vector>
+
+#include "instrument.h"
+
+/*
+ * Per-iteration times of the benchmark loop of upscale, for the whole
+ * frame and for every global activity (the stages, when instrumented),
+ * in seconds.
+ */
+struct frame_times {
+    std::vector<double> frame;
+    std::vector<double> stage[ACTIVITY_COUNT];
+};
+
+struct sample_stats {
+    double min;
+    double median;
+    double p90;
+    double p99;
+    double max;
+    double mean;
+    double stddev;
+};
+
+/* nearest-rank percentiles and the population standard deviation */
+sample_stats compute_stats(std::vector<double> samples);
+
+/*
+ * Add one iteration: its frame time, and the stage times as the
+ * difference of two activity_seconds() snapshots around it.
+ */
+void frame_times_add(frame_times *times, double frame,
+    const double before[ACTIVITY_COUNT], const double after[ACTIVITY_COUNT]);
+
+/* stats of the frame and of each stage that ran, a histogram of frames */
+void report_frame_times(FILE *f, const frame_times &times, bool histogram);
+
+/*
+ * Every iteration and the stats, as CSV when path ends in .csv and as
+ * JSON otherwise. CSV rows are told apart by a kind column of sample or
+ * stat. False on an I/O error.
+ */
+bool write_frame_times(const char *path, const frame_times &times,
+    int warmup);
+
+#endif /* FRAME_STATS_H_ */
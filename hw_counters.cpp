@@ -0,0 +1,246 @@
+#include "hw_counters.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <atomic>
+
+/* uncore memory controllers, one per channel group and socket */
+#define MAX_DRAM_FDS 256
+#define MAX_SOCKETS 16
+
+/* perf type and config of the per-thread counters, the group leader first */
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} counter_event[HW_DRAM_BYTES] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+
+/* the counters of one thread, read together as one perf group */
+struct thread_counters {
+    bool opened;
+    int leader;
+    int members;
+    /* position of each counter in the group read, -1 if not counted */
+    int index[HW_DRAM_BYTES];
+};
+
+static thread_local thread_counters counters = { false, -1, 0, {} };
+static std::atomic<unsigned int> available(0);
+static std::atomic<bool> have_error(false);
+static char error[128];
+
+static int dram_fds[MAX_DRAM_FDS];
+static int dram_count = 0;
+static bool dram_tried = false;
+
+static int perf_event_open(perf_event_attr *attr, pid_t pid, int cpu, int group)
+{
+    return syscall(SYS_perf_event_open, attr, pid, cpu, group, 0);
+}
+
+bool hw_counters_open()
+{
+    if (counters.opened) {
+        return counters.leader >= 0;
+    }
+    counters.opened = true;
+
+    for (int c = 0; c < HW_DRAM_BYTES; c++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter_event[c].type;
+        attr.config = counter_event[c].config;
+        attr.read_format = PERF_FORMAT_GROUP |
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        int fd = perf_event_open(&attr, 0, -1, counters.leader);
+        if (fd < 0) {
+            counters.index[c] = -1;
+            if (c == HW_CYCLES && !have_error.exchange(true)) {
+                snprintf(error, sizeof(error), "%s", strerror(errno));
+            }
+            continue;
+        }
+        if (counters.leader < 0) {
+            counters.leader = fd;
+        }
+        counters.index[c] = counters.members++;
+        available.fetch_or(1u << c, std::memory_order_relaxed);
+    }
+    return counters.leader >= 0;
+}
+
+void hw_counters_read(hw_sample *sample)
+{
+    memset(sample, 0, sizeof(*sample));
+    if (counters.leader < 0) {
+        return;
+    }
+
+    /* nr, time enabled, time running, then one value per member */
+    uint64_t data[3 + HW_DRAM_BYTES];
+    if (read(counters.leader, data, sizeof(data)) < (ssize_t)(3 * sizeof(uint64_t))) {
+        return;
+    }
+    uint64_t enabled = data[1], running = data[2];
+    for (int c = 0; c < HW_DRAM_BYTES; c++) {
+        if (counters.index[c] < 0) {
+            continue;
+        }
+        uint64_t value = data[3 + counters.index[c]];
+        /* scale up when the group was multiplexed with other events */
+        if (running > 0 && running < enabled) {
+            value = (uint64_t)((double)value * enabled / running);
+        }
+        sample->value[c] = value;
+    }
+}
+
+/* config of an event file like "event=0x04,umask=0x03" */
+static bool read_event(const char *path, uint64_t *config)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    unsigned int event = 0, umask = 0;
+    int n = fscanf(f, "event=%x,umask=%x", &event, &umask);
+    fclose(f);
+    *config = event | (uint64_t)umask << 8;
+    return n >= 1;
+}
+
+static bool read_int(const char *path, int *value)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    int n = fscanf(f, "%d", value);
+    fclose(f);
+    return n == 1;
+}
+
+/* CPUs of a cpumask list like "0,28" or "0-1", at most max of them */
+static int read_cpus(const char *path, int *cpus, int max)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    int count = 0, first, last;
+    while (count < max && fscanf(f, "%d", &first) == 1) {
+        last = first;
+        int c = fgetc(f);
+        if (c == '-' && fscanf(f, "%d", &last) == 1) {
+            c = fgetc(f);
+        }
+        for (int cpu = first; cpu <= last && count < max; cpu++) {
+            cpus[count++] = cpu;
+        }
+        if (c != ',') {
+            break;
+        }
+    }
+    fclose(f);
+    return count;
+}
+
+bool hw_dram_open()
+{
+    if (dram_tried) {
+        return dram_count > 0;
+    }
+    dram_tried = true;
+
+    const char *root = "/sys/bus/event_source/devices";
+    DIR *dir = opendir(root);
+    if (!dir) {
+        return false;
+    }
+
+    /* Intel's IMC PMUs, counted system wide on one CPU of every socket */
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "uncore_imc_", 11) != 0) {
+            continue;
+        }
+        char path[512];
+        int type, cpus[MAX_SOCKETS];
+        snprintf(path, sizeof(path), "%s/%s/type", root, entry->d_name);
+        if (!read_int(path, &type)) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s/cpumask", root, entry->d_name);
+        int sockets = read_cpus(path, cpus, MAX_SOCKETS);
+        if (sockets == 0) {
+            cpus[0] = 0;
+            sockets = 1;
+        }
+
+        static const char *events[] = { "cas_count_read", "cas_count_write" };
+        for (int k = 0; k < 2 && dram_count < MAX_DRAM_FDS; k++) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = type;
+            snprintf(path, sizeof(path), "%s/%s/events/%s", root,
+                entry->d_name, events[k]);
+            uint64_t config;
+            if (!read_event(path, &config)) {
+                continue;
+            }
+            attr.config = config;
+            for (int s = 0; s < sockets && dram_count < MAX_DRAM_FDS; s++) {
+                int fd = perf_event_open(&attr, -1, cpus[s], -1);
+                if (fd >= 0) {
+                    dram_fds[dram_count++] = fd;
+                }
+            }
+        }
+    }
+    closedir(dir);
+
+    if (dram_count > 0) {
+        available.fetch_or(1u << HW_DRAM_BYTES, std::memory_order_relaxed);
+    }
+    return dram_count > 0;
+}
+
+unsigned long long hw_dram_bytes()
+{
+    unsigned long long lines = 0;
+    for (int i = 0; i < dram_count; i++) {
+        uint64_t value;
+        if (read(dram_fds[i], &value, sizeof(value)) == sizeof(value)) {
+            lines += value;
+        }
+    }
+    /* every CAS moves one 64-byte line */
+    return lines * 64;
+}
+
+unsigned int hw_counters_available()
+{
+    return available.load(std::memory_order_relaxed);
+}
+
+const char *hw_counters_error()
+{
+    return have_error.load() ? error : NULL;
+}
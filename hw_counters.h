@@ -0,0 +1,40 @@
+#ifndef HW_COUNTERS_H_
+#define HW_COUNTERS_H_
+
+/*
+ * Hardware performance counters of the calling thread, through
+ * perf_event_open. Every counter is optional: a PMU missing in a VM or
+ * container, or perf_event_paranoid, leaves the counter out and the
+ * others still count. User space only, so paranoid up to 2 is enough.
+ */
+enum hw_counter {
+    HW_CYCLES, HW_INSTRUCTIONS, HW_LLC_MISSES, HW_BRANCH_MISSES,
+    HW_PAGE_FAULTS,
+    /* bytes moved by the memory controllers, system wide (uncore IMC) */
+    HW_DRAM_BYTES,
+    HW_COUNTER_COUNT
+};
+
+struct hw_sample {
+    unsigned long long value[HW_COUNTER_COUNT];
+};
+
+/*
+ * Open the per-thread counters of the calling thread, once per thread.
+ * False if none of them could be opened.
+ */
+bool hw_counters_open();
+/* the current counts of the calling thread, zero where not counted */
+void hw_counters_read(hw_sample *sample);
+
+/* the memory controller counters, opened once for the process */
+bool hw_dram_open();
+/* bytes read and written by all memory controllers so far */
+unsigned long long hw_dram_bytes();
+
+/* bit i set if counter i opened on some thread */
+unsigned int hw_counters_available();
+/* why the cycle counter could not be opened, NULL if it could */
+const char *hw_counters_error();
+
+#endif /* HW_COUNTERS_H_ */
@@ -0,0 +1,206 @@
+#include "image_write.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+image_format image_format_from_name(const char *filename)
+{
+    static const struct {
+        const char *ext;
+        image_format format;
+    } formats[] = {
+        { "ppm", IMAGE_PPM },
+        { "pam", IMAGE_PAM },
+        { "rgba", IMAGE_RGBA },
+        { "rgb", IMAGE_RGB },
+        { "qoi", IMAGE_QOI }
+    };
+
+    const char *dot = strrchr(filename, '.');
+    if (!dot) {
+        return IMAGE_PNG;
+    }
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        if (strcasecmp(dot + 1, formats[i].ext) == 0) {
+            return formats[i].format;
+        }
+    }
+    return IMAGE_PNG;
+}
+
+static bool is_opaque(const unsigned char *image, size_t pixels)
+{
+    for (size_t i = 0; i < pixels; i++) {
+        if (image[4 * i + 3] != 255) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* write pixels as RGBA, or as RGB packed a row at a time */
+static bool write_pixels(FILE *f, const unsigned char *image,
+    unsigned int width, unsigned int height, bool alpha)
+{
+    if (alpha) {
+        size_t bytes = 4 * (size_t)width * height;
+        return fwrite(image, 1, bytes, f) == bytes;
+    }
+
+    unsigned char *row = (unsigned char *)malloc(3 * (size_t)width);
+    bool ok = row != NULL;
+    for (unsigned int i = 0; i < height && ok; i++) {
+        const unsigned char *src = image + 4 * (size_t)width * i;
+        for (unsigned int j = 0; j < width; j++) {
+            row[3 * j + 0] = src[4 * j + 0];
+            row[3 * j + 1] = src[4 * j + 1];
+            row[3 * j + 2] = src[4 * j + 2];
+        }
+        ok = fwrite(row, 1, 3 * (size_t)width, f) == 3 * (size_t)width;
+    }
+    free(row);
+    return ok;
+}
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+
+static inline void put32(unsigned char *p, unsigned int x)
+{
+    p[0] = x >> 24;
+    p[1] = x >> 16;
+    p[2] = x >> 8;
+    p[3] = x;
+}
+
+/* encode to QOI (qoiformat.org), worst case 5 bytes per pixel */
+static size_t qoi_encode(unsigned char *out, const unsigned char *image,
+    unsigned int width, unsigned int height, bool alpha)
+{
+    static const unsigned char padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    unsigned char index[64][4];
+    unsigned char prev[4] = { 0, 0, 0, 255 };
+    size_t pixels = (size_t)width * height;
+    size_t p = 0;
+    int run = 0;
+
+    memcpy(out, "qoif", 4);
+    put32(out + 4, width);
+    put32(out + 8, height);
+    out[12] = alpha ? 4 : 3;
+    out[13] = 0; /* sRGB with linear alpha */
+    p = 14;
+    memset(index, 0, sizeof(index));
+
+    for (size_t i = 0; i < pixels; i++) {
+        const unsigned char *px = image + 4 * i;
+        unsigned char a = alpha ? px[3] : 255;
+
+        if (px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2] && a == prev[3]) {
+            if (++run == 62 || i == pixels - 1) {
+                out[p++] = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            out[p++] = QOI_OP_RUN | (run - 1);
+            run = 0;
+        }
+
+        int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + a * 11) % 64;
+        if (index[hash][0] == px[0] && index[hash][1] == px[1] &&
+            index[hash][2] == px[2] && index[hash][3] == a) {
+            out[p++] = QOI_OP_INDEX | hash;
+        } else {
+            index[hash][0] = px[0];
+            index[hash][1] = px[1];
+            index[hash][2] = px[2];
+            index[hash][3] = a;
+
+            if (a == prev[3]) {
+                signed char vr = px[0] - prev[0];
+                signed char vg = px[1] - prev[1];
+                signed char vb = px[2] - prev[2];
+                signed char vg_r = vr - vg;
+                signed char vg_b = vb - vg;
+
+                if (vr >= -2 && vr <= 1 && vg >= -2 && vg <= 1 && vb >= -2 && vb <= 1) {
+                    out[p++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                } else if (vg_r >= -8 && vg_r <= 7 && vg >= -32 && vg <= 31 &&
+                    vg_b >= -8 && vg_b <= 7) {
+                    out[p++] = QOI_OP_LUMA | (vg + 32);
+                    out[p++] = (vg_r + 8) << 4 | (vg_b + 8);
+                } else {
+                    out[p++] = QOI_OP_RGB;
+                    out[p++] = px[0];
+                    out[p++] = px[1];
+                    out[p++] = px[2];
+                }
+            } else {
+                out[p++] = QOI_OP_RGBA;
+                out[p++] = px[0];
+                out[p++] = px[1];
+                out[p++] = px[2];
+                out[p++] = a;
+            }
+        }
+
+        prev[0] = px[0];
+        prev[1] = px[1];
+        prev[2] = px[2];
+        prev[3] = a;
+    }
+
+    memcpy(out + p, padding, sizeof(padding));
+    return p + sizeof(padding);
+}
+
+bool image_write_file(const char *filename, image_format format,
+    const unsigned char *image, unsigned int width, unsigned int height)
+{
+    FILE *f = fopen(filename, "wb");
+    if (!f) {
+        return false;
+    }
+
+    size_t pixels = (size_t)width * height;
+    bool alpha = format == IMAGE_RGBA;
+    if (format == IMAGE_PAM || format == IMAGE_QOI) {
+        alpha = !is_opaque(image, pixels);
+    }
+
+    bool ok = true;
+    switch (format) {
+    case IMAGE_PPM:
+        ok = fprintf(f, "P6\n%u %u\n255\n", width, height) > 0;
+        break;
+    case IMAGE_PAM:
+        ok = fprintf(f, "P7\nWIDTH %u\nHEIGHT %u\nDEPTH %d\nMAXVAL 255\n"
+            "TUPLTYPE %s\nENDHDR\n", width, height, alpha ? 4 : 3,
+            alpha ? "RGB_ALPHA" : "RGB") > 0;
+        break;
+    default:
+        break;
+    }
+
+    if (ok && format == IMAGE_QOI) {
+        unsigned char *out = (unsigned char *)malloc(14 + 5 * pixels + 8);
+        ok = out != NULL;
+        if (ok) {
+            size_t size = qoi_encode(out, image, width, height, alpha);
+            ok = fwrite(out, 1, size, f) == size;
+        }
+        free(out);
+    } else if (ok) {
+        ok = write_pixels(f, image, width, height, alpha);
+    }
+
+    return fclose(f) == 0 && ok;
+}
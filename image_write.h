@@ -0,0 +1,31 @@
+#ifndef IMAGE_WRITE_H_
+#define IMAGE_WRITE_H_
+
+/*
+ * Uncompressed or cheaply compressed writers for handing frames to the next
+ * tool in a pipeline, selected by the file extension:
+ *   .ppm   binary PPM (P6), always RGB
+ *   .pam   PAM (P7), RGB_ALPHA or RGB
+ *   .rgba  raw RGBA, .rgb raw RGB
+ *   .qoi   QOI, 4 or 3 channels
+ * PAM and QOI drop the alpha channel when every pixel is opaque, which is
+ * always the case for Anime4k output.
+ */
+
+enum image_format {
+    IMAGE_PNG,
+    IMAGE_PPM,
+    IMAGE_PAM,
+    IMAGE_RGBA,
+    IMAGE_RGB,
+    IMAGE_QOI
+};
+
+/* format for filename from its extension, IMAGE_PNG when unknown */
+image_format image_format_from_name(const char *filename);
+
+/* write an 8-bit RGBA image in a non-PNG format, false on an I/O error */
+bool image_write_file(const char *filename, image_format format,
+    const unsigned char *image, unsigned int width, unsigned int height);
+
+#endif /* IMAGE_WRITE_H_ */
@@ -4,70 +4,424 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <atomic>
+
 #include "cycleTimer.h"
+#include "hw_counters.h"
 #include "instrument.h"
 
 #define MAX_THREAD 64
+#define MAX_DEPTH 8
+/* spans per trace buffer chunk */
+#define TRACE_CHUNK 4096
+
+typedef CycleTimer::SysClock ticks_t;
 
 /* Instrument different sections of program */
 static const char *activity_name[ACTIVITY_COUNT] = {
     "overhead", "decode", "linear", "luminance",
-    "thin_lines", "gradient", "refine"
+    "thin_lines", "gradient", "refine", "fused",
+    "read", "write"
+};
+
+/* an open activity on the stack of one thread */
+struct open_activity {
+    activity_t activity;
+    ticks_t start;
+    hw_sample counters;
+};
+
+struct thread_activity {
+    /* row of accum, -1 past MAX_THREAD threads, -2 before the first use */
+    int slot;
+    int depth;
+    open_activity stack[MAX_DEPTH];
+};
+
+/* busy ticks of one thread, a cache line per thread */
+struct alignas(64) thread_accum {
+    ticks_t ticks[ACTIVITY_COUNT];
+};
+
+/* counter totals of one thread, by activity */
+struct alignas(64) thread_counts {
+    unsigned long long local[ACTIVITY_COUNT][HW_COUNTER_COUNT];
+    unsigned long long global[ACTIVITY_COUNT][HW_COUNTER_COUNT];
+};
+
+/* a finished activity, for the trace */
+struct trace_span {
+    ticks_t start;
+    ticks_t end;
+    activity_t activity;
+    bool global;
+};
+
+/* spans of one thread, only ever appended to by that thread */
+struct trace_chunk {
+    trace_chunk *next;
+    int count;
+    trace_span spans[TRACE_CHUNK];
 };
 
 static bool tracking = false;
-static double global_start_time = 0.0;
+static bool tracing = false;
+static bool counting = false;
+static ticks_t global_start_ticks = 0;
+
+static thread_local thread_activity current = { -2, 0, {} };
+static std::atomic<int> thread_slots(0);
+static thread_accum accum[MAX_THREAD];
+static std::atomic<ticks_t> global_accum[ACTIVITY_COUNT];
+
+static thread_counts counts[MAX_THREAD];
+/* set on the thread that enabled counting, which samples the DRAM bytes */
+static thread_local bool reads_dram = false;
+
+/* first and last chunk of every thread, the last one only seen by its thread */
+static trace_chunk *trace_head[MAX_THREAD];
+static thread_local trace_chunk *trace_tail = NULL;
+static const char *thread_name[MAX_THREAD];
+
+static inline int thread_slot() {
+    if (current.slot == -2) {
+        int slot = thread_slots.fetch_add(1, std::memory_order_relaxed);
+        current.slot = slot < MAX_THREAD ? slot : -1;
+    }
+    return current.slot;
+}
 
-static activity_t current_activity = ACTIVITY_OVERHEAD;
-static double current_start_time = 0.0;
-static double accum[MAX_THREAD][ACTIVITY_COUNT];
-static double global_accum[ACTIVITY_COUNT];
+static void trace_span_add(activity_t a, ticks_t start, ticks_t end, bool global) {
+    int slot = thread_slot();
+    if (slot < 0)
+	return;
+    if (trace_tail == NULL || trace_tail->count == TRACE_CHUNK) {
+	trace_chunk *chunk = new trace_chunk;
+	chunk->next = NULL;
+	chunk->count = 0;
+	if (trace_tail == NULL)
+	    trace_head[slot] = chunk;
+	else
+	    trace_tail->next = chunk;
+	trace_tail = chunk;
+    }
+    trace_span &span = trace_tail->spans[trace_tail->count++];
+    span.start = start;
+    span.end = end;
+    span.activity = a;
+    span.global = global;
+}
+
+static void read_counters(hw_sample *sample) {
+    hw_counters_open();
+    hw_counters_read(sample);
+    if (reads_dram)
+	sample->value[HW_DRAM_BYTES] = hw_dram_bytes();
+}
+
+static void add_counters(const open_activity &open, bool global) {
+    int slot = thread_slot();
+    if (slot < 0)
+	return;
+    hw_sample now;
+    read_counters(&now);
+    unsigned long long *total = global ?
+	counts[slot].global[open.activity] : counts[slot].local[open.activity];
+    for (int c = 0; c < HW_COUNTER_COUNT; c++)
+	total[c] += now.value[c] - open.counters.value[c];
+}
+
+/* pop a, the time since it started; false if a was not the innermost */
+static bool pop_activity(activity_t a, bool global, ticks_t *ticks) {
+    ticks_t now = CycleTimer::currentTicks();
+    const char *kind = global ? "global" : "local";
+    if (current.depth == 0) {
+	fprintf(stderr, "Warning.  Finishing %s activity %s, but none was started\n",
+		kind, activity_name[a]);
+	return false;
+    }
+    current.depth--;
+    if (current.depth >= MAX_DEPTH)
+	return false;
+    open_activity &open = current.stack[current.depth];
+    if (a != open.activity) {
+	fprintf(stderr, "Warning.  Started activity %s, but now finishing %s activity %s\n",
+		activity_name[open.activity], kind, activity_name[a]);
+    }
+    *ticks = now - open.start;
+    if (counting)
+	add_counters(open, global);
+    if (tracing)
+	trace_span_add(a, open.start, now, global);
+    return true;
+}
 
 void track_activity(bool enable) {
     tracking = enable;
-    global_start_time = CycleTimer::currentSeconds();
-    current_start_time = global_start_time;
-    memset(accum, 0, ACTIVITY_COUNT * MAX_THREAD * sizeof(double));
-    memset(global_accum, 0, ACTIVITY_COUNT * sizeof(double));
-    current_activity = ACTIVITY_OVERHEAD;
+    global_start_ticks = CycleTimer::currentTicks();
+    memset(accum, 0, sizeof(accum));
+    memset(counts, 0, sizeof(counts));
+    for (int a = 0; a < (int) ACTIVITY_COUNT; a++)
+	global_accum[a].store(0, std::memory_order_relaxed);
 }
 
 void start_activity(activity_t a) {
     if (!tracking)
 	return;
-    current_start_time = CycleTimer::currentSeconds();
-    current_activity = a;
+    if (current.depth < MAX_DEPTH) {
+	open_activity &open = current.stack[current.depth];
+	open.activity = a;
+	if (counting)
+	    read_counters(&open.counters);
+	open.start = CycleTimer::currentTicks();
+    }
+    current.depth++;
+}
+
+void finish_local_activity(activity_t a) {
+    if (!tracking)
+	return;
+    ticks_t ticks;
+    int slot = thread_slot();
+    if (pop_activity(a, false, &ticks) && slot >= 0)
+	accum[slot].ticks[a] += ticks;
 }
 
 void finish_activity(activity_t a) {
     if (!tracking)
 	return;
-    double new_time = CycleTimer::currentSeconds();
-    if (a != current_activity) {
-	fprintf(stderr, "Warning.  Started activity %s, but now finishing global activity %s\n",
-		activity_name[current_activity], activity_name[a]);
+    ticks_t ticks;
+    if (pop_activity(a, true, &ticks))
+	global_accum[a].fetch_add(ticks, std::memory_order_relaxed);
+}
+
+void count_activity(bool enable) {
+    counting = enable;
+    if (enable) {
+	reads_dram = hw_dram_open();
+	hw_counters_open();
     }
-    global_accum[current_activity] += (new_time - current_start_time);
-    current_activity = ACTIVITY_OVERHEAD;
 }
 
+void trace_activity(bool enable) {
+    tracing = enable;
+}
+
+void name_thread(const char *name) {
+    int slot = thread_slot();
+    if (slot >= 0)
+	thread_name[slot] = name;
+}
+
+/* microseconds since track_activity() */
+static double trace_time(ticks_t ticks) {
+    return ((double) ticks - (double) global_start_ticks) *
+	CycleTimer::secondsPerTick() * 1e6;
+}
+
+bool write_trace(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+	fprintf(stderr, "Cannot open %s\n", path);
+	return false;
+    }
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(f, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, "
+	    "\"args\": {\"name\": \"stages\"}}");
+
+    int threads = thread_slots.load(std::memory_order_acquire);
+    threads = threads < MAX_THREAD ? threads : MAX_THREAD;
+    for (int t = 0; t < threads; t++) {
+	if (thread_name[t])
+	    fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+		    "\"tid\": %d, \"args\": {\"name\": \"%s\"}}", t + 1, thread_name[t]);
+	else
+	    fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+		    "\"tid\": %d, \"args\": {\"name\": \"thread %d\"}}", t + 1, t);
+	fprintf(f, ",\n{\"name\": \"thread_sort_index\", \"ph\": \"M\", \"pid\": 1, "
+		"\"tid\": %d, \"args\": {\"sort_index\": %d}}", t + 1, t + 1);
+
+	/* global spans go to the stages track, local ones to the thread's */
+	for (trace_chunk *chunk = trace_head[t]; chunk; chunk = chunk->next) {
+	    for (int k = 0; k < chunk->count; k++) {
+		const trace_span &span = chunk->spans[k];
+		double ts = trace_time(span.start);
+		fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+			"\"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+			activity_name[span.activity], span.global ? "stage" : "busy",
+			span.global ? 0 : t + 1, ts, trace_time(span.end) - ts);
+	    }
+	}
+    }
+    fprintf(f, "\n]}\n");
+    bool ok = !ferror(f);
+    if (fclose(f) != 0 || !ok) {
+	fprintf(stderr, "Failed to write %s\n", path);
+	return false;
+    }
+    return true;
+}
+
+activity_t current_activity() {
+    if (current.depth == 0 || current.depth > MAX_DEPTH)
+	return ACTIVITY_OVERHEAD;
+    return current.stack[current.depth - 1].activity;
+}
+
+void activity_seconds(double seconds[ACTIVITY_COUNT]) {
+    double spt = CycleTimer::secondsPerTick();
+    for (int a = 0; a < (int) ACTIVITY_COUNT; a++)
+	seconds[a] = global_accum[a].load(std::memory_order_relaxed) * spt;
+}
+
+const char *activity_label(activity_t a) {
+    return activity_name[a];
+}
+
+/* busy time of every thread that did some of a, and its spread */
+static void show_local_activity(FILE *f, int a, int threads) {
+    double spt = CycleTimer::secondsPerTick();
+    double min = 0.0, max = 0.0, sum = 0.0;
+    int busy = 0;
+    for (int t = 0; t < threads; t++) {
+	if (accum[t].ticks[a] == 0)
+	    continue;
+	double ms = accum[t].ticks[a] * spt * 1000.0;
+	min = busy == 0 || ms < min ? ms : min;
+	max = ms > max ? ms : max;
+	sum += ms;
+	busy++;
+    }
+    if (busy == 0)
+	return;
+    double mean = sum / busy;
+    fprintf(f, "    %-10s  %2d threads, busy min %d ms, mean %d ms, max %d ms, imbalance %.2f\n",
+	    activity_name[a], busy, (int) min, (int) mean, (int) max, max / mean);
+    fprintf(f, "               ");
+    for (int t = 0; t < threads; t++) {
+	if (accum[t].ticks[a] != 0)
+	    fprintf(f, " %d:%d", t, (int) (accum[t].ticks[a] * spt * 1000.0));
+    }
+    fprintf(f, "\n");
+}
+
+/* "-" for counters that could not be opened */
+static void show_count(FILE *f, bool counted, double value, const char *format) {
+    if (counted)
+	fprintf(f, format, value);
+    else
+	fprintf(f, " %9s", "-");
+}
+
+/*
+ Counters of every activity: the sum of the local activities over the
+ threads where there are any, else the global activity of the thread
+ that ran it alone. DRAM bytes only exist for global activities.
+*/
+static void show_counters(FILE *f, int threads) {
+    unsigned int available = hw_counters_available();
+    bool has[HW_COUNTER_COUNT];
+    for (int c = 0; c < HW_COUNTER_COUNT; c++)
+	has[c] = (available & (1u << c)) != 0;
+
+    if (!has[HW_CYCLES] && !has[HW_INSTRUCTIONS] && !has[HW_LLC_MISSES] &&
+	!has[HW_BRANCH_MISSES] && !has[HW_PAGE_FAULTS]) {
+	const char *error = hw_counters_error();
+	int paranoid = -1;
+	FILE *p = fopen("/proc/sys/kernel/perf_event_paranoid", "r");
+	if (p) {
+	    if (fscanf(p, "%d", &paranoid) != 1)
+		paranoid = -1;
+	    fclose(p);
+	}
+	fprintf(f, "    Hardware counters: not available (%s, perf_event_paranoid %d)\n",
+		error ? error : "no counters", paranoid);
+	return;
+    }
+    if (!has[HW_CYCLES])
+	fprintf(f, "    No cycle counter (%s), software counters only\n",
+		hw_counters_error() ? hw_counters_error() : "unknown");
+
+    double spt = CycleTimer::secondsPerTick();
+    fprintf(f, "    %-10s %9s %9s %9s %9s %9s %9s %9s %9s\n", "Counters",
+	    "Mcycles", "Minstr", "IPC", "LLC/kI", "brmiss/kI", "faults",
+	    "DRAM GB/s", "GHz");
+    for (int a = 1; a < (int) ACTIVITY_COUNT; a++) {
+	unsigned long long local[HW_COUNTER_COUNT] = {}, global[HW_COUNTER_COUNT] = {};
+	double busy = 0.0;
+	for (int t = 0; t < threads; t++) {
+	    for (int c = 0; c < HW_COUNTER_COUNT; c++) {
+		local[c] += counts[t].local[a][c];
+		global[c] += counts[t].global[a][c];
+	    }
+	    busy += accum[t].ticks[a] * spt;
+	}
+	double seconds = global_accum[a].load(std::memory_order_relaxed) * spt;
+	if (busy == 0.0 && seconds == 0.0)
+	    continue;
+	bool any_local = busy > 0.0;
+	unsigned long long *v = any_local ? local : global;
+	/* the clock rate over the busy time of the threads counted */
+	if (!any_local)
+	    busy = seconds;
+	double cycles = v[HW_CYCLES], instr = v[HW_INSTRUCTIONS];
+	bool per_instr = has[HW_INSTRUCTIONS] && instr > 0;
+
+	fprintf(f, "    %-10s", activity_name[a]);
+	show_count(f, has[HW_CYCLES], cycles / 1e6, " %9.1f");
+	show_count(f, has[HW_INSTRUCTIONS], instr / 1e6, " %9.1f");
+	show_count(f, has[HW_CYCLES] && per_instr && cycles > 0,
+		   instr / cycles, " %9.2f");
+	show_count(f, has[HW_LLC_MISSES] && per_instr,
+		   v[HW_LLC_MISSES] / instr * 1000.0, " %9.2f");
+	show_count(f, has[HW_BRANCH_MISSES] && per_instr,
+		   v[HW_BRANCH_MISSES] / instr * 1000.0, " %9.2f");
+	show_count(f, has[HW_PAGE_FAULTS], v[HW_PAGE_FAULTS], " %9.0f");
+	show_count(f, has[HW_DRAM_BYTES] && seconds > 0,
+		   global[HW_DRAM_BYTES] / seconds / 1e9, " %9.2f");
+	show_count(f, has[HW_CYCLES] && busy > 0, cycles / busy / 1e9, " %9.2f");
+	fprintf(f, "\n");
+    }
+}
 
 void show_activity(FILE *f, bool enable) {
     if (!enable)
 	return;
-    double elapsed = CycleTimer::currentSeconds() - global_start_time;
+    double spt = CycleTimer::secondsPerTick();
+    double elapsed = (CycleTimer::currentTicks() - global_start_ticks) * spt;
     int a;
     double unknown = elapsed;
     for (a = 1; a < (int) ACTIVITY_COUNT; a++) {
-	if (global_accum[a] == 0.0)
+	ticks_t ticks = global_accum[a].load(std::memory_order_relaxed);
+	if (ticks == 0)
 	    continue;
-	unknown -= global_accum[a];
-	double ms = global_accum[a] * 1000.0;
-	double pct = global_accum[a] / elapsed * 100.0;
-	fprintf(f, "    %8d ms    %5.1f %%    %s\n", (int) ms, pct, activity_name[a]); 
+	double seconds = ticks * spt;
+	unknown -= seconds;
+	double ms = seconds * 1000.0;
+	double pct = seconds / elapsed * 100.0;
+	fprintf(f, "    %8d ms    %5.1f %%    %s\n", (int) ms, pct, activity_name[a]);
     }
     double ums = unknown * 1000.0;
     double upct = unknown / elapsed * 100.0;
     fprintf(f, "    %8d ms    %5.1f %%    unknown\n", (int) ums, upct);
     fprintf(f, "    %8d ms    %5.1f %%    elapsed\n", (int) (elapsed * 1000.0), 100.0);
+
+    int threads = thread_slots.load(std::memory_order_relaxed);
+    threads = threads < MAX_THREAD ? threads : MAX_THREAD;
+    bool header = false;
+    for (a = 1; a < (int) ACTIVITY_COUNT; a++) {
+	bool any = false;
+	for (int t = 0; t < threads && !any; t++)
+	    any = accum[t].ticks[a] != 0;
+	if (!any)
+	    continue;
+	if (!header) {
+	    fprintf(f, "    Per-thread busy time (thread:ms):\n");
+	    header = true;
+	}
+	show_local_activity(f, a, threads);
+    }
+
+    if (counting)
+	show_counters(f, threads);
 }
@@ -8,24 +8,29 @@
 
 /*
  This code keeps track of how time gets used, both on a per-thread basis,
- and globally (as measured by thread 0).
+ and globally (as measured by the thread driving the frame).
 
  The programmer should wrap the code for major activities with calls to
  START_ACTIVITY(s),
- and (possibly) a FINISH_LOCAL_ACTIVITY(a),
- and then a FINISH_ACTIVITY(a),
+ and then either a FINISH_LOCAL_ACTIVITY(a) or a FINISH_ACTIVITY(a),
  where 'a' is one of the designated activity types.
+ Every thread keeps its own stack of open activities, timed with the
+ cycle counter, so activities nest and any thread may start one.
+   FINISH_LOCAL_ACTIVITY adds the time to the busy time of the calling
+   thread, FINISH_ACTIVITY adds it to the wall-clock time of the activity.
  With OMP:
-   The call to START_ACTIVITY should take occur before the parallel activity begins
-   The call to FINISH_LOCAL_ACTIVITY should occur before the global synchronization point (if it exists)
-   and the call to FINISH_ACTIVITY should occur after the parallel activity ends
+   One thread calls START_ACTIVITY before the parallel activity begins
+   and FINISH_ACTIVITY after it ends. Every thread doing the work calls
+   START_ACTIVITY and FINISH_LOCAL_ACTIVITY around its own share, before
+   the global synchronization point (if it exists).
 */
 
 /* Categories of activities */
 
 typedef enum {
     ACTIVITY_OVERHEAD, ACTIVITY_DECODE, ACTIVITY_LINEAR, ACTIVITY_LUM,
-    ACTIVITY_THINLINES, ACTIVITY_GRADIENT, ACTIVITY_REFINE,
+    ACTIVITY_THINLINES, ACTIVITY_GRADIENT, ACTIVITY_REFINE, ACTIVITY_FUSED,
+    ACTIVITY_READ, ACTIVITY_WRITE,
     ACTIVITY_COUNT
 } activity_t;
 
@@ -35,16 +40,54 @@ void finish_local_activity(activity_t a);
 void finish_activity(activity_t a);
 void show_activity(FILE *f, bool enable);
 
+/* innermost activity open on the calling thread, overhead if none */
+activity_t current_activity();
+
+/* wall-clock seconds of every global activity since track_activity() */
+void activity_seconds(double seconds[ACTIVITY_COUNT]);
+const char *activity_label(activity_t a);
+
+/*
+ Tracing keeps every finished activity as a span in a buffer of the
+ thread that ran it, appended without locks. write_trace() saves them
+ as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev): one
+ track per thread for its local activities and one for the global ones.
+ Call it once the threads that recorded spans are idle or gone.
+*/
+void trace_activity(bool enable);
+/*
+ Counting reads the hardware counters of hw_counters.h around every
+ activity, on the thread running it, and show_activity() reports them
+ per activity next to the time. The calling thread, the one driving the
+ frames, also samples the memory controllers for its global activities.
+ A read costs a system call, about a microsecond per activity.
+*/
+void count_activity(bool enable);
+/* name of the calling thread in the trace, a string that outlives it */
+void name_thread(const char *name);
+bool write_trace(const char *path);
+
+/* times its scope as a local activity of the thread constructing it */
+class scoped_activity {
+public:
+    scoped_activity(activity_t a) : activity_(a) { start_activity(a); }
+    ~scoped_activity() { finish_local_activity(activity_); }
+private:
+    activity_t activity_;
+};
+
 #if TRACK
 #define START_ACTIVITY(a) start_activity(a)
 #define FINISH_LOCAL_ACTIVITY(a) finish_local_activity(a)
 #define FINISH_ACTIVITY(a) finish_activity(a)
+#define LOCAL_ACTIVITY(a) scoped_activity local_activity_(a)
 #define SHOW_ACTIVITY(f,e) show_activity(f,e)
 #else
 #define TRACK_ACTIVITY(e)  /* Optimized out */
 #define START_ACTIVITY(a)   /* Optimized out */
 #define FINISH_LOCAL_ACTIVITY(a)  /* Optimized out */
 #define FINISH_ACTIVITY(a)  /* Optimized out */
+#define LOCAL_ACTIVITY(a)  /* Optimized out */
 #define SHOW_ACTIVITY(f,e)  /* Optimized out */
 #endif
 
@@ -40,14 +40,25 @@
 #include <string>
 
 struct CallInfo {
-    CallInfo() { count = laneCount = allOff = 0; }
+    CallInfo() { count = laneCount = allOff = gangSize = 0; }
     int count;
     int laneCount;
     int allOff;
+    int gangSize;
 };
 
 static std::map<std::string, CallInfo> callInfo;
 
+// Target the kernels run on, set by the backend; callsites are counted
+// per target since the gang size differs between them.
+static std::string targetName;
+static int targetGangSize = 0;
+
+void ISPCInstrumentTarget(const char *target, int gang_size) {
+    targetName = target;
+    targetGangSize = gang_size;
+}
+
 int countbits(uint64_t i) {
     int ret = 0;
     while (i) {
@@ -62,6 +73,8 @@ int countbits(uint64_t i) {
 // command-line flag is given while compiling.
 void ISPCInstrument(const char *fn, const char *note, int line, uint64_t mask) {
     std::stringstream s;
+    if (!targetName.empty())
+        s << "[" << targetName << "] ";
     s << fn << "(" << std::setfill('0') << std::setw(4) << line << ") - " << note;
 
     // Find or create a CallInfo instance for this callsite.
@@ -72,6 +85,7 @@ void ISPCInstrument(const char *fn, const char *note, int line, uint64_t mask) {
     if (mask == 0)
         ++ci.allOff;
     ci.laneCount += countbits(mask);
+    ci.gangSize = targetGangSize;
 }
 
 void ISPCPrintInstrument() {
@@ -80,10 +94,17 @@ void ISPCPrintInstrument() {
     std::map<std::string, CallInfo>::iterator citer = callInfo.begin();
     while (citer != callInfo.end()) {
         CallInfo &ci = citer->second;
-        float activePct = 100.f * ci.laneCount / (8.f * ci.count);
         float allOffPct = 100.f * ci.allOff / ci.count;
-        printf("%s: %d calls (%d / %.2f%% all off!), %.2f%% active lanes\n", citer->first.c_str(), ci.count, ci.allOff,
-               allOffPct, activePct);
+        if (ci.gangSize > 0) {
+            float activePct = 100.f * ci.laneCount / ((float)ci.gangSize * ci.count);
+            printf("%s: %d calls (%d / %.2f%% all off!), %.2f%% active lanes\n", citer->first.c_str(), ci.count,
+                   ci.allOff, allOffPct, activePct);
+        } else {
+            // no backend named the target, so the gang size is unknown
+            float activeLanes = (float)ci.laneCount / ci.count;
+            printf("%s: %d calls (%d / %.2f%% all off!), %.2f active lanes\n", citer->first.c_str(), ci.count,
+                   ci.allOff, allOffPct, activeLanes);
+        }
         ++citer;
     }
 }
@@ -40,6 +40,12 @@ extern "C" {
 void ISPCInstrument(const char *fn, const char *note, int line, uint64_t mask);
 }
 
+/*
+ * Name and programCount of the target the kernels run on, from the
+ * backend that picked it. Weak, so the backends link without this file.
+ */
+void ISPCInstrumentTarget(const char *target, int gang_size) __attribute__((weak));
+
 void ISPCPrintInstrument();
 
 #endif // ISPC_INSTRUMENT_H
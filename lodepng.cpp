@@ -1731,7 +1731,8 @@ static unsigned encodeLZ77(uivector* out, Hash* hash,
 
 /* /////////////////////////////////////////////////////////////////////////// */
 
-static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize) {
+static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, size_t datasize,
+                                     unsigned last) {
   /*non compressed deflate block data: 1 bit BFINAL,2 bits BTYPE,(5 bits): it jumps to start of next byte,
   2 bytes LEN, 2 bytes NLEN, LEN bytes literal DATA*/
 
@@ -1742,7 +1743,7 @@ static unsigned deflateNoCompression(ucvector* out, const unsigned char* data, s
     unsigned char firstbyte;
     size_t pos = out->size;
 
-    BFINAL = (i == numdeflateblocks - 1);
+    BFINAL = last && (i == numdeflateblocks - 1);
     BTYPE = 0;
 
     LEN = 65535;
@@ -2062,7 +2063,7 @@ static unsigned deflateFixed(LodePNGBitWriter* writer, Hash* hash,
 }
 
 static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t insize,
-                                 const LodePNGCompressSettings* settings) {
+                                 const LodePNGCompressSettings* settings, unsigned last) {
   unsigned error = 0;
   size_t i, blocksize, numdeflateblocks;
   Hash hash;
@@ -2071,7 +2072,7 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
   LodePNGBitWriter_init(&writer, out);
 
   if(settings->btype > 2) return 61;
-  else if(settings->btype == 0) return deflateNoCompression(out, in, insize);
+  else if(settings->btype == 0) return deflateNoCompression(out, in, insize, last);
   else if(settings->btype == 1) blocksize = insize;
   else /*if(settings->btype == 2)*/ {
     /*on PNGs, deflate blocks of 65-262k seem to give most dense encoding*/
@@ -2087,7 +2088,7 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
 
   if(!error) {
     for(i = 0; i != numdeflateblocks && !error; ++i) {
-      unsigned final = (i == numdeflateblocks - 1);
+      unsigned final = last && (i == numdeflateblocks - 1);
       size_t start = i * blocksize;
       size_t end = start + blocksize;
       if(end > insize) end = insize;
@@ -2097,6 +2098,20 @@ static unsigned lodepng_deflatev(ucvector* out, const unsigned char* in, size_t
     }
   }
 
+  /*not the last part: end with an empty stored block, which byte-aligns the output*/
+  if(!error && !last) {
+    size_t pos;
+    writeBits(&writer, 0, 3);
+    pos = out->size;
+    if(!ucvector_resize(out, pos + 4)) error = 83; /*alloc fail*/
+    else {
+      out->data[pos + 0] = 0;
+      out->data[pos + 1] = 0;
+      out->data[pos + 2] = 255;
+      out->data[pos + 3] = 255;
+    }
+  }
+
   hash_cleanup(&hash);
 
   return error;
@@ -2106,7 +2121,17 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings) {
   ucvector v = ucvector_init(*out, *outsize);
-  unsigned error = lodepng_deflatev(&v, in, insize, settings);
+  unsigned error = lodepng_deflatev(&v, in, insize, settings, 1);
+  *out = v.data;
+  *outsize = v.size;
+  return error;
+}
+
+unsigned lodepng_deflate_part(unsigned char** out, size_t* outsize,
+                              const unsigned char* in, size_t insize,
+                              const LodePNGCompressSettings* settings, unsigned last) {
+  ucvector v = ucvector_init(*out, *outsize);
+  unsigned error = lodepng_deflatev(&v, in, insize, settings, last);
   *out = v.data;
   *outsize = v.size;
   return error;
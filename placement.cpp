@@ -0,0 +1,138 @@
+#include "placement.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <omp.h>
+
+/* the CPUs before anything was pinned, pinned threads pass their mask on */
+static cpu_set_t process_cpus;
+static bool have_process_cpus =
+    sched_getaffinity(0, sizeof(process_cpus), &process_cpus) == 0;
+
+/* pages to query per move_pages call */
+#define PAGE_BATCH 512
+
+void first_touch_rows(void *p, size_t row_bytes, unsigned int rows)
+{
+    char *bytes = (char *)p;
+
+    #pragma omp parallel for schedule(static)
+    for (unsigned int i = 0; i < rows; i++) {
+        memset(bytes + i * row_bytes, 0, row_bytes);
+    }
+}
+
+bool pin_omp_threads()
+{
+    if (!have_process_cpus) {
+        return false;
+    }
+
+    int cpus = CPU_COUNT(&process_cpus);
+    bool ok = true;
+
+    #pragma omp parallel
+    {
+        /* the thread-th allowed CPU, wrapping when oversubscribed */
+        int n = omp_get_thread_num() % cpus;
+        int cpu = 0;
+        for (; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &process_cpus) && n-- == 0) {
+                break;
+            }
+        }
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            #pragma omp atomic write
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+/* node of each page, negative errno where unknown; false without move_pages */
+static bool page_nodes(void **pages, int *status, unsigned long count)
+{
+#ifdef SYS_move_pages
+    /* nodes == NULL only queries, it does not move anything */
+    return syscall(SYS_move_pages, 0, count, pages, NULL, status, 0) == 0;
+#else
+    return false;
+#endif
+}
+
+void placement_count(const void *p, size_t row_bytes, unsigned int rows,
+    placement_stats *stats)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+
+    #pragma omp parallel
+    {
+        unsigned long local = 0, remote = 0, unknown = 0;
+        unsigned int node = 0;
+        bool have_node = syscall(SYS_getcpu, NULL, &node, NULL) == 0;
+
+        /* the same rows this thread touched in first_touch_rows() */
+        unsigned int threads = omp_get_num_threads();
+        unsigned int t = omp_get_thread_num();
+        unsigned int chunk = rows / threads, extra = rows % threads;
+        unsigned int begin = t * chunk + (t < extra ? t : extra);
+        unsigned int end = begin + chunk + (t < extra ? 1 : 0);
+
+        uintptr_t first = ((uintptr_t)p + begin * row_bytes) & ~(page - 1);
+        uintptr_t last = (uintptr_t)p + end * row_bytes;
+
+        void *pages[PAGE_BATCH];
+        int status[PAGE_BATCH];
+        for (uintptr_t addr = first; addr < last; ) {
+            unsigned long count = 0;
+            for (; count < PAGE_BATCH && addr < last; count++, addr += page) {
+                pages[count] = (void *)addr;
+            }
+
+            if (!have_node || !page_nodes(pages, status, count)) {
+                unknown += count;
+                continue;
+            }
+            for (unsigned long k = 0; k < count; k++) {
+                if (status[k] < 0) {
+                    unknown++;
+                } else if ((unsigned int)status[k] == node) {
+                    local++;
+                } else {
+                    remote++;
+                }
+            }
+        }
+
+        #pragma omp atomic
+        stats->local += local;
+        #pragma omp atomic
+        stats->remote += remote;
+        #pragma omp atomic
+        stats->unknown += unknown;
+    }
+}
+
+void placement_report(FILE *f, const placement_stats &stats)
+{
+    unsigned long total = stats.local + stats.remote + stats.unknown;
+    if (total == 0) {
+        return;
+    }
+    if (stats.unknown == total) {
+        fprintf(f, "Plane placement: not available (no move_pages)\n");
+        return;
+    }
+    fprintf(f, "Plane pages: %lu, %.1f%% on the node of the thread computing "
+        "them, %.1f%% remote, %.1f%% unknown\n", total,
+        100.0 * stats.local / total, 100.0 * stats.remote / total,
+        100.0 * stats.unknown / total);
+}
@@ -0,0 +1,39 @@
+#ifndef PLACEMENT_H_
+#define PLACEMENT_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * NUMA placement of the planes. Linux puts a page on the node of the
+ * thread that first writes it, so a plane is zeroed right after it is
+ * allocated by the OpenMP threads that compute it, each thread its own
+ * schedule(static) block of rows, the partition of the static stages.
+ */
+void first_touch_rows(void *p, size_t row_bytes, unsigned int rows);
+
+/*
+ * Pin OpenMP thread i to the i-th CPU the process was allowed to run on
+ * at start-up. The pool threads persist, so later parallel regions of the
+ * same size keep the placement. Returns false if any thread failed.
+ */
+bool pin_omp_threads();
+
+/* pages of a plane on the node of the thread owning their rows, or not */
+struct placement_stats {
+    unsigned long local;
+    unsigned long remote;
+    unsigned long unknown;
+};
+
+/*
+ * Add the pages of rows x row_bytes at p to stats, split over the OpenMP
+ * threads like first_touch_rows(). Pages whose node cannot be queried
+ * (no move_pages in a container, not yet faulted in) count as unknown.
+ */
+void placement_count(const void *p, size_t row_bytes, unsigned int rows,
+    placement_stats *stats);
+
+void placement_report(FILE *f, const placement_stats &stats);
+
+#endif /* PLACEMENT_H_ */
@@ -0,0 +1,149 @@
+#include "plane_alloc.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define LINE 64
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+/*
+ * The n-th plane starts (n % STAGGER_COUNT) * STAGGER_STEP bytes into its
+ * mapping. Three lines per step moves both the 4 KB alias and the L1 set.
+ */
+#define STAGGER_STEP (3 * LINE)
+#define STAGGER_COUNT 16
+
+/* one line in front of every plane, so plane_free() knows the mapping */
+struct plane_header {
+    void *base;
+    size_t length;
+};
+
+static plane_config config = { HUGE_PAGES_THP, 0, true };
+/* planes are allocated by the thread that sets the backend up */
+static unsigned int planes_allocated = 0;
+
+/* bytes mapped by kind of backing, for plane_report() */
+static size_t hugetlb_bytes = 0;
+static size_t thp_bytes = 0;
+static size_t small_bytes = 0;
+
+void plane_configure(const plane_config &new_config)
+{
+    config = new_config;
+}
+
+bool huge_pages_parse(const char *name, huge_pages *huge)
+{
+    static const char *names[] = { "off", "thp", "explicit" };
+    for (int i = 0; i < 3; i++) {
+        if (strcasecmp(name, names[i]) == 0) {
+            *huge = (huge_pages)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+unsigned int plane_stride(unsigned int width, size_t elem)
+{
+    size_t bytes = (width * elem + LINE - 1) / LINE * LINE + config.row_pad;
+    bytes = (bytes + LINE - 1) / LINE * LINE;
+    if (bytes % 4096 == 0) {
+        bytes += LINE;
+    }
+    return bytes / elem;
+}
+
+/* a 2 MB aligned mapping of length bytes, the slack around it unmapped */
+static void *map_aligned(size_t length)
+{
+    size_t slack = length + HUGE_PAGE;
+    char *p = (char *)mmap(NULL, slack, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    char *aligned = (char *)(((uintptr_t)p + HUGE_PAGE - 1) & ~(uintptr_t)(HUGE_PAGE - 1));
+    if (aligned > p) {
+        munmap(p, aligned - p);
+    }
+    size_t tail = (p + slack) - (aligned + length);
+    if (tail > 0) {
+        munmap(aligned + length, tail);
+    }
+    return aligned;
+}
+
+void *plane_alloc(size_t bytes)
+{
+    size_t offset = 0;
+    if (config.stagger) {
+        offset = (planes_allocated % STAGGER_COUNT) * STAGGER_STEP;
+    }
+    planes_allocated++;
+
+    size_t length = LINE + offset + bytes;
+    void *base = NULL;
+
+#ifdef MAP_HUGETLB
+    if (config.huge == HUGE_PAGES_EXPLICIT) {
+        size_t huge_length = (length + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+        base = mmap(NULL, huge_length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (base == MAP_FAILED) {
+            base = NULL;
+        } else {
+            length = huge_length;
+            hugetlb_bytes += length;
+        }
+    }
+#endif
+
+    if (base == NULL && config.huge != HUGE_PAGES_OFF && length >= HUGE_PAGE) {
+        length = (length + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+        base = map_aligned(length);
+        if (base != NULL) {
+#ifdef MADV_HUGEPAGE
+            madvise(base, length, MADV_HUGEPAGE);
+#endif
+            thp_bytes += length;
+        }
+    }
+
+    if (base == NULL) {
+        base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            fprintf(stderr, "Cannot map a %zu byte plane\n", bytes);
+            exit(1);
+        }
+        small_bytes += length;
+    }
+
+    char *plane = (char *)base + LINE + offset;
+    plane_header *header = (plane_header *)(plane - LINE);
+    header->base = base;
+    header->length = length;
+    return plane;
+}
+
+void plane_free(void *p)
+{
+    if (p == NULL) {
+        return;
+    }
+    plane_header *header = (plane_header *)((char *)p - LINE);
+    munmap(header->base, header->length);
+}
+
+void plane_report(FILE *f)
+{
+    fprintf(f, "Planes: %u allocated, %.1f MB explicit huge pages, %.1f MB "
+        "transparent huge pages, %.1f MB small pages\n", planes_allocated,
+        hugetlb_bytes / 1e6, thp_bytes / 1e6, small_bytes / 1e6);
+}
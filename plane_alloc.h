@@ -0,0 +1,51 @@
+#ifndef PLANE_ALLOC_H_
+#define PLANE_ALLOC_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * Allocator for the planes of every backend. Planes are mmap()ed
+ * directly: 64-byte aligned, staggered by a few cache lines per plane so
+ * that the many same-sized planes do not alias modulo 4 KB, and backed
+ * by huge pages where the system allows.
+ */
+enum huge_pages {
+    HUGE_PAGES_OFF,      /* 4 KB pages */
+    HUGE_PAGES_THP,      /* 2 MB aligned and madvise(MADV_HUGEPAGE) */
+    HUGE_PAGES_EXPLICIT  /* MAP_HUGETLB, THP when the pool is empty */
+};
+
+struct plane_config {
+    huge_pages huge;
+    /* extra bytes per padded row, on top of the rounding to 64 bytes */
+    unsigned int row_pad;
+    /* stagger consecutive planes, off gives every plane the same offset */
+    bool stagger;
+};
+
+/* applies to the planes allocated afterwards, the default is THP, 0, on */
+void plane_configure(const plane_config &config);
+bool huge_pages_parse(const char *name, huge_pages *huge);
+
+/*
+ * Elements per row for rows of width elements of elem bytes: a multiple
+ * of 64 bytes plus row_pad, and never a multiple of 4 KB, so vertically
+ * adjacent stencil taps do not land in the same cache set.
+ */
+unsigned int plane_stride(unsigned int width, size_t elem);
+
+/* zeroed, 64-byte aligned, freed with plane_free() */
+void *plane_alloc(size_t bytes);
+void plane_free(void *p);
+
+template <typename T>
+static inline T *plane_new(size_t count)
+{
+    return (T *)plane_alloc(count * sizeof(T));
+}
+
+/* how the planes allocated so far are backed */
+void plane_report(FILE *f);
+
+#endif /* PLANE_ALLOC_H_ */
@@ -0,0 +1,62 @@
+#include "lodepng.h"
+#include "png_parallel.h"
+#include "cycleTimer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Encode throughput against output size of every png_speed preset:
+ *   png_bench [-n TIMES] IMAGE...
+ * MB/s is of the raw RGBA input, the best of TIMES encodes.
+ */
+int main(int argc, char *argv[]) {
+    int times = 3;
+    int first = 1;
+    if (argc > 2 && argv[1][0] == '-' && argv[1][1] == 'n') {
+        times = atoi(argv[2]);
+        first = 3;
+    }
+    if (first >= argc || times < 1) {
+        printf("Usage: %s [-n TIMES] IMAGE...\n", argv[0]);
+        return 1;
+    }
+
+    printf("%-28s %-8s %10s %12s %8s\n", "image", "speed", "MB/s", "bytes", "ratio");
+    for (int i = first; i < argc; i++) {
+        unsigned char *image;
+        unsigned int width, height;
+        unsigned error = lodepng_decode32_file(&image, &width, &height, argv[i]);
+        if (error) {
+            printf("%s: error %u: %s\n", argv[i], error, lodepng_error_text(error));
+            continue;
+        }
+        double raw = 4.0 * width * height;
+
+        for (int s = PNG_SPEED_DEFAULT; s <= PNG_SPEED_STORED; s++) {
+            LodePNGEncoderSettings settings;
+            png_speed_settings(&settings, (png_speed)s);
+
+            double best = 1e30;
+            size_t size = 0;
+            for (int k = 0; k < times && !error; k++) {
+                unsigned char *out = NULL;
+                double start = CycleTimer::currentSeconds();
+                error = png_encode32_parallel(&out, &size, image, width, height,
+                    &settings);
+                double t = CycleTimer::currentSeconds() - start;
+                if (t < best) best = t;
+                free(out);
+            }
+            if (error) {
+                printf("%s: error %u: %s\n", argv[i], error, lodepng_error_text(error));
+                break;
+            }
+            printf("%-28s %-8s %10.1f %12zu %7.2f%%\n", argv[i],
+                png_speed_name((png_speed)s), raw / best / 1e6, size,
+                100.0 * size / raw);
+        }
+        free(image);
+    }
+    return 0;
+}
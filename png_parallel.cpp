@@ -0,0 +1,347 @@
+#include "png_parallel.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* uncompressed bytes per band, in the range pigz uses for its blocks */
+#define BAND_BYTES (128 * 1024)
+
+#define ADLER_BASE 65521u
+
+static unsigned int adler32(const unsigned char *data, size_t len)
+{
+    unsigned int s1 = 1, s2 = 0;
+    while (len > 0) {
+        /* 5552 is the most bytes before s2 can overflow */
+        size_t n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n--) {
+            s1 += *data++;
+            s2 += s1;
+        }
+        s1 %= ADLER_BASE;
+        s2 %= ADLER_BASE;
+    }
+    return (s2 << 16) | s1;
+}
+
+/* adler32 of A followed by B from adler32(A), adler32(B) and len(B) */
+static unsigned int adler32_combine(unsigned int a, unsigned int b, size_t len_b)
+{
+    unsigned int rem = len_b % ADLER_BASE;
+    unsigned int s1 = a & 0xffff;
+    unsigned int s2 = (unsigned int)(((unsigned long long)rem * s1) % ADLER_BASE);
+    s1 += (b & 0xffff) + ADLER_BASE - 1;
+    s2 += (a >> 16) + (b >> 16) + ADLER_BASE - rem;
+    if (s1 >= ADLER_BASE) s1 -= ADLER_BASE;
+    if (s1 >= ADLER_BASE) s1 -= ADLER_BASE;
+    if (s2 >= 2 * ADLER_BASE) s2 -= 2 * ADLER_BASE;
+    if (s2 >= ADLER_BASE) s2 -= ADLER_BASE;
+    return (s2 << 16) | s1;
+}
+
+static inline unsigned char paeth(int a, int b, int c)
+{
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - 2 * c);
+    if (pc < pa && pc < pb) {
+        return c;
+    }
+    return pb < pa ? b : a;
+}
+
+/* PNG filter method 0 on one scanline, prev is NULL for the first row */
+static void filter_scanline(unsigned char *out, const unsigned char *line,
+    const unsigned char *prev, size_t length, size_t bpp, int type)
+{
+    size_t i;
+    switch (type) {
+    case 0:
+        memcpy(out, line, length);
+        break;
+    case 1:
+        for (i = 0; i < bpp; i++) out[i] = line[i];
+        for (; i < length; i++) out[i] = line[i] - line[i - bpp];
+        break;
+    case 2:
+        for (i = 0; i < length; i++) out[i] = line[i] - (prev ? prev[i] : 0);
+        break;
+    case 3:
+        for (i = 0; i < bpp; i++) out[i] = line[i] - ((prev ? prev[i] : 0) >> 1);
+        for (; i < length; i++) {
+            out[i] = line[i] - ((line[i - bpp] + (prev ? prev[i] : 0)) >> 1);
+        }
+        break;
+    case 4:
+        for (i = 0; i < bpp; i++) out[i] = line[i] - (prev ? prev[i] : 0);
+        for (; i < length; i++) {
+            out[i] = line[i] - (prev ?
+                paeth(line[i - bpp], prev[i], prev[i - bpp]) : line[i - bpp]);
+        }
+        break;
+    }
+}
+
+/* the minimum sum of absolute differences heuristic, as lodepng's LFS_MINSUM */
+static size_t filter_cost(const unsigned char *out, size_t length, int type)
+{
+    size_t sum = 0;
+    for (size_t i = 0; i < length; i++) {
+        sum += type == 0 || out[i] < 128 ? out[i] : 255u - out[i];
+    }
+    return sum;
+}
+
+/* pack row y into line as RGB or RGBA */
+static const unsigned char *get_line(unsigned char *line,
+    const unsigned char *image, unsigned int width, unsigned int y,
+    size_t channels)
+{
+    const unsigned char *src = image + 4 * (size_t)width * y;
+    if (channels == 4) {
+        return src;
+    }
+    for (unsigned int x = 0; x < width; x++) {
+        line[3 * x + 0] = src[4 * x + 0];
+        line[3 * x + 1] = src[4 * x + 1];
+        line[3 * x + 2] = src[4 * x + 2];
+    }
+    return line;
+}
+
+static const char *speed_names[] = { "default", "fast", "huffman", "stored" };
+
+void png_speed_settings(LodePNGEncoderSettings *settings, png_speed speed)
+{
+    lodepng_encoder_settings_init(settings);
+    LodePNGCompressSettings *zlib = &settings->zlibsettings;
+
+    switch (speed) {
+    case PNG_SPEED_DEFAULT:
+        break;
+    case PNG_SPEED_FAST:
+        /* upscaled frames are smooth, paeth alone is close to minimum sum */
+        settings->filter_strategy = LFS_FOUR;
+        zlib->windowsize = 512;
+        zlib->nicematch = 32;
+        zlib->lazymatching = 0;
+        break;
+    case PNG_SPEED_HUFFMAN:
+        settings->filter_strategy = LFS_FOUR;
+        zlib->use_lz77 = 0;
+        break;
+    case PNG_SPEED_STORED:
+        settings->filter_strategy = LFS_ZERO;
+        zlib->btype = 0;
+        break;
+    }
+}
+
+bool png_speed_parse(const char *name, png_speed *speed)
+{
+    for (int i = 0; i < 4; i++) {
+        if (strcasecmp(name, speed_names[i]) == 0 ||
+            (name[0] == '0' + i && name[1] == '\0')) {
+            *speed = (png_speed)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *png_speed_name(png_speed speed)
+{
+    return speed_names[speed];
+}
+
+unsigned png_encode32_parallel(unsigned char **out, size_t *outsize,
+    const unsigned char *image, unsigned int width, unsigned int height,
+    const LodePNGEncoderSettings *settings)
+{
+    *out = NULL;
+    *outsize = 0;
+    LodePNGEncoderSettings defaults;
+    if (!settings) {
+        lodepng_encoder_settings_init(&defaults);
+        settings = &defaults;
+    }
+    if (width == 0 || height == 0) {
+        return 93; /* zero width or height */
+    }
+
+    size_t pixels = (size_t)width * height;
+    bool opaque = true;
+    #pragma omp parallel for reduction(&&:opaque)
+    for (size_t i = 0; i < pixels; i++) {
+        opaque = opaque && image[4 * i + 3] == 255;
+    }
+
+    size_t channels = opaque ? 3 : 4;
+    size_t linebytes = channels * width;
+    size_t stride = linebytes + 1;
+    unsigned int band_rows = BAND_BYTES / stride > 0 ? BAND_BYTES / stride : 1;
+    int bands = (height + band_rows - 1) / band_rows;
+
+    unsigned char *filtered = (unsigned char *)malloc(stride * height);
+    unsigned char **parts = (unsigned char **)calloc(bands, sizeof(unsigned char *));
+    size_t *part_sizes = (size_t *)calloc(bands, sizeof(size_t));
+    unsigned int *adlers = (unsigned int *)malloc(bands * sizeof(unsigned int));
+    unsigned error = 0;
+
+    if (!filtered || !parts || !part_sizes || !adlers) {
+        error = 83; /* alloc fail */
+    }
+
+    if (!error) {
+        #pragma omp parallel
+        {
+            /* current and previous packed row, plus one attempt per filter */
+            unsigned char *scratch = (unsigned char *)malloc(7 * linebytes);
+
+            #pragma omp for schedule(dynamic, 1)
+            for (int b = 0; b < bands; b++) {
+                unsigned int y0 = b * band_rows;
+                unsigned int y1 = y0 + band_rows < height ? y0 + band_rows : height;
+                unsigned char *band = filtered + stride * y0;
+                unsigned err = 0;
+
+                if (!scratch) {
+                    err = 83;
+                }
+                const unsigned char *prev = NULL;
+                if (!err && y0 > 0) {
+                    prev = get_line(scratch + (y0 & 1) * linebytes,
+                        image, width, y0 - 1, channels);
+                }
+
+                for (unsigned int y = y0; y < y1 && !err; y++) {
+                    unsigned char *attempt = scratch + 2 * linebytes;
+                    unsigned char *dst = filtered + stride * y;
+                    const unsigned char *line = get_line(scratch + ((y + 1) & 1) * linebytes,
+                        image, width, y, channels);
+
+                    int strategy = settings->filter_strategy;
+                    if (strategy >= LFS_ZERO && strategy <= LFS_FOUR) {
+                        dst[0] = strategy;
+                        filter_scanline(dst + 1, line, prev, linebytes, channels, strategy);
+                        prev = line;
+                        continue;
+                    }
+
+                    size_t best = 0;
+                    int best_type = 0;
+                    for (int type = 0; type < 5; type++) {
+                        unsigned char *a = attempt + type * linebytes;
+                        filter_scanline(a, line, prev, linebytes, channels, type);
+                        size_t cost = filter_cost(a, linebytes, type);
+                        if (type == 0 || cost < best) {
+                            best = cost;
+                            best_type = type;
+                        }
+                    }
+                    dst[0] = best_type;
+                    memcpy(dst + 1, attempt + best_type * linebytes, linebytes);
+                    prev = line;
+                }
+
+                size_t len = stride * (y1 - y0);
+                if (!err) {
+                    err = lodepng_deflate_part(&parts[b], &part_sizes[b], band, len,
+                        &settings->zlibsettings, b == bands - 1);
+                }
+                adlers[b] = adler32(band, len);
+                if (err) {
+                    #pragma omp critical
+                    error = err;
+                }
+            }
+
+            free(scratch);
+        }
+    }
+
+    /* zlib header (deflate, 32K window, no dictionary), parts, adler32 */
+    unsigned char *idat = NULL;
+    size_t idat_size = 2 + 4;
+    if (!error) {
+        for (int b = 0; b < bands; b++) {
+            idat_size += part_sizes[b];
+        }
+        idat = (unsigned char *)malloc(idat_size);
+        if (!idat) {
+            error = 83;
+        }
+    }
+
+    if (!error) {
+        size_t pos = 0;
+        unsigned int adler = 1;
+        idat[pos++] = 0x78;
+        idat[pos++] = 0x01;
+        for (int b = 0; b < bands; b++) {
+            unsigned int y0 = b * band_rows;
+            unsigned int rows = y0 + band_rows < height ? band_rows : height - y0;
+            memcpy(idat + pos, parts[b], part_sizes[b]);
+            pos += part_sizes[b];
+            adler = adler32_combine(adler, adlers[b], stride * rows);
+        }
+        idat[pos++] = adler >> 24;
+        idat[pos++] = adler >> 16;
+        idat[pos++] = adler >> 8;
+        idat[pos++] = adler;
+    }
+
+    static const unsigned char signature[8] = {
+        137, 80, 78, 71, 13, 10, 26, 10
+    };
+    unsigned char ihdr[13] = {
+        (unsigned char)(width >> 24), (unsigned char)(width >> 16),
+        (unsigned char)(width >> 8), (unsigned char)width,
+        (unsigned char)(height >> 24), (unsigned char)(height >> 16),
+        (unsigned char)(height >> 8), (unsigned char)height,
+        8, (unsigned char)(opaque ? 2 : 6), 0, 0, 0
+    };
+
+    if (!error) {
+        *out = (unsigned char *)malloc(sizeof(signature));
+        if (!*out) {
+            error = 83;
+        } else {
+            memcpy(*out, signature, sizeof(signature));
+            *outsize = sizeof(signature);
+        }
+    }
+    if (!error) error = lodepng_chunk_create(out, outsize, 13, "IHDR", ihdr);
+    if (!error) error = lodepng_chunk_create(out, outsize, idat_size, "IDAT", idat);
+    if (!error) error = lodepng_chunk_create(out, outsize, 0, "IEND", NULL);
+
+    if (parts) {
+        for (int b = 0; b < bands; b++) {
+            free(parts[b]);
+        }
+    }
+    free(parts);
+    free(part_sizes);
+    free(adlers);
+    free(filtered);
+    free(idat);
+
+    return error;
+}
+
+unsigned png_encode32_file_parallel(const char *filename,
+    const unsigned char *image, unsigned int width, unsigned int height,
+    const LodePNGEncoderSettings *settings)
+{
+    unsigned char *buffer = NULL;
+    size_t buffersize = 0;
+    unsigned error = png_encode32_parallel(&buffer, &buffersize,
+        image, width, height, settings);
+    if (!error) {
+        error = lodepng_save_file(buffer, buffersize, filename);
+    }
+    free(buffer);
+    return error;
+}
@@ -0,0 +1,45 @@
+#ifndef PNG_PARALLEL_H_
+#define PNG_PARALLEL_H_
+
+#include "lodepng.h"
+
+/*
+ * Parallel PNG encoder on top of lodepng for 8-bit RGBA images.
+ * Scanlines are filtered and deflated in bands of rows on all OpenMP
+ * threads. Each band is an independent deflate part ending in a full flush
+ * (see lodepng_deflate_part), so the parts concatenate into one zlib stream
+ * in a single IDAT chunk. Like lodepng's auto_convert, opaque images are
+ * stored as RGB.
+ *
+ * settings may be NULL for lodepng's defaults; zlibsettings and
+ * filter_strategy (LFS_ZERO..LFS_FOUR or LFS_MINSUM) are honored.
+ * Returns a lodepng error code.
+ */
+unsigned png_encode32_parallel(unsigned char **out, size_t *outsize,
+    const unsigned char *image, unsigned int width, unsigned int height,
+    const LodePNGEncoderSettings *settings = NULL);
+
+unsigned png_encode32_file_parallel(const char *filename,
+    const unsigned char *image, unsigned int width, unsigned int height,
+    const LodePNGEncoderSettings *settings = NULL);
+
+/* encoder effort presets for png_speed_settings */
+enum png_speed {
+    PNG_SPEED_DEFAULT, /* lodepng's defaults: minimum sum filters, full effort zlib */
+    PNG_SPEED_FAST,    /* paeth filter, small window greedy LZ77 */
+    PNG_SPEED_HUFFMAN, /* paeth filter, Huffman coding only */
+    PNG_SPEED_STORED   /* no filter, stored blocks */
+};
+
+/*
+ * Reset settings to lodepng's defaults adjusted for speed. The faster
+ * presets are meant for intermediates that are re-encoded downstream.
+ */
+void png_speed_settings(LodePNGEncoderSettings *settings, png_speed speed);
+
+/* parse "default", "fast", "huffman", "stored" or 0-3, false if unknown */
+bool png_speed_parse(const char *name, png_speed *speed);
+
+const char *png_speed_name(png_speed speed);
+
+#endif /* PNG_PARALLEL_H_ */
@@ -44,6 +44,7 @@
     - Microsoft's Concurrency Runtime (ISPC_USE_CONCRT)
     - Apple's Grand Central Dispatch (ISPC_USE_GCD)
     - bare pthreads (ISPC_USE_PTHREADS, ISPC_USE_PTHREADS_FULLY_SUBSCRIBED)
+    - pthreads with per-worker work-stealing deques (ISPC_USE_WORK_STEALING)
     - TBB (ISPC_USE_TBB_TASK_GROUP, ISPC_USE_TBB_PARALLEL_FOR)
     - OpenMP (ISPC_USE_OMP)
     - HPX (ISPC_USE_HPX)
@@ -61,6 +62,13 @@
 #define ISPC_USE_OMP
 #define ISPC_USE_TBB_TASK_GROUP
 #define ISPC_USE_TBB_PARALLEL_FOR
+#define ISPC_USE_WORK_STEALING
+
+  The ISPC_USE_WORK_STEALING model gives every worker a lock-free Chase-Lev
+  deque. A launch pushes its whole index range as one item; workers split
+  ranges in half as they pop them and idle threads steal the oldest (largest)
+  half from a random victim, so a launch costs O(log count) deque operations
+  per thread instead of one mutex acquisition and semaphore post per task.
 
   The ISPC_USE_PTHREADS_FULLY_SUBSCRIBED model essentially takes over the machine
   by assigning one pthread to each hyper-thread, and then uses spinlocks and atomics
@@ -79,7 +87,8 @@
 
 #if !(defined ISPC_USE_CONCRT || defined ISPC_USE_GCD || defined ISPC_USE_PTHREADS ||                                  \
       defined ISPC_USE_PTHREADS_FULLY_SUBSCRIBED || defined ISPC_USE_TBB_TASK_GROUP ||                                 \
-      defined ISPC_USE_TBB_PARALLEL_FOR || defined ISPC_USE_OMP || defined ISPC_USE_HPX)
+      defined ISPC_USE_TBB_PARALLEL_FOR || defined ISPC_USE_OMP || defined ISPC_USE_HPX ||                           \
+      defined ISPC_USE_WORK_STEALING)
 
 // If no task model chosen from the compiler cmdline, pick a reasonable default
 #if defined(_WIN32) || defined(_WIN64)
@@ -139,6 +148,13 @@ using namespace Concurrency;
 //#include <stdexcept>
 #include <stack>
 #endif // ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+#ifdef ISPC_USE_WORK_STEALING
+#include <atomic>
+#include <new>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif // ISPC_USE_WORK_STEALING
 #ifdef ISPC_USE_TBB_PARALLEL_FOR
 #include <tbb/parallel_for.h>
 #endif // ISPC_USE_TBB_PARALLEL_FOR
@@ -163,6 +179,8 @@ using namespace Concurrency;
 #include <stdlib.h>
 #include <string.h>
 
+#include "instrument.h"
+
 // Signature of ispc-generated 'task' functions
 typedef void (*TaskFuncType)(void *data, int threadIndex, int threadCount, int taskIndex, int taskCount, int taskIndex0,
                              int taskIndex1, int taskIndex2, int taskCount0, int taskCount1, int taskCount2);
@@ -173,6 +191,8 @@ struct TaskInfo {
     void *data;
     int taskIndex;
     int taskCount3d[3];
+    // Activity of the launching thread, tasks are timed as part of it
+    activity_t activity;
 #if defined(ISPC_USE_CONCRT)
     event taskEvent;
 #endif
@@ -191,6 +211,7 @@ extern "C" {
 void ISPCLaunch(void **handlePtr, void *f, void *data, int countx, int county, int countz);
 void *ISPCAlloc(void **handlePtr, int64_t size, int32_t alignment);
 void ISPCSync(void *handle);
+int ISPCTaskThreads();
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -421,6 +442,29 @@ class TaskGroup : public TaskGroupBase {
 
 #endif // ISPC_USE_PTHREADS
 
+#ifdef ISPC_USE_WORK_STEALING
+struct WorkItem;
+static void lRunWorkItem(int self, WorkItem item);
+
+class TaskGroup : public TaskGroupBase {
+  public:
+    TaskGroup() { numUnfinishedTasks = 0; }
+
+    void Reset() {
+        TaskGroupBase::Reset();
+        numUnfinishedTasks = 0;
+    }
+
+    void Launch(int baseIndex, int count);
+    void Sync();
+
+  private:
+    friend void lRunWorkItem(int self, WorkItem item);
+
+    std::atomic<int32_t> numUnfinishedTasks;
+};
+#endif // ISPC_USE_WORK_STEALING
+
 #ifdef ISPC_USE_OMP
 
 class TaskGroup : public TaskGroupBase {
@@ -561,6 +605,35 @@ inline void TaskGroup::Sync() {
 
 #endif // ISPC_USE_CONCRT
 
+///////////////////////////////////////////////////////////////////////////
+// thread pinning
+
+#if defined ISPC_USE_PTHREADS || defined ISPC_USE_WORK_STEALING
+#ifdef ISPC_IS_LINUX
+// With ISPC_PIN_THREADS set, worker i runs on the (i + 1)-th CPU the
+// process started with and the launching thread is left alone.
+static cpu_set_t lProcessCpus;
+static bool lHaveProcessCpus = sched_getaffinity(0, sizeof(lProcessCpus), &lProcessCpus) == 0;
+
+static void lPinWorker(int index) {
+    if (!lHaveProcessCpus || getenv("ISPC_PIN_THREADS") == NULL)
+        return;
+    int n = (index + 1) % CPU_COUNT(&lProcessCpus);
+    int cpu = 0;
+    for (; cpu < CPU_SETSIZE; ++cpu)
+        if (CPU_ISSET(cpu, &lProcessCpus) && n-- == 0)
+            break;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        fprintf(stderr, "Could not pin worker %d to CPU %d\n", index, cpu);
+}
+#else
+static void lPinWorker(int index) {}
+#endif // ISPC_IS_LINUX
+#endif // ISPC_USE_PTHREADS || ISPC_USE_WORK_STEALING
+
 ///////////////////////////////////////////////////////////////////////////
 // pthreads
 
@@ -578,6 +651,7 @@ static sem_t *workerSemaphore;
 static void *lTaskEntry(void *arg) {
     int threadIndex = (int)((int64_t)arg);
     int threadCount = nThreads;
+    lPinWorker(threadIndex);
 
     while (1) {
         int err;
@@ -635,9 +709,11 @@ static void *lTaskEntry(void *arg) {
         //
         DBG(fprintf(stderr, "running task %d from group %p\n", taskNumber, tg));
         TaskInfo *myTask = tg->GetTaskInfo(taskNumber);
+        START_ACTIVITY(myTask->activity);
         myTask->func(myTask->data, threadIndex, threadCount, myTask->taskIndex, myTask->taskCount(),
                      myTask->taskIndex0(), myTask->taskIndex1(), myTask->taskIndex2(), myTask->taskCount0(),
                      myTask->taskCount1(), myTask->taskCount2());
+        FINISH_LOCAL_ACTIVITY(myTask->activity);
 
         //
         // Decrement the "number of unfinished tasks" counter in the task
@@ -835,9 +911,11 @@ inline void TaskGroup::Sync() {
         // Do work for _myTask_
         //
         // FIXME: bogus values for thread index/thread count here as well..
+        START_ACTIVITY(myTask->activity);
         myTask->func(myTask->data, 0, 1, myTask->taskIndex, myTask->taskCount(), myTask->taskIndex0(),
                      myTask->taskIndex1(), myTask->taskIndex2(), myTask->taskCount0(), myTask->taskCount1(),
                      myTask->taskCount2());
+        FINISH_LOCAL_ACTIVITY(myTask->activity);
 
         //
         // Decrement the number of unfinished tasks counter
@@ -850,6 +928,308 @@ inline void TaskGroup::Sync() {
 
 #endif // ISPC_USE_PTHREADS
 
+///////////////////////////////////////////////////////////////////////////
+// work stealing
+
+#ifdef ISPC_USE_WORK_STEALING
+
+// A contiguous range of task indices of one task group, split in halves
+// down to grain tasks
+struct WorkItem {
+    TaskGroup *tg;
+    int begin;
+    int end;
+    int grain;
+};
+
+#define LOG_DEQUE_SIZE 10
+#define DEQUE_SIZE (1 << LOG_DEQUE_SIZE)
+
+// Threads that are not workers (the main thread, or any other thread that
+// launches tasks) get one of these extra deques on their first launch.
+#define MAX_EXTERNAL_THREADS 8
+
+/* Chase-Lev deque ("Correct and Efficient Work-Stealing for Weak Memory
+   Models", Le et al. 2013).  Only the owner pushes and pops at the bottom,
+   any thread steals from the top.  Items are never more than a few
+   log2(count) deep, so the buffer is fixed and Push() fails when full.
+ */
+class WorkDeque {
+  public:
+    WorkDeque() : top(0), bottom(0) {}
+
+    bool Push(const WorkItem &item) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        if (b - t >= DEQUE_SIZE)
+            return false;
+        Slot &slot = slots[b & (DEQUE_SIZE - 1)];
+        slot.tg.store(item.tg, std::memory_order_relaxed);
+        slot.begin.store(item.begin, std::memory_order_relaxed);
+        slot.end.store(item.end, std::memory_order_relaxed);
+        slot.grain.store(item.grain, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    bool Pop(WorkItem *item) {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+
+        bool found = false;
+        if (t <= b) {
+            Read(b, item);
+            found = true;
+            if (t == b) {
+                // Last item, race the thieves for it
+                found = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+                bottom.store(b + 1, std::memory_order_relaxed);
+            }
+        } else {
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return found;
+    }
+
+    bool Steal(WorkItem *item) {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return false;
+        Read(t, item);
+        return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+  private:
+    struct Slot {
+        std::atomic<TaskGroup *> tg;
+        std::atomic<int> begin;
+        std::atomic<int> end;
+        std::atomic<int> grain;
+    };
+
+    void Read(int64_t index, WorkItem *item) {
+        Slot &slot = slots[index & (DEQUE_SIZE - 1)];
+        item->tg = slot.tg.load(std::memory_order_relaxed);
+        item->begin = slot.begin.load(std::memory_order_relaxed);
+        item->end = slot.end.load(std::memory_order_relaxed);
+        item->grain = slot.grain.load(std::memory_order_relaxed);
+    }
+
+    // top and bottom on their own cache lines, thieves hammer top
+    alignas(64) std::atomic<int64_t> top;
+    alignas(64) std::atomic<int64_t> bottom;
+    alignas(64) Slot slots[DEQUE_SIZE];
+};
+
+static volatile int32_t lock = 0;
+
+// Deques 0..nThreads-1 belong to the workers, the rest to external threads
+static int nThreads;
+static int nDeques;
+static WorkDeque *deques = NULL;
+static pthread_t *threads = NULL;
+static std::atomic<int> nExternal(0);
+static __thread int lSelf = -1;
+
+// Idle workers sleep on wakeCond until the launch epoch moves. Plain
+// pthread objects: a static std::condition_variable would block exit in its
+// destructor while the workers still wait on it.
+static pthread_mutex_t wakeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeCond = PTHREAD_COND_INITIALIZER;
+static std::atomic<uint32_t> launchEpoch(0);
+static std::atomic<int> nSleeping(0);
+
+// Rounds of failed steal attempts before a worker goes to sleep
+#define STEAL_ROUNDS 64
+
+static inline int lSelfDeque() {
+    if (lSelf < 0) {
+        int ext = nExternal.fetch_add(1);
+        if (ext >= MAX_EXTERNAL_THREADS) {
+            fprintf(stderr, "More than %d threads launch ispc tasks. Increase MAX_EXTERNAL_THREADS.\n",
+                    MAX_EXTERNAL_THREADS);
+            exit(1);
+        }
+        lSelf = nThreads + ext;
+    }
+    return lSelf;
+}
+
+static inline void lWakeWorkers() {
+    launchEpoch.fetch_add(1);
+    if (nSleeping.load() > 0) {
+        pthread_mutex_lock(&wakeMutex);
+        pthread_cond_broadcast(&wakeCond);
+        pthread_mutex_unlock(&wakeMutex);
+    }
+}
+
+static inline unsigned int lRandom(unsigned int *state) {
+    // xorshift32, only used to pick steal victims
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Pop from our own deque, else steal from every other deque once
+static bool lFindWork(int self, unsigned int *rng, WorkItem *item) {
+    if (deques[self].Pop(item))
+        return true;
+    int start = lRandom(rng) % nDeques;
+    for (int i = 0; i < nDeques; ++i) {
+        int victim = (start + i) % nDeques;
+        if (victim != self && deques[victim].Steal(item))
+            return true;
+    }
+    return false;
+}
+
+static void lRunWorkItem(int self, WorkItem item) {
+    TaskGroup *tg = item.tg;
+
+    // Keep the upper half stealable until a grain is left
+    bool split = false;
+    while (item.end - item.begin > item.grain) {
+        WorkItem upper = {tg, (item.begin + item.end) / 2, item.end, item.grain};
+        if (!deques[self].Push(upper))
+            break;
+        item.end = upper.begin;
+        split = true;
+    }
+    // Bump the epoch before looking for sleepers, as Launch does: a worker
+    // counted in nSleeping after this sees the new epoch and rescans
+    if (split)
+        lWakeWorkers();
+
+    int threadCount = nThreads + 1;
+    for (int i = item.begin; i < item.end; ++i) {
+        TaskInfo *ti = tg->GetTaskInfo(i);
+        LOCAL_ACTIVITY(ti->activity);
+        ti->func(ti->data, self < nThreads ? self : nThreads, threadCount, ti->taskIndex, ti->taskCount(),
+                 ti->taskIndex0(), ti->taskIndex1(), ti->taskIndex2(), ti->taskCount0(), ti->taskCount1(),
+                 ti->taskCount2());
+    }
+
+    // The last access to tg, Sync() may recycle it right after this
+    tg->numUnfinishedTasks.fetch_sub(item.end - item.begin, std::memory_order_release);
+}
+
+static void *lWorkerEntry(void *arg) {
+    int self = (int)((int64_t)arg);
+    lSelf = self;
+    lPinWorker(self);
+    unsigned int rng = 2654435761u * (self + 1);
+
+    while (1) {
+        uint32_t epoch = launchEpoch.load();
+        WorkItem item;
+        bool found = false;
+        for (int round = 0; round < STEAL_ROUNDS && !found; ++round)
+            found = lFindWork(self, &rng, &item);
+
+        if (found) {
+            lRunWorkItem(self, item);
+            continue;
+        }
+
+        pthread_mutex_lock(&wakeMutex);
+        nSleeping.fetch_add(1);
+        while (launchEpoch.load() == epoch)
+            pthread_cond_wait(&wakeCond, &wakeMutex);
+        nSleeping.fetch_sub(1);
+        pthread_mutex_unlock(&wakeMutex);
+    }
+
+    pthread_exit(NULL);
+    return 0;
+}
+
+static void InitTaskSystem() {
+    if (threads == NULL) {
+        while (1) {
+            if (lAtomicCompareAndSwap32(&lock, 1, 0) == 0) {
+                if (threads == NULL) {
+                    // As with ISPC_USE_PTHREADS, the launching thread
+                    // works in Sync(), so one fewer worker than cores
+                    // unless ISPC_NUM_THREADS says how many threads to use
+                    const char *env = getenv("ISPC_NUM_THREADS");
+                    nThreads = (env ? atoi(env) : sysconf(_SC_NPROCESSORS_ONLN)) - 1;
+                    nThreads = std::max(nThreads, 0);
+                    nDeques = nThreads + MAX_EXTERNAL_THREADS;
+                    // new[] only honors the 64 byte alignment from C++17
+                    void *mem = NULL;
+                    if (posix_memalign(&mem, 64, nDeques * sizeof(WorkDeque)) != 0) {
+                        fprintf(stderr, "Error allocating work deques\n");
+                        exit(1);
+                    }
+                    deques = (WorkDeque *)mem;
+                    for (int i = 0; i < nDeques; ++i)
+                        new (&deques[i]) WorkDeque;
+
+                    pthread_t *workers = (pthread_t *)malloc(nThreads * sizeof(pthread_t));
+                    for (int i = 0; i < nThreads; ++i) {
+                        int err = pthread_create(&workers[i], NULL, &lWorkerEntry, (void *)((long long)i));
+                        if (err != 0) {
+                            fprintf(stderr, "Error creating pthread %d: %s\n", i, strerror(err));
+                            exit(1);
+                        }
+                    }
+                    lMemFence();
+                    threads = workers;
+                }
+
+                lMemFence();
+                lock = 0;
+                break;
+            }
+        }
+    }
+}
+
+inline void TaskGroup::Launch(int baseIndex, int count) {
+    numUnfinishedTasks.fetch_add(count, std::memory_order_relaxed);
+
+    // About four grains per thread, enough to balance uneven rows without
+    // a deque operation per task
+    int grain = std::max(1, count / (4 * (nThreads + 1)));
+    WorkItem item = {this, baseIndex, baseIndex + count, grain};
+    int self = lSelfDeque();
+    if (!deques[self].Push(item)) {
+        // Deque full (deeply nested launches), run it right here
+        lRunWorkItem(self, item);
+        return;
+    }
+    lWakeWorkers();
+}
+
+inline void TaskGroup::Sync() {
+    int self = lSelfDeque();
+    unsigned int rng = 2654435761u * (self + 1);
+
+    int idle = 0;
+    while (numUnfinishedTasks.load(std::memory_order_acquire) > 0) {
+        // Help out with whatever is queued, our own group's tasks are most
+        // likely at the bottom of our own deque
+        WorkItem item;
+        if (lFindWork(self, &rng, &item)) {
+            lRunWorkItem(self, item);
+            idle = 0;
+        } else if (++idle >= STEAL_ROUNDS) {
+            // The rest is running elsewhere, let those threads have the core
+            sched_yield();
+        }
+    }
+}
+
+#endif // ISPC_USE_WORK_STEALING
+
 ///////////////////////////////////////////////////////////////////////////
 // OpenMP
 
@@ -870,6 +1250,7 @@ inline void TaskGroup::Launch(int baseIndex, int count) {
             TaskInfo *ti = GetTaskInfo(baseIndex + i);
 
             // Actually run the task.
+            LOCAL_ACTIVITY(ti->activity);
             ti->func(ti->data, threadIndex, threadCount, ti->taskIndex, ti->taskCount(), ti->taskIndex0(),
                      ti->taskIndex1(), ti->taskIndex2(), ti->taskCount0(), ti->taskCount1(), ti->taskCount2());
         }
@@ -1012,6 +1393,7 @@ void ISPCLaunch(void **taskGroupPtr, void *func, void *data, int count0, int cou
         ti->taskCount3d[0] = count0;
         ti->taskCount3d[1] = count1;
         ti->taskCount3d[2] = count2;
+        ti->activity = current_activity();
     }
     taskGroup->Launch(baseIndex, count);
 }
@@ -1262,3 +1644,22 @@ void *ISPCAlloc(void **taskGroupPtr, int64_t size, int32_t alignment) {
 }
 
 #endif // ISPC_USE_PTHREADS_FULLY_SUBSCRIBED
+
+///////////////////////////////////////////////////////////////////////////
+// Thread count
+
+// Threads that run the tasks, launcher included, for the host's cost model
+// and reports. 0 when the tasks follow the OpenMP thread count.
+int ISPCTaskThreads() {
+#if defined(ISPC_USE_OMP)
+    return 0;
+#elif defined(ISPC_USE_WORK_STEALING)
+    const char *env = getenv("ISPC_NUM_THREADS");
+    return std::max(env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN), 1);
+#elif defined(ISPC_USE_PTHREADS)
+    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    // not tracked for the remaining models, taken as following OpenMP
+    return 0;
+#endif
+}
@@ -0,0 +1,113 @@
+#include "cycleTimer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * Launch/sync overhead of the task system linked in, driven through the
+ * same entry points ispc generated code calls:
+ *   tasksys_bench [-n ROUNDS] [-w WORK]
+ * Every round launches COUNT tasks of WORK dependent multiply-adds each
+ * and syncs, like one stage of the cpu backend with COUNT row spans.
+ */
+extern "C" {
+void ISPCLaunch(void **handlePtr, void *f, void *data, int countx, int county, int countz);
+void *ISPCAlloc(void **handlePtr, int64_t size, int32_t alignment);
+void ISPCSync(void *handle);
+}
+
+struct bench_args {
+    int work;
+    float *out;
+};
+
+static void bench_task(void *data, int threadIndex, int threadCount, int taskIndex,
+    int taskCount, int taskIndex0, int taskIndex1, int taskIndex2,
+    int taskCount0, int taskCount1, int taskCount2)
+{
+    bench_args *args = (bench_args *)data;
+    float x = taskIndex;
+    for (int i = 0; i < args->work; i++) {
+        x = x * 0.999f + 1.0f;
+    }
+    args->out[taskIndex] = x;
+}
+
+static void count_task(void *data, int threadIndex, int threadCount, int taskIndex,
+    int taskCount, int taskIndex0, int taskIndex1, int taskIndex2,
+    int taskCount0, int taskCount1, int taskCount2)
+{
+    __sync_fetch_and_add(&((int *)data)[taskIndex], 1);
+}
+
+/* every task of a launch runs exactly once before Sync() returns */
+static bool check_launch(int count)
+{
+    int *hits = new int[count]();
+    void *handle = NULL;
+    ISPCLaunch(&handle, (void *)count_task, hits, count, 1, 1);
+    ISPCSync(handle);
+    bool ok = true;
+    for (int i = 0; i < count && ok; i++) {
+        if (hits[i] != 1) {
+            fprintf(stderr, "task %d of %d ran %d times\n", i, count, hits[i]);
+            ok = false;
+        }
+    }
+    delete [] hits;
+    return ok;
+}
+
+/* seconds per launch + sync of count tasks, the best of 5 batches */
+static double time_launch(int count, int work, int rounds, float *out)
+{
+    double best = 1e30;
+    for (int batch = 0; batch < 5; batch++) {
+        double start = CycleTimer::currentSeconds();
+        for (int r = 0; r < rounds; r++) {
+            void *handle = NULL;
+            bench_args *args = (bench_args *)ISPCAlloc(&handle, sizeof(bench_args), 32);
+            args->work = work;
+            args->out = out;
+            ISPCLaunch(&handle, (void *)bench_task, args, count, 1, 1);
+            ISPCSync(handle);
+        }
+        double t = (CycleTimer::currentSeconds() - start) / rounds;
+        if (t < best) best = t;
+    }
+    return best;
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = 200;
+    int work = 0;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-n") == 0) {
+            rounds = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "-w") == 0) {
+            work = atoi(argv[i + 1]);
+        }
+    }
+
+    /* 2160 is one task per row of a 4K frame, the --span 1 case */
+    static const int counts[] = { 1, 16, 256, 2160, 8640 };
+    float *out = new float[8640];
+
+    /* also starts the workers outside the timed region */
+    for (unsigned int i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        if (!check_launch(counts[i])) {
+            return 1;
+        }
+    }
+
+    printf("%8s %14s %12s\n", "tasks", "us/launch", "ns/task");
+    for (unsigned int i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        double t = time_launch(counts[i], work, rounds, out);
+        printf("%8d %14.2f %12.1f\n", counts[i], t * 1e6, t * 1e9 / counts[i]);
+    }
+
+    delete [] out;
+    return 0;
+}
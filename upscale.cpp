@@ -1,9 +1,16 @@
 #include "lodepng.h"
+#include "png_parallel.h"
+#include "image_write.h"
 #include "cycleTimer.h"
 #include "instrument.h"
+#include "placement.h"
+#include "plane_alloc.h"
+#include "frame_stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <getopt.h>
 
 #include "anime4k.h"
@@ -12,37 +19,125 @@
 #include "anime4k_cpu.h"
 #include "anime4k_omp.h"
 #include "anime4k_ispc.h"
+#include "anime4k_tile.h"
+#include "anime4k_stream.h"
+#include "anime4k_fixed.h"
+#include "video.h"
 
 static void usage(char *name) {
-    const char *use_string = "-i IFILE [-o OFILE] [-b IMP] [-n TIMES] [-W WIDTH] [-H HEIGHT] [-I]";
+    const char *use_string = "-i IFILE [-o OFILE] [-b IMP] [-n TIMES] [-W WIDTH] [-H HEIGHT] [-t TILE] [-d] [-f FORMAT] [-c] [-I [TRACE.json]] [--png-speed SPEED] [--span SPAN] [--pin] [--huge-pages MODE] [--row-pad BYTES] [--counters] [--warmup N] [--stats FILE]";
     printf("Usage: %s %s\n", name, use_string);
     printf("   -h        Print this message\n");
     printf("   -i IFILE  Input image file\n");
-    printf("   -o OFILE  Output image file\n");
-    printf("   -b IMP    Backend implementation\n");
+    printf("   -o OFILE  Output image file, .png or by extension .ppm, .pam,\n");
+    printf("             .rgba, .rgb or .qoi\n");
+    printf("   -b IMP    Backend implementation, ispc and cpu take an\n");
+    printf("             optional ISPC target, e.g. ispc:avx512skx\n");
     printf("   -n TIMES  Number of benchmark rounds\n");
     printf("   -W WIDTH  Width of the output\n");
     printf("   -H HEIGHT Height of the output\n");
-    printf("   -I        Instrument\n");
+    printf("   -t TILE   Tile size of the tile backend (WxH or N)\n");
+    printf("   -d        Tile backend only recomputes tiles whose input changed\n");
+    printf("             since the previous frame\n");
+    printf("   -f FORMAT Stream video frames instead of a PNG: rgba:WxH or y4m,\n");
+    printf("             - as IFILE/OFILE is stdin/stdout\n");
+    printf("   -c        Report the error against the seq backend\n");
+    printf("   -I [TRACE.json]\n");
+    printf("             Instrument, and save a Chrome trace of every stage on\n");
+    printf("             every thread to TRACE.json (chrome://tracing, Perfetto)\n");
+    printf("   --png-speed SPEED\n");
+    printf("             PNG encoder effort: default, fast, huffman or stored\n");
+    printf("   --span SPAN\n");
+    printf("             Rows per ISPC task of the cpu backend, N for every stage\n");
+    printf("             or LINEAR,THINLINES,GRADIENT,REFINE; 0 keeps the\n");
+    printf("             automatic choice for that stage\n");
+    printf("   --pin     Pin the OpenMP threads and the ispc task workers to\n");
+    printf("             one CPU each\n");
+    printf("   --huge-pages MODE\n");
+    printf("             Back the planes with off, thp (default) or explicit\n");
+    printf("             (MAP_HUGETLB, thp when the pool is empty) huge pages\n");
+    printf("   --row-pad BYTES\n");
+    printf("             Extra bytes per padded plane row of the omp, wave, ispc,\n");
+    printf("             cpu and fixed backends\n");
+    printf("   --counters\n");
+    printf("             With -I, also report cycles, instructions, LLC and branch\n");
+    printf("             misses, page faults and DRAM bandwidth per stage\n");
+    printf("   --warmup N\n");
+    printf("             Untimed rounds before the -n benchmark rounds, default 1\n");
+    printf("   --stats FILE\n");
+    printf("             Save the time of every round, of the frame and of each\n");
+    printf("             stage with -I, and min/median/p90/p99/max/mean/stddev\n");
+    printf("             as FILE.csv or FILE.json\n");
     exit(0);
 }
 
+/* max/mean absolute error and PSNR of the color channels against ref */
+static void report_error(FILE *f, unsigned char *image, unsigned char *ref,
+    unsigned int width, unsigned int height) {
+    unsigned int max = 0;
+    unsigned long sum = 0, sum2 = 0, differ = 0;
+    unsigned long n = (unsigned long)width * height * 3;
+    for (unsigned long i = 0; i < (unsigned long)width * height; i++) {
+        for (int c = 0; c < 3; c++) {
+            int d = abs((int)image[4 * i + c] - (int)ref[4 * i + c]);
+            if ((unsigned int)d > max) max = d;
+            sum += d;
+            sum2 += d * d;
+            differ += d != 0;
+        }
+    }
+    double mse = (double)sum2 / n;
+    fprintf(f, "Error vs seq: max %u, mean %.4f, %.2f%% differ, PSNR ",
+        max, (double)sum / n, 100.0 * differ / n);
+    if (mse > 0) {
+        fprintf(f, "%.2f dB\n", 10 * log10(255.0 * 255.0 / mse));
+    } else {
+        fprintf(f, "inf\n");
+    }
+}
 
 int main(int argc, char *argv[]) {
     char *ifile = NULL;
     char *ofile = NULL;
     const char *backend = "cuda";
+    const char *target = "auto";
+    const char *format = NULL;
+    char *colon;
+    int n;
     int times = 100;
     unsigned int width = 3840;
     unsigned int height = 2160;
+    unsigned int tile_width = 64;
+    unsigned int tile_height = 32;
     unsigned int error;
     unsigned char* image = 0;
     unsigned int old_width, old_height;
     bool instrument = false;
+    const char *trace = NULL;
+    bool counters = false;
+    int warmup = 1;
+    const char *stats = NULL;
+    bool compare = false;
+    bool delta = false;
+    png_speed speed = PNG_SPEED_DEFAULT;
+    task_spans spans = { 0, 0, 0, 0 };
+    bool pin = false;
+    plane_config planes = { HUGE_PAGES_THP, 0, true };
 
-    const char *optstring = "hi:o:b:n:W:H:I";
+    const char *optstring = "hi:o:b:n:W:H:t:df:cI::";
+    static const struct option longopts[] = {
+        {"png-speed", required_argument, NULL, 'P'},
+        {"span", required_argument, NULL, 'S'},
+        {"pin", no_argument, NULL, 'A'},
+        {"huge-pages", required_argument, NULL, 'G'},
+        {"row-pad", required_argument, NULL, 'R'},
+        {"counters", no_argument, NULL, 'C'},
+        {"warmup", required_argument, NULL, 'U'},
+        {"stats", required_argument, NULL, 'T'},
+        {NULL, 0, NULL, 0}
+    };
     int c;
-    while ((c = getopt(argc, argv, optstring)) != -1) {
+    while ((c = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
         switch(c) {
         case 'h':
             usage(argv[0]);
@@ -54,7 +149,12 @@ int main(int argc, char *argv[]) {
             ofile = optarg;
             break;
         case 'b':
+            /* "ispc:avx2" selects one ISPC target instead of the dispatcher */
             backend = optarg;
+            if ((colon = strchr(optarg, ':')) != NULL) {
+                *colon = '\0';
+                target = colon + 1;
+            }
             break;
         case 'n':
             times = atoi(optarg);
@@ -65,8 +165,70 @@ int main(int argc, char *argv[]) {
         case 'H':
             height = atoi(optarg);
             break;
+        case 't':
+            if (sscanf(optarg, "%ux%u", &tile_width, &tile_height) == 1) {
+                tile_height = tile_width;
+            }
+            if (tile_width == 0 || tile_height == 0) {
+                printf("Invalid tile size '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'd':
+            delta = true;
+            break;
+        case 'f':
+            format = optarg;
+            break;
+        case 'c':
+            compare = true;
+            break;
         case 'I':
             instrument = true;
+            /* the trace file as -Ifile, or as a separate -I file.json */
+            if (optarg) {
+                trace = optarg;
+            } else if (optind < argc && argv[optind][0] != '-' &&
+                strstr(argv[optind], ".json") != NULL) {
+                trace = argv[optind++];
+            }
+            break;
+        case 'P':
+            if (!png_speed_parse(optarg, &speed)) {
+                printf("Unknown PNG speed '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'S':
+            n = sscanf(optarg, "%u,%u,%u,%u", &spans.linear, &spans.thinlines,
+                &spans.gradient, &spans.refine);
+            if (n == 1) {
+                spans.thinlines = spans.gradient = spans.refine = spans.linear;
+            } else if (n != 4) {
+                printf("Invalid span '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'A':
+            pin = true;
+            break;
+        case 'G':
+            if (!huge_pages_parse(optarg, &planes.huge)) {
+                printf("Unknown huge page mode '%s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'R':
+            planes.row_pad = atoi(optarg);
+            break;
+        case 'C':
+            counters = true;
+            break;
+        case 'U':
+            warmup = atoi(optarg);
+            break;
+        case 'T':
+            stats = optarg;
             break;
         default:
             printf("Unknown option '%c'\n", c);
@@ -81,47 +243,183 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    error = lodepng_decode32_file(&image, &old_width, &old_height, ifile);
-    if (error) {
-        printf("error %u: %s\n", error, lodepng_error_text(error));
+    /* in video mode the frames are handed to the upscaler as they arrive */
+    video_stream stream;
+    FILE *video_out = stdout;
+    if (format) {
+        FILE *video_in = strcmp(ifile, "-")==0 ? stdin : fopen(ifile, "rb");
+        if (!video_in || !video_open(&stream, video_in, format)) {
+            fprintf(stderr, "Cannot read %s as %s video\n", ifile, format);
+            exit(1);
+        }
+        if (ofile && strcmp(ofile, "-")!=0 && !(video_out = fopen(ofile, "wb"))) {
+            fprintf(stderr, "Cannot open %s\n", ofile);
+            exit(1);
+        }
+        old_width = stream.width;
+        old_height = stream.height;
+    } else {
+        error = lodepng_decode32_file(&image, &old_width, &old_height, ifile);
+        if (error) {
+            printf("error %u: %s\n", error, lodepng_error_text(error));
+            exit(1);
+        }
+    }
+
+    if ((strcasecmp(backend, "cpu")==0 && !Anime4kCpu::has_target(target)) ||
+        (strcasecmp(backend, "ispc")==0 && !Anime4kIspc::has_target(target))) {
+        printf("ISPC target %s is not available\n", target);
+        exit(1);
+    }
+
+    if (delta && strcasecmp(backend, "tile")!=0) {
+        printf("-d needs the tile backend\n");
         exit(1);
     }
 
+    /* before the backends first-touch their planes from the pinned threads */
+    if (pin) {
+        if (!pin_omp_threads()) {
+            fprintf(stderr, "Could not pin the OpenMP threads\n");
+        }
+        setenv("ISPC_PIN_THREADS", "1", 1);
+    }
+    plane_configure(planes);
+
     Anime4k* upscaler;
+    Anime4kTile* tile = NULL;
+    Anime4kCpu* cpu = NULL;
+    Anime4kOmp* omp = NULL;
     if (strcasecmp(backend, "seq")==0) {
         upscaler = new Anime4kSeq(old_width, old_height, image, width, height);
     } else if (strcasecmp(backend, "cuda")==0) {
         upscaler = new Anime4kCuda(old_width, old_height, image, width, height);
     } else if (strcasecmp(backend, "cpu")==0) {
-        upscaler = new Anime4kCpu(old_width, old_height, image, width, height);
+        upscaler = cpu = new Anime4kCpu(old_width, old_height, image, width, height,
+            target);
+        cpu->set_spans(spans);
     } else if (strcasecmp(backend, "omp")==0) {
-        upscaler = new Anime4kOmp(old_width, old_height, image, width, height);
+        upscaler = omp = new Anime4kOmp(old_width, old_height, image, width, height);
+    } else if (strcasecmp(backend, "wave")==0) {
+        /* the omp backend with the stages as a dataflow of row bands */
+        upscaler = omp = new Anime4kOmp(old_width, old_height, image, width, height);
+        omp->set_wavefront(true);
     } else if (strcasecmp(backend, "ispc")==0) {
-        upscaler = new Anime4kIspc(old_width, old_height, image, width, height);
+        upscaler = new Anime4kIspc(old_width, old_height, image, width, height,
+            target);
+    } else if (strcasecmp(backend, "tile")==0) {
+        upscaler = tile = new Anime4kTile(old_width, old_height, image, width, height,
+            tile_width, tile_height);
+        tile->set_delta(delta, instrument ? stderr : NULL);
+    } else if (strcasecmp(backend, "stream")==0) {
+        upscaler = new Anime4kStream(old_width, old_height, image, width, height);
+    } else if (strcasecmp(backend, "fixed")==0) {
+        upscaler = new Anime4kFixed(old_width, old_height, image, width, height);
     } else {
         printf("%s backend is not implemented\n", backend);
         exit(1);
     }
 
+    int scale = integer_scale(old_width, old_height, width, height);
+    if (instrument && scale &&
+        (strcasecmp(backend, "omp")==0 || strcasecmp(backend, "wave")==0 ||
+         strcasecmp(backend, "ispc")==0)) {
+        fprintf(stderr, "Using the %dx integer-scale linear_upscale\n", scale);
+    }
+
+    if (instrument && cpu) {
+        const task_spans &s = cpu->get_spans();
+        fprintf(stderr, "Rows per task: linear %u, thin_lines %u, gradient %u, refine %u\n",
+            s.linear, s.thinlines, s.gradient, s.refine);
+    }
+
+    /* the first rounds fault in the planes and start the thread pools */
+    if (!format) {
+        for (int i = 0; i < warmup; i++) {
+            upscaler->run();
+        }
+    }
+
+    name_thread("main");
+    trace_activity(trace != NULL);
+    count_activity(instrument && counters);
     track_activity(instrument);
+    frame_times frames;
     double startTime = CycleTimer::currentSeconds();
 
-    for (int i = 0; i < times; i++) {
-        upscaler->run();
+    if (format) {
+        times = video_upscale(upscaler, &stream, video_out, width, height);
+    } else {
+        double before[ACTIVITY_COUNT], after[ACTIVITY_COUNT];
+        activity_seconds(before);
+        for (int i = 0; i < times; i++) {
+            double frameStart = CycleTimer::currentSeconds();
+            upscaler->run();
+            double frameTime = CycleTimer::currentSeconds() - frameStart;
+            activity_seconds(after);
+            frame_times_add(&frames, frameTime, before, after);
+            memcpy(before, after, sizeof(before));
+        }
     }
 
     double endTime = CycleTimer::currentSeconds();
     double totalTime = endTime - startTime;
 
     SHOW_ACTIVITY(stderr, instrument);
+    if (trace && write_trace(trace)) {
+        fprintf(stderr, "Trace saved to %s\n", trace);
+    }
+    report_frame_times(stderr, frames, instrument);
+    if (stats && !frames.frame.empty() && write_frame_times(stats, frames, warmup)) {
+        fprintf(stderr, "Round times saved to %s\n", stats);
+    }
     fprintf(stderr, "Upscaled %d frames in %.4f s (%.4f fps)\n",
         times, totalTime, times / totalTime);
+    if (delta) {
+        tile->report_delta(stderr);
+    }
+    if (instrument) {
+        plane_report(stderr);
+    }
+    if (instrument && omp) {
+        omp->report_placement(stderr);
+    }
 
-    if (ofile) {
-        error = lodepng_encode32_file(ofile, upscaler->get_image(), width, height);
+    if (format) {
+        if (stream.file != stdin) {
+            fclose(stream.file);
+        }
+        if (video_out != stdout) {
+            fclose(video_out);
+        }
+    } else if (compare) {
+        Anime4kSeq reference(old_width, old_height, image, width, height);
+        reference.run();
+        report_error(stderr, upscaler->get_image(), reference.get_image(),
+            width, height);
+    }
+
+    if (ofile && !format) {
+        image_format oformat = image_format_from_name(ofile);
+        double encodeStart = CycleTimer::currentSeconds();
+        if (oformat == IMAGE_PNG) {
+            LodePNGEncoderSettings settings;
+            png_speed_settings(&settings, speed);
+            error = png_encode32_file_parallel(ofile, upscaler->get_image(),
+                width, height, &settings);
+        } else {
+            /* lodepng's "failed to open file for writing" */
+            error = image_write_file(ofile, oformat, upscaler->get_image(),
+                width, height) ? 0 : 79;
+        }
+        double encodeTime = CycleTimer::currentSeconds() - encodeStart;
         if (error) {
             printf("error %u: %s\n", error, lodepng_error_text(error));
-        }   
+        } else {
+            fprintf(stderr, "Encoded %s in %.4f s (%.1f MB/s, %s)\n", ofile,
+                encodeTime, 4.0 * width * height / encodeTime / 1e6,
+                oformat == IMAGE_PNG ? png_speed_name(speed) : strrchr(ofile, '.') + 1);
+        }
     }
 
     delete upscaler;
@@ -0,0 +1,314 @@
+#include "video.h"
+#include "instrument.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+/* blocking FIFO of frame buffers, pop() fails once closed and drained */
+class frame_queue {
+private:
+    std::deque<unsigned char *> frames_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool closed_;
+public:
+    frame_queue() : closed_(false) {}
+
+    void push(unsigned char *frame)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        frames_.push_back(frame);
+        cond_.notify_one();
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        cond_.notify_all();
+    }
+
+    bool pop(unsigned char **frame)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (frames_.empty() && !closed_) {
+            cond_.wait(lock);
+        }
+        if (frames_.empty()) {
+            return false;
+        }
+        *frame = frames_.front();
+        frames_.pop_front();
+        return true;
+    }
+};
+
+bool video_open(video_stream *v, FILE *file, const char *format)
+{
+    v->file = file;
+    v->chroma = CHROMA_420;
+    v->params[0] = '\0';
+
+    if (strncasecmp(format, "rgba:", 5) == 0) {
+        v->container = VIDEO_RGBA;
+        return sscanf(format + 5, "%ux%u", &v->width, &v->height) == 2 &&
+            v->width > 0 && v->height > 0;
+    }
+
+    if (strcasecmp(format, "y4m") != 0) {
+        return false;
+    }
+    v->container = VIDEO_Y4M;
+
+    char header[1024];
+    if (!fgets(header, sizeof(header), file) ||
+        strncmp(header, "YUV4MPEG2 ", 10) != 0) {
+        return false;
+    }
+
+    /* keep every parameter but the frame size for the output header */
+    v->width = v->height = 0;
+    size_t used = 0;
+    for (char *tok = strtok(header + 10, " \n"); tok; tok = strtok(NULL, " \n")) {
+        if (tok[0] == 'W') {
+            v->width = atoi(tok + 1);
+            continue;
+        } else if (tok[0] == 'H') {
+            v->height = atoi(tok + 1);
+            continue;
+        } else if (tok[0] == 'C') {
+            if (strncmp(tok, "C420", 4) == 0) {
+                v->chroma = CHROMA_420;
+            } else if (strcmp(tok, "C444") == 0) {
+                v->chroma = CHROMA_444;
+            } else if (strcmp(tok, "Cmono") == 0) {
+                v->chroma = CHROMA_MONO;
+            } else {
+                fprintf(stderr, "Unsupported Y4M colorspace %s\n", tok);
+                return false;
+            }
+        }
+        if (used + strlen(tok) + 2 > sizeof(v->params)) {
+            return false;
+        }
+        used += sprintf(v->params + used, " %s", tok);
+    }
+
+    return v->width > 0 && v->height > 0;
+}
+
+/* bytes of one Y4M frame without the FRAME line */
+static size_t yuv_size(video_chroma chroma, unsigned int width, unsigned int height)
+{
+    size_t luma = (size_t)width * height;
+    if (chroma == CHROMA_MONO) {
+        return luma;
+    } else if (chroma == CHROMA_444) {
+        return 3 * luma;
+    }
+    return luma + 2 * (size_t)((width + 1) / 2) * ((height + 1) / 2);
+}
+
+static inline unsigned char clip(int x)
+{
+    return x < 0 ? 0 : (x > 255 ? 255 : x);
+}
+
+/* BT.601 limited range, 8 fractional bits */
+static void yuv_to_rgba(video_chroma chroma, unsigned int width, unsigned int height,
+    const unsigned char *yuv, unsigned char *rgba)
+{
+    unsigned int cw = chroma == CHROMA_420 ? (width + 1) / 2 : width;
+    unsigned int ch = chroma == CHROMA_420 ? (height + 1) / 2 : height;
+    const unsigned char *u_plane = yuv + (size_t)width * height;
+    const unsigned char *v_plane = u_plane + (size_t)cw * ch;
+    int shift = chroma == CHROMA_420 ? 1 : 0;
+
+    for (unsigned int i = 0; i < height; i++) {
+        for (unsigned int j = 0; j < width; j++) {
+            int c = 298 * (yuv[i * width + j] - 16) + 128;
+            int d = 0, e = 0;
+            if (chroma != CHROMA_MONO) {
+                size_t cix = (size_t)(i >> shift) * cw + (j >> shift);
+                d = u_plane[cix] - 128;
+                e = v_plane[cix] - 128;
+            }
+
+            unsigned char *p = rgba + 4 * ((size_t)i * width + j);
+            p[0] = clip((c + 409 * e) >> 8);
+            p[1] = clip((c - 100 * d - 208 * e) >> 8);
+            p[2] = clip((c + 516 * d) >> 8);
+            p[3] = 255;
+        }
+    }
+}
+
+static void rgba_to_yuv(video_chroma chroma, unsigned int width, unsigned int height,
+    const unsigned char *rgba, unsigned char *yuv)
+{
+    for (size_t ix = 0; ix < (size_t)width * height; ix++) {
+        const unsigned char *p = rgba + 4 * ix;
+        yuv[ix] = ((66 * p[0] + 129 * p[1] + 25 * p[2] + 128) >> 8) + 16;
+    }
+
+    if (chroma == CHROMA_MONO) {
+        return;
+    }
+
+    /* 4:2:0 chroma is taken from the mean color of each 2x2 block */
+    int step = chroma == CHROMA_420 ? 2 : 1;
+    unsigned int cw = (width + step - 1) / step;
+    unsigned int ch = (height + step - 1) / step;
+    unsigned char *u_plane = yuv + (size_t)width * height;
+    unsigned char *v_plane = u_plane + (size_t)cw * ch;
+
+    for (unsigned int ci = 0; ci < ch; ci++) {
+        for (unsigned int cj = 0; cj < cw; cj++) {
+            int r = 0, g = 0, b = 0, n = 0;
+            for (unsigned int i = ci * step; i < ci * step + step && i < height; i++) {
+                for (unsigned int j = cj * step; j < cj * step + step && j < width; j++) {
+                    const unsigned char *p = rgba + 4 * ((size_t)i * width + j);
+                    r += p[0];
+                    g += p[1];
+                    b += p[2];
+                    n++;
+                }
+            }
+            r = (r + n / 2) / n;
+            g = (g + n / 2) / n;
+            b = (b + n / 2) / n;
+
+            size_t cix = (size_t)ci * cw + cj;
+            u_plane[cix] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+            v_plane[cix] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+        }
+    }
+}
+
+/* read one frame into rgba, false at the end of the stream */
+static bool read_frame(video_stream *v, unsigned char *yuv, unsigned char *rgba)
+{
+    size_t bytes;
+    size_t got;
+
+    if (v->container == VIDEO_RGBA) {
+        bytes = 4 * (size_t)v->width * v->height;
+        got = fread(rgba, 1, bytes, v->file);
+    } else {
+        char line[256];
+        if (!fgets(line, sizeof(line), v->file)) {
+            return false;
+        }
+        if (strncmp(line, "FRAME", 5) != 0) {
+            fprintf(stderr, "Malformed Y4M frame header\n");
+            return false;
+        }
+        bytes = yuv_size(v->chroma, v->width, v->height);
+        got = fread(yuv, 1, bytes, v->file);
+        if (got == bytes) {
+            yuv_to_rgba(v->chroma, v->width, v->height, yuv, rgba);
+        }
+    }
+
+    if (got != 0 && got != bytes) {
+        fprintf(stderr, "Truncated frame, %zu of %zu bytes\n", got, bytes);
+    }
+    return got == bytes;
+}
+
+static bool write_frame(video_stream *v, FILE *out, unsigned int width,
+    unsigned int height, unsigned char *yuv, const unsigned char *rgba)
+{
+    if (v->container == VIDEO_RGBA) {
+        size_t bytes = 4 * (size_t)width * height;
+        return fwrite(rgba, 1, bytes, out) == bytes;
+    }
+
+    size_t bytes = yuv_size(v->chroma, width, height);
+    rgba_to_yuv(v->chroma, width, height, rgba, yuv);
+    return fputs("FRAME\n", out) >= 0 && fwrite(yuv, 1, bytes, out) == bytes;
+}
+
+int video_upscale(Anime4k *upscaler, video_stream *in, FILE *out,
+    unsigned int width, unsigned int height, int depth)
+{
+    size_t in_bytes = 4 * (size_t)in->width * in->height;
+    size_t out_bytes = 4 * (size_t)width * height;
+
+    if (in->container == VIDEO_Y4M) {
+        fprintf(out, "YUV4MPEG2 W%u H%u%s\n", width, height, in->params);
+    }
+
+    /* frames cycle free -> full -> free between two threads each */
+    frame_queue in_free, in_full, out_free, out_full;
+    unsigned char *frames = new unsigned char[depth * (in_bytes + out_bytes)];
+    for (int k = 0; k < depth; k++) {
+        in_free.push(frames + k * in_bytes);
+        out_free.push(frames + depth * in_bytes + k * out_bytes);
+    }
+
+    std::thread reader([&]() {
+        unsigned char *yuv = new unsigned char[yuv_size(in->chroma,
+            in->width, in->height)];
+        unsigned char *frame;
+        name_thread("video reader");
+        while (in_free.pop(&frame)) {
+            START_ACTIVITY(ACTIVITY_READ);
+            bool ok = read_frame(in, yuv, frame);
+            FINISH_LOCAL_ACTIVITY(ACTIVITY_READ);
+            if (!ok) {
+                break;
+            }
+            in_full.push(frame);
+        }
+        in_full.close();
+        delete [] yuv;
+    });
+
+    std::thread writer([&]() {
+        unsigned char *yuv = new unsigned char[yuv_size(in->chroma,
+            width, height)];
+        unsigned char *frame;
+        bool ok = true;
+        name_thread("video writer");
+        while (out_full.pop(&frame)) {
+            /* keep draining after an error so upscaling never blocks */
+            START_ACTIVITY(ACTIVITY_WRITE);
+            if (ok && !write_frame(in, out, width, height, yuv, frame)) {
+                fprintf(stderr, "Failed to write frame\n");
+                ok = false;
+            }
+            FINISH_LOCAL_ACTIVITY(ACTIVITY_WRITE);
+            out_free.push(frame);
+        }
+        fflush(out);
+        delete [] yuv;
+    });
+
+    int count = 0;
+    unsigned char *src, *dst = NULL;
+    while (in_full.pop(&src)) {
+        upscaler->reconfigure(in->width, in->height, src, width, height);
+        upscaler->run();
+        in_free.push(src);
+
+        out_free.pop(&dst);
+        memcpy(dst, upscaler->get_image(), out_bytes);
+        out_full.push(dst);
+        count++;
+    }
+    out_full.close();
+    /* the reader may still wait for a free frame after a read error */
+    in_free.close();
+
+    reader.join();
+    writer.join();
+    delete [] frames;
+
+    return count;
+}
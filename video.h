@@ -0,0 +1,52 @@
+#ifndef VIDEO_H_
+#define VIDEO_H_
+
+#include "anime4k.h"
+
+#include <stdio.h>
+
+/*
+ * Raw video streams, compatible with ffmpeg on both ends:
+ *   ffmpeg -i in.mkv -f rawvideo -pix_fmt rgba - |
+ *       upscale -f rgba:1920x1080 -i - -o - |
+ *       ffmpeg -f rawvideo -pix_fmt rgba -s 3840x2160 -i - out.mkv
+ * or with -f yuv4mpegpipe on both sides and -f y4m. Y4M frames are
+ * converted from and to RGBA with BT.601 limited range coefficients.
+ */
+
+enum video_container {
+    VIDEO_RGBA,
+    VIDEO_Y4M
+};
+
+enum video_chroma {
+    CHROMA_420,
+    CHROMA_444,
+    CHROMA_MONO
+};
+
+struct video_stream {
+    FILE *file;
+    video_container container;
+    unsigned int width;
+    unsigned int height;
+    /* Y4M only */
+    video_chroma chroma;
+    char params[256];
+};
+
+/*
+ * Open a stream described by format, "rgba:WxH" or "y4m"; for Y4M the
+ * stream header is read here. Returns false on a malformed format or header.
+ */
+bool video_open(video_stream *v, FILE *file, const char *format);
+
+/*
+ * Upscale every frame of in to out with width x height frames in the same
+ * container. Reading, upscaling and writing run on separate threads with
+ * 'depth' frames in flight per direction. Returns the frame count.
+ */
+int video_upscale(Anime4k *upscaler, video_stream *in, FILE *out,
+    unsigned int width, unsigned int height, int depth = 3);
+
+#endif /* VIDEO_H_ */